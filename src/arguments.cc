@@ -10,7 +10,7 @@ void Arguments::printUsage(const char* progName) {
     std::cout << "Usage: " << progName << " [OPTIONS] [input files]\n\n"
               << "JIT-compiling interpreter for brainfuck\n\n"
               << "Options:\n"
-              << "  -m, --mem-size SIZE        Number of memory cells (default: 32768)\n"
+              << "  -m, --mem-size SIZE        Number of memory cells, or auto for the smallest power of 2 the program needs (default: 32768)\n"
               << "  -w, --cell-bit-width BITS  Width of cell in bits (8, 16, or 32, default: 8)\n"
               << "  -0, --no-optimize          Don't optimize the IR\n"
               << "  -d, --dump-code            Dump the generated machine code\n"
@@ -20,6 +20,20 @@ void Arguments::printUsage(const char* progName) {
               << "  -g, --gen-syms             Generate jit symbol maps for debugging purposes\n"
               << "  -n, --no-flush             Don't flush after each character\n"
               << "      --use-interpreter      Don't jit the IR, just interpret it\n"
+              << "      --lazy-jit             Only compile top level loops when they are first entered\n"
+              << "      --huge-pages           Back the memory array with transparent huge pages\n"
+              << "      --fork-server JOBFILE  Run up to the first input once, then fork for each \"INPUT OUTPUT\" line of JOBFILE\n"
+              << "      --emit-elf OUT         Write a standalone executable to OUT instead of running\n"
+              << "      --profile-generate FILE  Run in the interpreter and write a loop profile to FILE\n"
+              << "      --profile-use FILE     Use a profile from --profile-generate to guide code generation\n"
+              << "      --sample-profile       Sample where the jit code spends its time and report it on stderr at exit\n"
+              << "      --stream               Run each part of the source outside of loops as soon as it has been read\n"
+              << "      --fuel N               Stop the program after about N loop iterations\n"
+              << "      --time-limit SECONDS   Stop the program after SECONDS of wall clock time\n"
+              << "      --serve PORT           Run a session of the program for each connection to PORT on localhost\n"
+              << "      --async-output         Write output from a separate thread, so a slow reader doesn't stall the program\n"
+              << "      --splice-output        Like --async-output, but vmsplice full buffers into stdout if it is a pipe\n"
+              << "      --batch                Run the program once per line of stdin, with the line as its input, many lines at a time in SIMD lanes\n"
               << "  -v, --verbose              Print more information\n"
               << "  -h, --help                 Print this help message\n";
 }
@@ -39,6 +53,20 @@ Arguments::Arguments(int argc, char *argv[]) :
         {"gen-syms", no_argument, 0, 'g'},
         {"no-flush", no_argument, 0, 'n'},
         {"use-interpreter", no_argument, 0, 1003},
+        {"lazy-jit", no_argument, 0, 1004},
+        {"huge-pages", no_argument, 0, 1005},
+        {"fork-server", required_argument, 0, 1006},
+        {"emit-elf", required_argument, 0, 1007},
+        {"profile-generate", required_argument, 0, 1008},
+        {"profile-use", required_argument, 0, 1009},
+        {"sample-profile", no_argument, 0, 1010},
+        {"stream", no_argument, 0, 1011},
+        {"fuel", required_argument, 0, 1012},
+        {"time-limit", required_argument, 0, 1013},
+        {"serve", required_argument, 0, 1014},
+        {"async-output", no_argument, 0, 1015},
+        {"splice-output", no_argument, 0, 1016},
+        {"batch", no_argument, 0, 1017},
         {"verbose", no_argument, 0, 'v'},
         {"help", no_argument, 0, 'h'},
         {"no-optimize", no_argument, 0, '0'},
@@ -51,6 +79,12 @@ Arguments::Arguments(int argc, char *argv[]) :
     while ((c = getopt_long(argc, argv, "m:w:de:gnvh0", long_options, &option_index)) != -1) {
         switch (c) {
             case 'm':
+                if (strcmp(optarg, "auto") == 0) {
+                    autoMemSize = true;
+                    bfMemLength = 32768;
+                    break;
+                }
+                autoMemSize = false;
                 bfMemLength = std::strtoul(optarg, nullptr, 10);
                 if (bfMemLength == 0 || bfMemLength > 1024 * 1024 * 1024) {
                     std::cerr << "Invalid memory length, max support is 1GB\n";
@@ -99,6 +133,61 @@ Arguments::Arguments(int argc, char *argv[]) :
             case 1003: // --use-interpreter
                 useInterpreter = true;
                 break;
+            case 1004: // --lazy-jit
+                lazyJit = true;
+                break;
+            case 1005: // --huge-pages
+                hugePages = true;
+                break;
+            case 1006: // --fork-server
+                forkServerJobs = optarg;
+                break;
+            case 1007: // --emit-elf
+                emitElf = optarg;
+                break;
+            case 1008: // --profile-generate
+                profileGenerate = optarg;
+                break;
+            case 1009: // --profile-use
+                profileUse = optarg;
+                break;
+            case 1010: // --sample-profile
+                sampleProfile = true;
+                break;
+            case 1011: // --stream
+                stream = true;
+                break;
+            case 1012: // --fuel
+                fuel = std::strtoull(optarg, nullptr, 10);
+                if (fuel == 0) {
+                    std::cerr << "Error: Invalid fuel, must be a positive number of loop iterations\n";
+                    exit(1);
+                }
+                break;
+            case 1013: // --time-limit
+                timeLimit = std::strtod(optarg, nullptr);
+                if (!(timeLimit > 0)) {
+                    std::cerr << "Error: Invalid time limit, must be a positive number of seconds\n";
+                    exit(1);
+                }
+                break;
+            case 1014: // --serve
+                servePort = std::atoi(optarg);
+                if (servePort <= 0 || servePort > 65535) {
+                    std::cerr << "Error: Invalid port\n";
+                    exit(1);
+                }
+                break;
+            case 1015: // --async-output
+                asyncOutput = true;
+                break;
+            case 1016: // --splice-output
+                asyncOutput = true;
+                spliceOutput = true;
+                break;
+            case 1017: // --batch
+                batch = true;
+                break;
             case 'v':
                 verbose = true;
                 break;
@@ -128,4 +217,39 @@ Arguments::Arguments(int argc, char *argv[]) :
         printUsage(argv[0]);
         exit(1);
     }
+
+    if (asyncOutput && !forkServerJobs.empty()) {
+        std::cerr << "Error: --async-output can't be combined with --fork-server\n";
+        exit(1);
+    }
+
+    if (stream && (!emitElf.empty() || !profileGenerate.empty() || !profileUse.empty() || sampleProfile ||
+                   !forkServerJobs.empty() || servePort != 0)) {
+        std::cerr << "Error: --stream can't be combined with --emit-elf, --profile-generate, --profile-use, "
+                     "--sample-profile, --fork-server or --serve\n";
+        exit(1);
+    }
+
+    if (servePort != 0 && (!profileGenerate.empty() || !emitElf.empty() || !forkServerJobs.empty() || asyncOutput ||
+                           sampleProfile)) {
+        std::cerr << "Error: --serve can't be combined with --profile-generate, --emit-elf, --fork-server, "
+                     "--async-output or --sample-profile\n";
+        exit(1);
+    }
+
+    if (!emitElf.empty() && (!forkServerJobs.empty() || servePort != 0 || fuel > 0 || timeLimit > 0 ||
+                             useInterpreter || !profileGenerate.empty() || sampleProfile || asyncOutput)) {
+        std::cerr << "Error: --emit-elf can't be combined with --fork-server, --serve, --fuel, --time-limit, "
+                     "--use-interpreter, --profile-generate, --sample-profile or --async-output\n";
+        exit(1);
+    }
+
+    if (batch && (servePort != 0 || !forkServerJobs.empty() || stream || asyncOutput || fuel > 0 || timeLimit > 0 ||
+                  !profileGenerate.empty() || !profileUse.empty() || !emitElf.empty() || sampleProfile || lazyJit ||
+                  useInterpreter)) {
+        std::cerr << "Error: --batch can't be combined with --serve, --fork-server, --stream, --async-output, --fuel, "
+                     "--time-limit, --profile-generate, --profile-use, --emit-elf, --sample-profile, --lazy-jit or "
+                     "--use-interpreter\n";
+        exit(1);
+    }
 }
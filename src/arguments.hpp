@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdint>
 #include <vector>
 #include <string>
 
@@ -8,13 +9,33 @@ struct Arguments {
     size_t bfMemLength;
     size_t cellBitWidth;
     std::vector<std::string> fileNames;
+    std::string forkServerJobs;
+    std::string emitElf;
+    std::string profileGenerate;
+    std::string profileUse;
     bool verbose{false};
     bool dryRun{false};
     bool dumpCode{false};
     bool dumpMem{false};
     bool genSyms{false};
     bool useInterpreter{false};
+    bool lazyJit{false};
+    bool hugePages{false};
     bool noFlush{false};
+    bool sampleProfile{false};
+    bool stream{false};
+    // --async-output, or --splice-output which also sets spliceOutput
+    bool asyncOutput{false};
+    bool spliceOutput{false};
+    // --mem-size=auto, which starts from the default bfMemLength
+    bool autoMemSize{false};
+    // Loop iterations and wall clock seconds the jit code may run for, or 0 for no limit
+    uint64_t fuel{0};
+    double timeLimit{0};
+    // --serve: TCP port to run a session of the program for each connection on, or 0
+    int servePort{0};
+    // --batch: run the program once per line of stdin, many lines at a time
+    bool batch{false};
     bool optimize{true};
     GetCharBehaviour getCharBehaviour{GetCharBehaviour::EOF_RETURNS_0};
 
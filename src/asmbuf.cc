@@ -1,6 +1,6 @@
 #include "asmbuf.hpp"
 
-void enter_buf(const void *addr) {
+uintptr_t enter_buf(const void *addr) {
     // Call into addr, which is a function pointer
-    ((void(*)(void))addr)();
+    return ((uintptr_t(*)(void))addr)();
 }
@@ -6,38 +6,90 @@
 #include <sstream>
 #include <string_view>
 #include <sys/mman.h>
+#include <unistd.h>
 
 const int PAGE_SIZE = 4096;
 using ASMBufOffset = size_t;
 
-void enter_buf(const void *addr);
+// Call the generated function at addr, returning what it leaves in rax
+uintptr_t enter_buf(const void *addr);
+
+enum class ASMBufMapping {
+    // A single private mapping, toggled between RW and RX with set_executable()
+    Private,
+    // A memfd mapped twice, once RW and once RX, so code can be appended and
+    // patched while other code in the buffer is running. The buffer never moves.
+    DualMapped,
+};
 
 class ASMBuf {
+    // Address space reserved up front for dual mapped buffers, since they can't be moved
+    static constexpr size_t DUAL_MAPPED_RESERVE = 1024 * 1024 * 1024;
     size_t used;
     size_t buf_len;
     bool is_exec;
+    int memfd;
     unsigned char *data;
+    unsigned char *exec_data;
 
   public:
-    ASMBuf(size_t pages) : used(0), buf_len(pages * PAGE_SIZE), is_exec(false) {
+    ASMBuf(size_t pages, ASMBufMapping mapping = ASMBufMapping::Private)
+        : used(0), buf_len(pages * PAGE_SIZE), is_exec(false), memfd(-1) {
+        if (mapping == ASMBufMapping::DualMapped) {
+            map_dual();
+            return;
+        }
         data = static_cast<unsigned char *>(
             mmap(nullptr, buf_len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0));
         if (data == MAP_FAILED) {
             throw JITError("Failed to mmap ASMBuf: ", strerror(errno));
         }
+        exec_data = data;
     }
     ASMBuf(const ASMBuf &other) = delete;
-    ASMBuf(ASMBuf &&other) : used(other.used), buf_len(other.buf_len), is_exec(other.is_exec), data(other.data) {
+    ASMBuf(ASMBuf &&other)
+        : used(other.used), buf_len(other.buf_len), is_exec(other.is_exec), memfd(other.memfd), data(other.data),
+          exec_data(other.exec_data) {
+        other.memfd = -1;
         other.data = nullptr;
+        other.exec_data = nullptr;
     }
-    ~ASMBuf() {
-        if (data != nullptr) {
-            // Not checking munmap because we are discarding, and this is a destructor
-            munmap(data, buf_len);
+    ~ASMBuf() { release(); }
+    void map_dual() {
+        buf_len = DUAL_MAPPED_RESERVE;
+        data = exec_data = nullptr;
+        memfd = memfd_create("bf_jit", MFD_CLOEXEC);
+        if (memfd == -1) {
+            throw JITError("Failed to create memfd for ASMBuf: ", strerror(errno));
+        }
+        // The file is sparse, pages are only allocated once code is written to them
+        if (ftruncate(memfd, buf_len)) {
+            const int error = errno;
+            release();
+            throw JITError("Failed to size memfd for ASMBuf: ", strerror(error));
+        }
+        data = static_cast<unsigned char *>(
+            mmap(nullptr, buf_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, memfd, 0));
+        if (data == MAP_FAILED) {
+            const int error = errno;
             data = nullptr;
+            release();
+            throw JITError("Failed to mmap ASMBuf: ", strerror(error));
+        }
+        exec_data = static_cast<unsigned char *>(
+            mmap(nullptr, buf_len, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_NORESERVE, memfd, 0));
+        if (exec_data == MAP_FAILED) {
+            const int error = errno;
+            exec_data = nullptr;
+            release();
+            throw JITError("Failed to mmap ASMBuf: ", strerror(error));
         }
     }
+    bool is_dual_mapped() const { return memfd != -1; }
     void grow() {
+        if (is_dual_mapped()) {
+            throw JITError("Ran out of space in dual mapped ASMBuf");
+        }
         // create new mapping
         auto new_buffer = static_cast<unsigned char *>(
             mmap(nullptr, 2 * buf_len, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0));
@@ -52,13 +104,14 @@ class ASMBuf {
             data = nullptr;
             throw JITError("Failed to unmap ASMBuf: ", strerror(errno));
         }
-        data = new_buffer;
+        data = exec_data = new_buffer;
         // synchronize attributes
         buf_len *= 2;
         set_executable(is_exec);
     }
     void set_executable(bool executable) {
-        if (data == nullptr)
+        // Dual mapped buffers are always writable through data, and executable through exec_data
+        if (data == nullptr || is_dual_mapped())
             return;
         int prot;
         if (executable) {
@@ -103,7 +156,8 @@ class ASMBuf {
         used = old_used;
     }
     ASMBufOffset current_offset() const { return used; }
-    uintptr_t address_at_offset(ASMBufOffset offset) const { return (uintptr_t)(data + offset); }
+    const unsigned char *bytes() const { return data; }
+    uintptr_t address_at_offset(ASMBufOffset offset) const { return (uintptr_t)(exec_data + offset); }
     std::string instructionHexDump() const {
         std::ostringstream ss;
         ss.fill('0');
@@ -114,8 +168,27 @@ class ASMBuf {
         }
         return ss.str();
     }
-    void enter(ASMBufOffset offset) {
-        const void *address = static_cast<void *>(data + offset);
-        enter_buf(address);
+    uintptr_t enter(ASMBufOffset offset) {
+        const void *address = static_cast<void *>(exec_data + offset);
+        return enter_buf(address);
+    }
+
+  private:
+    // Unmap the buffer and close its memfd, also what a failed map_dual() got
+    // to, since the destructor doesn't run when the constructor throws
+    void release() {
+        // Not checking munmap because we are discarding
+        if (exec_data != nullptr && exec_data != data) {
+            munmap(exec_data, buf_len);
+        }
+        exec_data = nullptr;
+        if (data != nullptr) {
+            munmap(data, buf_len);
+            data = nullptr;
+        }
+        if (memfd != -1) {
+            close(memfd);
+            memfd = -1;
+        }
     }
 };
@@ -0,0 +1,372 @@
+#include "assembler.hpp"
+
+static bool fitsInt8(int64_t v) { return v >= INT8_MIN && v <= INT8_MAX; }
+
+static uint8_t low3(uint8_t reg) { return reg & 7; }
+
+static uint8_t regNum(Reg reg) { return static_cast<uint8_t>(reg); }
+
+// spl, bpl, sil and dil are only addressable as byte registers with a REX prefix
+static bool needsRexForByte(uint8_t reg) { return reg >= 4 && reg < 8; }
+
+void Assembler::bind(Label &label) {
+    if (label.bound_) {
+        throw JITError("ICE: Label bound twice");
+    }
+    label.offset_ = offset();
+    label.bound_ = true;
+    for (auto fixup : label.fixups_) {
+        if (fixup.isShort) {
+            const int64_t rel = (int64_t)label.offset_ - (int64_t)(fixup.pos + 1);
+            if (!fitsInt8(rel)) {
+                throw JITError("ICE: Short jump out of range by ", rel);
+            }
+            buf_.patch_val(fixup.pos, (int8_t)rel);
+        } else {
+            const int32_t rel = (int32_t)label.offset_ - (int32_t)(fixup.pos + 4);
+            buf_.patch_val(fixup.pos, rel);
+        }
+    }
+    label.fixups_.clear();
+}
+
+void Assembler::imm(Width w, int32_t value) {
+    switch (w) {
+    case Width::B:
+        buf_.write_val((int8_t)value);
+        break;
+    case Width::W:
+        buf_.write_val((int16_t)value);
+        break;
+    default:
+        buf_.write_val(value);
+        break;
+    }
+}
+
+void Assembler::prefixes(Width w, uint8_t reg, uint8_t index, uint8_t base, bool byteRegs) {
+    if (w == Width::W) {
+        byte(0x66);
+    }
+    const uint8_t rex = 0x40 | ((w == Width::Q) << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+    if (rex != 0x40 || byteRegs) {
+        byte(rex);
+    }
+}
+
+void Assembler::modrmReg(uint8_t reg, uint8_t rm) { byte(0xc0 | (low3(reg) << 3) | low3(rm)); }
+
+void Assembler::modrmMem(uint8_t reg, const Mem &m) {
+    const uint8_t base = regNum(m.base);
+    const bool hasIndex = m.index != Reg::RSP;
+    // rsp and r12 as a base can only be encoded with a SIB byte
+    const bool needSib = hasIndex || low3(base) == 4;
+    uint8_t mod;
+    // rbp and r13 as a base with mod 0 mean rip relative/no base, so they need a displacement
+    if (m.disp == 0 && low3(base) != 5) {
+        mod = 0;
+    } else if (fitsInt8(m.disp)) {
+        mod = 1;
+    } else {
+        mod = 2;
+    }
+    byte((mod << 6) | (low3(reg) << 3) | (needSib ? 4 : low3(base)));
+    if (needSib) {
+        uint8_t scaleBits = 0;
+        switch (m.scale) {
+        case 1: scaleBits = 0; break;
+        case 2: scaleBits = 1; break;
+        case 4: scaleBits = 2; break;
+        case 8: scaleBits = 3; break;
+        default:
+            throw JITError("ICE: Invalid memory operand scale ", (int)m.scale);
+        }
+        byte((scaleBits << 6) | (low3(hasIndex ? regNum(m.index) : 4) << 3) | low3(base));
+    }
+    if (mod == 1) {
+        buf_.write_val((int8_t)m.disp);
+    } else if (mod == 2) {
+        buf_.write_val(m.disp);
+    }
+}
+
+// Opcodes above 0xff are two byte opcodes
+static void opcodeBytes(ASMBuf &buf, uint16_t opcode) {
+    if (opcode > 0xff) {
+        buf.write_val((uint8_t)(opcode >> 8));
+    }
+    buf.write_val((uint8_t)opcode);
+}
+
+void Assembler::opRR(Width w, uint8_t opcode, uint8_t reg, Reg rm, bool regIsReg) {
+    const bool byteRegs = w == Width::B && ((regIsReg && needsRexForByte(reg)) || needsRexForByte(regNum(rm)));
+    prefixes(w, reg, 0, regNum(rm), byteRegs);
+    byte(opcode);
+    modrmReg(reg, regNum(rm));
+}
+
+void Assembler::opRM(Width w, uint8_t opcode, uint8_t reg, const Mem &m, bool regIsReg) {
+    const bool byteRegs = w == Width::B && regIsReg && needsRexForByte(reg);
+    prefixes(w, reg, m.index == Reg::RSP ? 0 : regNum(m.index), regNum(m.base), byteRegs);
+    byte(opcode);
+    modrmMem(reg, m);
+}
+
+void Assembler::mov(Width w, Reg dst, Reg src) { opRR(w, w == Width::B ? 0x88 : 0x89, regNum(src), dst); }
+
+void Assembler::mov(Width w, Reg dst, const Mem &src) { opRM(w, w == Width::B ? 0x8a : 0x8b, regNum(dst), src, true); }
+
+void Assembler::mov(Width w, const Mem &dst, Reg src) { opRM(w, w == Width::B ? 0x88 : 0x89, regNum(src), dst, true); }
+
+void Assembler::mov(Width w, const Mem &dst, int32_t value) {
+    opRM(w, w == Width::B ? 0xc6 : 0xc7, 0, dst, false);
+    imm(w, value);
+}
+
+void Assembler::movImm(Reg dst, uint64_t value) {
+    const uint8_t r = regNum(dst);
+    if (value <= UINT32_MAX) {
+        // mov r32, imm32 zero extends into the full register
+        prefixes(Width::D, 0, 0, r, false);
+        byte(0xb8 + low3(r));
+        buf_.write_val((uint32_t)value);
+    } else if ((int64_t)value >= INT32_MIN && (int64_t)value <= INT32_MAX) {
+        opRR(Width::Q, 0xc7, 0, dst, false);
+        buf_.write_val((int32_t)value);
+    } else {
+        prefixes(Width::Q, 0, 0, r, false);
+        byte(0xb8 + low3(r));
+        buf_.write_val(value);
+    }
+}
+
+void Assembler::movzx(Width srcWidth, Reg dst, const Mem &src) {
+    const uint8_t r = regNum(dst);
+    prefixes(Width::D, r, src.index == Reg::RSP ? 0 : regNum(src.index), regNum(src.base), false);
+    opcodeBytes(buf_, srcWidth == Width::B ? 0x0fb6 : 0x0fb7);
+    modrmMem(r, src);
+}
+
+void Assembler::movsx(Width srcWidth, Reg dst, const Mem &src) {
+    const uint8_t r = regNum(dst);
+    prefixes(Width::D, r, src.index == Reg::RSP ? 0 : regNum(src.index), regNum(src.base), false);
+    opcodeBytes(buf_, srcWidth == Width::B ? 0x0fbe : 0x0fbf);
+    modrmMem(r, src);
+}
+
+void Assembler::lea(Width w, Reg dst, const Mem &src) { opRM(w, 0x8d, regNum(dst), src, false); }
+
+void Assembler::push(Reg reg) {
+    prefixes(Width::D, 0, 0, regNum(reg), false);
+    byte(0x50 + low3(regNum(reg)));
+}
+
+void Assembler::pop(Reg reg) {
+    prefixes(Width::D, 0, 0, regNum(reg), false);
+    byte(0x58 + low3(regNum(reg)));
+}
+
+void Assembler::aluImm(uint8_t ext, Width w, Reg dst, int32_t value) {
+    if (w == Width::B) {
+        if (dst == Reg::RAX) {
+            byte(ext * 8 + 4);
+        } else {
+            opRR(w, 0x80, ext, dst, false);
+        }
+        imm(w, value);
+    } else if (fitsInt8(value)) {
+        opRR(w, 0x83, ext, dst, false);
+        buf_.write_val((int8_t)value);
+    } else if (dst == Reg::RAX) {
+        prefixes(w, 0, 0, 0, false);
+        byte(ext * 8 + 5);
+        imm(w, value);
+    } else {
+        opRR(w, 0x81, ext, dst, false);
+        imm(w, value);
+    }
+}
+
+void Assembler::aluImm(uint8_t ext, Width w, const Mem &dst, int32_t value) {
+    if (w == Width::B) {
+        opRM(w, 0x80, ext, dst, false);
+        imm(w, value);
+    } else if (fitsInt8(value)) {
+        opRM(w, 0x83, ext, dst, false);
+        buf_.write_val((int8_t)value);
+    } else {
+        opRM(w, 0x81, ext, dst, false);
+        imm(w, value);
+    }
+}
+
+void Assembler::aluRR(uint8_t ext, Width w, Reg dst, Reg src) {
+    opRR(w, ext * 8 + (w == Width::B ? 0 : 1), regNum(src), dst);
+}
+
+void Assembler::aluRM(uint8_t ext, Width w, Reg dst, const Mem &src) {
+    opRM(w, ext * 8 + (w == Width::B ? 2 : 3), regNum(dst), src, true);
+}
+
+void Assembler::aluMR(uint8_t ext, Width w, const Mem &dst, Reg src) {
+    opRM(w, ext * 8 + (w == Width::B ? 0 : 1), regNum(src), dst, true);
+}
+
+void Assembler::test(Width w, Reg dst, Reg src) { opRR(w, w == Width::B ? 0x84 : 0x85, regNum(src), dst); }
+
+void Assembler::unary(uint8_t opcode, uint8_t ext, Width w, Reg reg) {
+    const bool byteRegs = w == Width::B && needsRexForByte(regNum(reg));
+    prefixes(w, 0, 0, regNum(reg), byteRegs);
+    byte(opcode + (w == Width::B ? 0 : 1));
+    modrmReg(ext, regNum(reg));
+}
+
+void Assembler::imul(Width w, Reg dst, Reg src) {
+    prefixes(w, regNum(dst), 0, regNum(src), false);
+    opcodeBytes(buf_, 0x0faf);
+    modrmReg(regNum(dst), regNum(src));
+}
+
+void Assembler::imul(Width w, Reg dst, Reg src, int32_t value) {
+    if (fitsInt8(value)) {
+        opRR(w, 0x6b, regNum(dst), src);
+        buf_.write_val((int8_t)value);
+    } else {
+        opRR(w, 0x69, regNum(dst), src);
+        imm(w, value);
+    }
+}
+
+void Assembler::shl(Width w, Reg reg, uint8_t amount) {
+    if (amount == 1) {
+        unary(0xd0, 4, w, reg);
+    } else {
+        unary(0xc0, 4, w, reg);
+        byte(amount);
+    }
+}
+
+void Assembler::cmov(Cond cond, Width w, Reg dst, Reg src) {
+    prefixes(w, regNum(dst), 0, regNum(src), false);
+    opcodeBytes(buf_, 0x0f40 + static_cast<uint8_t>(cond));
+    modrmReg(regNum(dst), regNum(src));
+}
+
+void Assembler::sseRR(uint8_t prefix, uint16_t opcode, uint8_t reg, uint8_t rm, bool rexW) {
+    byte(prefix);
+    prefixes(rexW ? Width::Q : Width::D, reg, 0, rm, false);
+    opcodeBytes(buf_, opcode);
+    modrmReg(reg, rm);
+}
+
+void Assembler::sseRM(uint8_t prefix, uint16_t opcode, uint8_t reg, const Mem &m) {
+    byte(prefix);
+    prefixes(Width::D, reg, m.index == Reg::RSP ? 0 : regNum(m.index), regNum(m.base), false);
+    opcodeBytes(buf_, opcode);
+    modrmMem(reg, m);
+}
+
+void Assembler::padd(Width lane, Xmm dst, Xmm src) {
+    uint16_t opcode = 0x0ffe;
+    switch (lane) {
+    case Width::B: opcode = 0x0ffc; break;
+    case Width::W: opcode = 0x0ffd; break;
+    case Width::D: opcode = 0x0ffe; break;
+    case Width::Q: opcode = 0x0fd4; break;
+    }
+    sseRR(0x66, opcode, xmmNum(dst), xmmNum(src));
+}
+
+void Assembler::jump(int shortOpcode, uint8_t nearOpcode0, int nearOpcode1, Label &label, bool isShort) {
+    if (label.bound_) {
+        const int64_t shortRel = (int64_t)label.offset_ - (int64_t)(offset() + 2);
+        if (fitsInt8(shortRel)) {
+            byte(shortOpcode);
+            buf_.write_val((int8_t)shortRel);
+            return;
+        }
+        byte(nearOpcode0);
+        if (nearOpcode1 >= 0) {
+            byte(nearOpcode1);
+        }
+        buf_.write_val((int32_t)((int64_t)label.offset_ - (int64_t)(offset() + 4)));
+        return;
+    }
+    if (isShort) {
+        byte(shortOpcode);
+        label.fixups_.push_back({offset(), true});
+        byte(0);
+        return;
+    }
+    byte(nearOpcode0);
+    if (nearOpcode1 >= 0) {
+        byte(nearOpcode1);
+    }
+    label.fixups_.push_back({offset(), false});
+    buf_.write_val((int32_t)0);
+}
+
+void Assembler::jmp(Label &label, bool isShort) { jump(0xeb, 0xe9, -1, label, isShort); }
+
+void Assembler::jcc(Cond cond, Label &label, bool isShort) {
+    const uint8_t cc = static_cast<uint8_t>(cond);
+    jump(0x70 + cc, 0x0f, 0x80 + cc, label, isShort);
+}
+
+void Assembler::jmp(Reg target) { unary(0xfe, 4, Width::D, target); }
+
+void Assembler::call(Reg target) { unary(0xfe, 2, Width::D, target); }
+
+void Assembler::call(Label &label) {
+    byte(0xe8);
+    if (label.bound_) {
+        buf_.write_val((int32_t)((int64_t)label.offset_ - (int64_t)(offset() + 4)));
+        return;
+    }
+    label.fixups_.push_back({offset(), false});
+    buf_.write_val((int32_t)0);
+}
+
+void Assembler::ret() { byte(0xc3); }
+
+void Assembler::syscall() {
+    byte(0x0f);
+    byte(0x05);
+}
+
+void Assembler::jmpRel32(ASMBufOffset target) {
+    byte(0xe9);
+    buf_.write_val((int32_t)((int64_t)target - (int64_t)(offset() + 4)));
+}
+
+void Assembler::nop(size_t count) {
+    // Recommended multi-byte nop sequences, indexed by length
+    static const unsigned char nops[][9] = {
+        {0x90},
+        {0x66, 0x90},
+        {0x0f, 0x1f, 0x00},
+        {0x0f, 0x1f, 0x40, 0x00},
+        {0x0f, 0x1f, 0x44, 0x00, 0x00},
+        {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00},
+        {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00},
+        {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+        {0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    };
+    const size_t maxNopLength = std::size(nops);
+    while (count > 0) {
+        const size_t length = std::min(count, maxNopLength);
+        for (size_t i = 0; i < length; ++i) {
+            byte(nops[length - 1][i]);
+        }
+        count -= length;
+    }
+}
+
+bool Assembler::align(size_t alignment, size_t maxPadding) {
+    const size_t padding = (alignment - offset() % alignment) % alignment;
+    if (padding > maxPadding) {
+        return false;
+    }
+    nop(padding);
+    return true;
+}
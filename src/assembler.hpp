@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "asmbuf.hpp"
+#include "error.hpp"
+
+// General purpose registers, numbered by their encoding
+enum class Reg : uint8_t {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// SSE registers
+enum class Xmm : uint8_t {
+    XMM0, XMM1, XMM2, XMM3, XMM4, XMM5, XMM6, XMM7,
+    XMM8, XMM9, XMM10, XMM11, XMM12, XMM13, XMM14, XMM15,
+};
+
+// Operand size in bytes
+enum class Width : uint8_t { B = 1, W = 2, D = 4, Q = 8 };
+
+// Condition codes, numbered by their encoding
+enum class Cond : uint8_t {
+    O, NO, B, AE, E, NE, BE, A, S, NS, P, NP, L, GE, LE, G,
+    Z = E, NZ = NE,
+};
+
+// Memory operand: [base + index*scale + disp]
+struct Mem {
+    Reg base;
+    Reg index{Reg::RSP}; // RSP can't be an index, so it means "no index"
+    uint8_t scale{1};
+    int32_t disp{};
+};
+
+inline Mem mem(Reg base, int32_t disp = 0) { return Mem{base, Reg::RSP, 1, disp}; }
+inline Mem mem(Reg base, Reg index, uint8_t scale, int32_t disp = 0) { return Mem{base, index, scale, disp}; }
+
+// Jump target. Jumps to bound labels pick the shortest encoding, jumps to
+// unbound labels are rel32 unless they are marked as short, and get patched
+// when the label is bound.
+class Label {
+    friend class Assembler;
+    struct Fixup {
+        ASMBufOffset pos;
+        bool isShort;
+    };
+    std::vector<Fixup> fixups_;
+    ASMBufOffset offset_{};
+    bool bound_{false};
+
+  public:
+    bool bound() const { return bound_; }
+    ASMBufOffset offset() const { return offset_; }
+};
+
+// Typed x86-64 instruction encoder writing into an ASMBuf. Every method picks
+// the shortest encoding of the instruction it is asked for (imm8 over imm32,
+// disp8 over disp32, and only emitting a REX prefix when it is needed).
+class Assembler {
+  public:
+    explicit Assembler(ASMBuf &buf) : buf_{buf} {}
+
+    ASMBufOffset offset() const { return buf_.current_offset(); }
+    ASMBuf &buf() { return buf_; }
+
+    void bind(Label &label);
+
+    // Data movement
+    void mov(Width w, Reg dst, Reg src);
+    void mov(Width w, Reg dst, const Mem &src);
+    void mov(Width w, const Mem &dst, Reg src);
+    void mov(Width w, const Mem &dst, int32_t imm);
+    // Materialize a 64 bit constant, using a 32 bit move when it zero extends correctly
+    void movImm(Reg dst, uint64_t imm);
+    void movzx(Width srcWidth, Reg dst, const Mem &src);
+    void movsx(Width srcWidth, Reg dst, const Mem &src);
+    void lea(Width w, Reg dst, const Mem &src);
+    void push(Reg reg);
+    void pop(Reg reg);
+
+    // Arithmetic
+    void add(Width w, Reg dst, int32_t imm) { aluImm(0, w, dst, imm); }
+    void add(Width w, const Mem &dst, int32_t imm) { aluImm(0, w, dst, imm); }
+    void add(Width w, Reg dst, Reg src) { aluRR(0, w, dst, src); }
+    void add(Width w, Reg dst, const Mem &src) { aluRM(0, w, dst, src); }
+    void add(Width w, const Mem &dst, Reg src) { aluMR(0, w, dst, src); }
+    void and_(Width w, Reg dst, int32_t imm) { aluImm(4, w, dst, imm); }
+    void and_(Width w, Reg dst, Reg src) { aluRR(4, w, dst, src); }
+    void sub(Width w, Reg dst, int32_t imm) { aluImm(5, w, dst, imm); }
+    void sub(Width w, Reg dst, Reg src) { aluRR(5, w, dst, src); }
+    void sub(Width w, const Mem &dst, Reg src) { aluMR(5, w, dst, src); }
+    void xor_(Width w, Reg dst, Reg src) { aluRR(6, w, dst, src); }
+    void cmp(Width w, Reg dst, int32_t imm) { aluImm(7, w, dst, imm); }
+    void cmp(Width w, Reg dst, Reg src) { aluRR(7, w, dst, src); }
+    void cmp(Width w, Reg dst, const Mem &src) { aluRM(7, w, dst, src); }
+    void cmp(Width w, const Mem &dst, int32_t imm) { aluImm(7, w, dst, imm); }
+    void test(Width w, Reg dst, Reg src);
+    void inc(Width w, Reg reg) { unary(0xfe, 0, w, reg); }
+    void dec(Width w, Reg reg) { unary(0xfe, 1, w, reg); }
+    void neg(Width w, Reg reg) { unary(0xf6, 3, w, reg); }
+    // Unsigned divide of rdx:rax (or narrower) by reg, leaving the quotient in rax and the remainder in rdx
+    void div(Width w, Reg reg) { unary(0xf6, 6, w, reg); }
+    void imul(Width w, Reg dst, Reg src);
+    void imul(Width w, Reg dst, Reg src, int32_t imm);
+    void shl(Width w, Reg reg, uint8_t amount);
+    void cmov(Cond cond, Width w, Reg dst, Reg src);
+
+    // SSE2
+    void movdqu(Xmm dst, const Mem &src) { sseRM(0xf3, 0x0f6f, xmmNum(dst), src); }
+    void movdqu(const Mem &dst, Xmm src) { sseRM(0xf3, 0x0f7f, xmmNum(src), dst); }
+    void movq(Xmm dst, Reg src) { sseRR(0x66, 0x0f6e, xmmNum(dst), static_cast<uint8_t>(src), true); }
+    void movq(Xmm dst, const Mem &src) { sseRM(0xf3, 0x0f7e, xmmNum(dst), src); }
+    void movq(const Mem &dst, Xmm src) { sseRM(0x66, 0x0fd6, xmmNum(src), dst); }
+    // Add packed integers of the given lane width
+    void padd(Width lane, Xmm dst, Xmm src);
+    void pand(Xmm dst, Xmm src) { sseRR(0x66, 0x0fdb, xmmNum(dst), xmmNum(src)); }
+    void pxor(Xmm dst, Xmm src) { sseRR(0x66, 0x0fef, xmmNum(dst), xmmNum(src)); }
+    void punpcklqdq(Xmm dst, Xmm src) { sseRR(0x66, 0x0f6c, xmmNum(dst), xmmNum(src)); }
+
+    // Control flow
+    void jmp(Label &label, bool isShort = false);
+    void jcc(Cond cond, Label &label, bool isShort = false);
+    void jmp(Reg target);
+    void call(Reg target);
+    void call(Label &label);
+    void ret();
+    void syscall();
+    // Fixed size jmp rel32, for sites that get patched later
+    void jmpRel32(ASMBufOffset target);
+    void nop(size_t count);
+    // Pad with nops to the given power of 2 alignment, if that takes at most maxPadding bytes
+    bool align(size_t alignment, size_t maxPadding);
+
+  private:
+    void byte(uint8_t b) { buf_.write_val(b); }
+    void imm(Width w, int32_t value);
+    void prefixes(Width w, uint8_t reg, uint8_t index, uint8_t base, bool byteRegs);
+    void modrmReg(uint8_t reg, uint8_t rm);
+    void modrmMem(uint8_t reg, const Mem &m);
+    // regIsReg is false when the reg field holds an opcode extension
+    void opRR(Width w, uint8_t opcode, uint8_t reg, Reg rm, bool regIsReg = true);
+    void opRM(Width w, uint8_t opcode, uint8_t reg, const Mem &m, bool regIsReg);
+    void aluImm(uint8_t ext, Width w, Reg dst, int32_t value);
+    void aluImm(uint8_t ext, Width w, const Mem &dst, int32_t value);
+    void aluRR(uint8_t ext, Width w, Reg dst, Reg src);
+    void aluRM(uint8_t ext, Width w, Reg dst, const Mem &src);
+    void aluMR(uint8_t ext, Width w, const Mem &dst, Reg src);
+    void unary(uint8_t opcode, uint8_t ext, Width w, Reg reg);
+    static uint8_t xmmNum(Xmm reg) { return static_cast<uint8_t>(reg); }
+    // SSE instructions, with their mandatory prefix ahead of any REX prefix
+    void sseRR(uint8_t prefix, uint16_t opcode, uint8_t reg, uint8_t rm, bool rexW = false);
+    void sseRM(uint8_t prefix, uint16_t opcode, uint8_t reg, const Mem &m);
+    void jump(int shortOpcode, uint8_t nearOpcode0, int nearOpcode1, Label &label, bool isShort);
+
+    ASMBuf &buf_;
+};
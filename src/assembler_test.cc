@@ -0,0 +1,252 @@
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "asmbuf.hpp"
+#include "assembler.hpp"
+#include "error.hpp"
+
+// make test: checks the bytes the assembler emits against known encodings.
+// Each case names the instruction it expects in Intel syntax, and lists its
+// encoding in hex. Cases that need padding ahead of the instruction, to put a
+// label out of short jump range, only compare that many bytes at the end.
+
+struct EncodingCase {
+    const char *name;
+    std::function<void(Assembler &)> emit;
+    const char *expected;
+    // Bytes of padding expected ahead of the compared ones
+    size_t padding{};
+};
+
+static const Mem CELL = mem(Reg::R10, Reg::R11, 1);
+
+static const std::vector<EncodingCase> CASES{
+    /// imm8 or imm32, and the short forms for al/eax
+    {"add r11, 1", [](Assembler &as) { as.add(Width::Q, Reg::R11, 1); }, "4983c301"},
+    {"add r11, -128", [](Assembler &as) { as.add(Width::Q, Reg::R11, -128); }, "4983c380"},
+    {"add r11, 128", [](Assembler &as) { as.add(Width::Q, Reg::R11, 128); }, "4981c380000000"},
+    {"sub r11, 0x1000", [](Assembler &as) { as.sub(Width::Q, Reg::R11, 0x1000); }, "4981eb00100000"},
+    {"add eax, 0x1000", [](Assembler &as) { as.add(Width::D, Reg::RAX, 0x1000); }, "0500100000"},
+    {"add rax, 0x1000", [](Assembler &as) { as.add(Width::Q, Reg::RAX, 0x1000); }, "480500100000"},
+    {"add al, 5", [](Assembler &as) { as.add(Width::B, Reg::RAX, 5); }, "0405"},
+    {"add cl, -1", [](Assembler &as) { as.add(Width::B, Reg::RCX, -1); }, "80c1ff"},
+    {"add ax, 300", [](Assembler &as) { as.add(Width::W, Reg::RAX, 300); }, "66052c01"},
+    {"and eax, 0xff", [](Assembler &as) { as.and_(Width::D, Reg::RAX, 0xff); }, "25ff000000"},
+    {"cmp r11, r15", [](Assembler &as) { as.cmp(Width::Q, Reg::R11, Reg::R15); }, "4d39fb"},
+    {"cmp r12d, 2", [](Assembler &as) { as.cmp(Width::D, Reg::R12, 2); }, "4183fc02"},
+    {"xor eax, eax", [](Assembler &as) { as.xor_(Width::D, Reg::RAX, Reg::RAX); }, "31c0"},
+    {"add byte [r10+r11], 3", [](Assembler &as) { as.add(Width::B, CELL, 3); }, "4380041a03"},
+    {"add word [r10+r11*2], -1",
+     [](Assembler &as) { as.add(Width::W, mem(Reg::R10, Reg::R11, 2), -1); }, "664383045aff"},
+    {"add dword [r10+r11*4+8], 1000",
+     [](Assembler &as) { as.add(Width::D, mem(Reg::R10, Reg::R11, 4, 8), 1000); }, "4381449a08e8030000"},
+    {"cmp byte [r10+r11], 0", [](Assembler &as) { as.cmp(Width::B, CELL, 0); }, "43803c1a00"},
+    {"add [r10+r11], r12b", [](Assembler &as) { as.add(Width::B, CELL, Reg::R12); }, "4700241a"},
+    {"sub [r10+r11*2], r12w",
+     [](Assembler &as) { as.sub(Width::W, mem(Reg::R10, Reg::R11, 2), Reg::R12); }, "664729245a"},
+
+    /// disp8 or disp32, and the bases that need a SIB byte or a displacement
+    {"mov eax, [r10]", [](Assembler &as) { as.mov(Width::D, Reg::RAX, mem(Reg::R10)); }, "418b02"},
+    {"mov eax, [r10+0x7f]", [](Assembler &as) { as.mov(Width::D, Reg::RAX, mem(Reg::R10, 0x7f)); }, "418b427f"},
+    {"mov eax, [r10-0x80]", [](Assembler &as) { as.mov(Width::D, Reg::RAX, mem(Reg::R10, -0x80)); }, "418b4280"},
+    {"mov eax, [r10+0x80]",
+     [](Assembler &as) { as.mov(Width::D, Reg::RAX, mem(Reg::R10, 0x80)); }, "418b8280000000"},
+    {"mov eax, [r10-0x81]",
+     [](Assembler &as) { as.mov(Width::D, Reg::RAX, mem(Reg::R10, -0x81)); }, "418b827fffffff"},
+    {"mov eax, [rbp]", [](Assembler &as) { as.mov(Width::D, Reg::RAX, mem(Reg::RBP)); }, "8b4500"},
+    {"mov eax, [r13]", [](Assembler &as) { as.mov(Width::D, Reg::RAX, mem(Reg::R13)); }, "418b4500"},
+    {"mov eax, [rsp+8]", [](Assembler &as) { as.mov(Width::D, Reg::RAX, mem(Reg::RSP, 8)); }, "8b442408"},
+    {"mov eax, [r12]", [](Assembler &as) { as.mov(Width::D, Reg::RAX, mem(Reg::R12)); }, "418b0424"},
+    {"mov rcx, [r13+rax*8+0x100]",
+     [](Assembler &as) { as.mov(Width::Q, Reg::RCX, mem(Reg::R13, Reg::RAX, 8, 0x100)); }, "498b8cc500010000"},
+    {"mov dword [r10+r11*4], 7",
+     [](Assembler &as) { as.mov(Width::D, mem(Reg::R10, Reg::R11, 4), 7); }, "43c7049a07000000"},
+    {"mov word [r10+r11*2], 7",
+     [](Assembler &as) { as.mov(Width::W, mem(Reg::R10, Reg::R11, 2), 7); }, "6643c7045a0700"},
+    {"lea rax, [r11+8]", [](Assembler &as) { as.lea(Width::Q, Reg::RAX, mem(Reg::R11, 8)); }, "498d4308"},
+    {"lea rcx, [rcx+rcx*2]",
+     [](Assembler &as) { as.lea(Width::Q, Reg::RCX, mem(Reg::RCX, Reg::RCX, 2)); }, "488d0c49"},
+
+    /// REX prefixes, which byte registers from spl to dil need even without extended registers
+    {"mov cl, al", [](Assembler &as) { as.mov(Width::B, Reg::RCX, Reg::RAX); }, "88c1"},
+    {"mov dil, al", [](Assembler &as) { as.mov(Width::B, Reg::RDI, Reg::RAX); }, "4088c7"},
+    {"mov al, sil", [](Assembler &as) { as.mov(Width::B, Reg::RAX, Reg::RSI); }, "4088f0"},
+    {"mov byte [rax], al", [](Assembler &as) { as.mov(Width::B, mem(Reg::RAX), Reg::RAX); }, "8800"},
+    {"mov byte [rax], sil", [](Assembler &as) { as.mov(Width::B, mem(Reg::RAX), Reg::RSI); }, "408830"},
+    {"mov dil, [rax]", [](Assembler &as) { as.mov(Width::B, Reg::RDI, mem(Reg::RAX)); }, "408a38"},
+    {"mov [r10+r11], r12b", [](Assembler &as) { as.mov(Width::B, CELL, Reg::R12); }, "4788241a"},
+    {"test r12b, r12b", [](Assembler &as) { as.test(Width::B, Reg::R12, Reg::R12); }, "4584e4"},
+    {"test dil, dil", [](Assembler &as) { as.test(Width::B, Reg::RDI, Reg::RDI); }, "4084ff"},
+    {"test eax, eax", [](Assembler &as) { as.test(Width::D, Reg::RAX, Reg::RAX); }, "85c0"},
+    {"inc sil", [](Assembler &as) { as.inc(Width::B, Reg::RSI); }, "40fec6"},
+    {"dec rbx", [](Assembler &as) { as.dec(Width::Q, Reg::RBX); }, "48ffcb"},
+    {"neg r12d", [](Assembler &as) { as.neg(Width::D, Reg::R12); }, "41f7dc"},
+    {"div cl", [](Assembler &as) { as.div(Width::B, Reg::RCX); }, "f6f1"},
+    {"mov r12, rax", [](Assembler &as) { as.mov(Width::Q, Reg::R12, Reg::RAX); }, "4989c4"},
+    {"mov eax, r12d", [](Assembler &as) { as.mov(Width::D, Reg::RAX, Reg::R12); }, "4489e0"},
+    {"movzx r12d, byte [r10+r11]", [](Assembler &as) { as.movzx(Width::B, Reg::R12, CELL); }, "470fb6241a"},
+    {"movzx eax, word [r10+r11*2]",
+     [](Assembler &as) { as.movzx(Width::W, Reg::RAX, mem(Reg::R10, Reg::R11, 2)); }, "430fb7045a"},
+    {"movsx eax, byte [r10+r11]", [](Assembler &as) { as.movsx(Width::B, Reg::RAX, CELL); }, "430fbe041a"},
+    {"push rbx", [](Assembler &as) { as.push(Reg::RBX); }, "53"},
+    {"push r12", [](Assembler &as) { as.push(Reg::R12); }, "4154"},
+    {"pop r15", [](Assembler &as) { as.pop(Reg::R15); }, "415f"},
+    {"imul eax, ecx", [](Assembler &as) { as.imul(Width::D, Reg::RAX, Reg::RCX); }, "0fafc1"},
+    {"imul r12d, eax", [](Assembler &as) { as.imul(Width::D, Reg::R12, Reg::RAX); }, "440fafe0"},
+    {"imul eax, ecx, 3", [](Assembler &as) { as.imul(Width::D, Reg::RAX, Reg::RCX, 3); }, "6bc103"},
+    {"imul eax, ecx, 1000", [](Assembler &as) { as.imul(Width::D, Reg::RAX, Reg::RCX, 1000); }, "69c1e8030000"},
+    {"shl rax, 1", [](Assembler &as) { as.shl(Width::Q, Reg::RAX, 1); }, "48d1e0"},
+    {"shl eax, 3", [](Assembler &as) { as.shl(Width::D, Reg::RAX, 3); }, "c1e003"},
+    {"cmovb r11, rax", [](Assembler &as) { as.cmov(Cond::B, Width::Q, Reg::R11, Reg::RAX); }, "4c0f42d8"},
+
+    /// 64 bit constants, in the shortest move that produces them
+    {"mov eax, 5", [](Assembler &as) { as.movImm(Reg::RAX, 5); }, "b805000000"},
+    {"mov r15d, 0x8000", [](Assembler &as) { as.movImm(Reg::R15, 0x8000); }, "41bf00800000"},
+    {"mov rax, -1", [](Assembler &as) { as.movImm(Reg::RAX, (uint64_t)-1); }, "48c7c0ffffffff"},
+    {"movabs r13, 0x100000000", [](Assembler &as) { as.movImm(Reg::R13, 0x100000000); }, "49bd0000000001000000"},
+
+    /// SSE2, as used by runs of offset updates
+    {"movdqu xmm0, [r10+r11]", [](Assembler &as) { as.movdqu(Xmm::XMM0, CELL); }, "f3430f6f041a"},
+    {"movdqu [r10+r11+0x10], xmm0",
+     [](Assembler &as) { as.movdqu(mem(Reg::R10, Reg::R11, 1, 0x10), Xmm::XMM0); }, "f3430f7f441a10"},
+    {"movdqu xmm8, [rax]", [](Assembler &as) { as.movdqu(Xmm::XMM8, mem(Reg::RAX)); }, "f3440f6f00"},
+    {"movq xmm0, [r10+r11-8]",
+     [](Assembler &as) { as.movq(Xmm::XMM0, mem(Reg::R10, Reg::R11, 1, -8)); }, "f3430f7e441af8"},
+    {"movq [r10+r11], xmm0", [](Assembler &as) { as.movq(CELL, Xmm::XMM0); }, "66430fd6041a"},
+    {"movq xmm2, rax", [](Assembler &as) { as.movq(Xmm::XMM2, Reg::RAX); }, "66480f6ed0"},
+    {"movq xmm9, r12", [](Assembler &as) { as.movq(Xmm::XMM9, Reg::R12); }, "664d0f6ecc"},
+    {"paddb xmm0, xmm1", [](Assembler &as) { as.padd(Width::B, Xmm::XMM0, Xmm::XMM1); }, "660ffcc1"},
+    {"paddw xmm0, xmm1", [](Assembler &as) { as.padd(Width::W, Xmm::XMM0, Xmm::XMM1); }, "660ffdc1"},
+    {"paddd xmm0, xmm1", [](Assembler &as) { as.padd(Width::D, Xmm::XMM0, Xmm::XMM1); }, "660ffec1"},
+    {"paddq xmm10, xmm1", [](Assembler &as) { as.padd(Width::Q, Xmm::XMM10, Xmm::XMM1); }, "66440fd4d1"},
+    {"pand xmm0, xmm1", [](Assembler &as) { as.pand(Xmm::XMM0, Xmm::XMM1); }, "660fdbc1"},
+    {"pxor xmm1, xmm1", [](Assembler &as) { as.pxor(Xmm::XMM1, Xmm::XMM1); }, "660fefc9"},
+    {"punpcklqdq xmm1, xmm2", [](Assembler &as) { as.punpcklqdq(Xmm::XMM1, Xmm::XMM2); }, "660f6cca"},
+
+    /// Jumps: backward ones relax to rel8 when they reach, forward ones are
+    /// rel32 unless marked short, and get patched when the label is bound
+    {"jmp $", [](Assembler &as) {
+         Label label;
+         as.bind(label);
+         as.jmp(label);
+     }, "ebfe"},
+    {"jne $", [](Assembler &as) {
+         Label label;
+         as.bind(label);
+         as.jcc(Cond::NE, label);
+     }, "75fe"},
+    {"jmp $-126 (rel8 -128)", [](Assembler &as) {
+         Label label;
+         as.bind(label);
+         as.nop(126);
+         as.jmp(label);
+     }, "eb80", 126},
+    {"jmp $-127 (rel32)", [](Assembler &as) {
+         Label label;
+         as.bind(label);
+         as.nop(127);
+         as.jmp(label);
+     }, "e97cffffff", 127},
+    {"je $-127 (rel32)", [](Assembler &as) {
+         Label label;
+         as.bind(label);
+         as.nop(127);
+         as.jcc(Cond::E, label);
+     }, "0f847bffffff", 127},
+    {"jmp forward (rel32)", [](Assembler &as) {
+         Label label;
+         as.jmp(label);
+         as.nop(3);
+         as.bind(label);
+     }, "e9030000000f1f00"},
+    {"jmp short forward", [](Assembler &as) {
+         Label label;
+         as.jmp(label, true);
+         as.nop(3);
+         as.bind(label);
+     }, "eb030f1f00"},
+    {"jae short forward", [](Assembler &as) {
+         Label label;
+         as.jcc(Cond::AE, label, true);
+         as.ret();
+         as.bind(label);
+     }, "7301c3"},
+    {"jnz forward (rel32)", [](Assembler &as) {
+         Label label;
+         as.jcc(Cond::NZ, label);
+         as.bind(label);
+     }, "0f8500000000"},
+    {"call forward", [](Assembler &as) {
+         Label label;
+         as.call(label);
+         as.bind(label);
+     }, "e800000000"},
+    {"call $", [](Assembler &as) {
+         Label label;
+         as.bind(label);
+         as.call(label);
+     }, "e8fbffffff"},
+    {"jmp rel32 to 0", [](Assembler &as) { as.jmpRel32(0); }, "e9fbffffff"},
+    {"call r13", [](Assembler &as) { as.call(Reg::R13); }, "41ffd5"},
+    {"jmp rax", [](Assembler &as) { as.jmp(Reg::RAX); }, "ffe0"},
+    {"syscall", [](Assembler &as) { as.syscall(); }, "0f05"},
+    {"nop 11", [](Assembler &as) { as.nop(11); }, "660f1f8400000000006690"},
+    {"align 16 after ret", [](Assembler &as) {
+         as.ret();
+         as.align(16, 15);
+     }, "c3660f1f840000000000660f1f440000"},
+};
+
+static std::string hex(const unsigned char *bytes, size_t length) {
+    std::string result;
+    char digits[3];
+    for (size_t i = 0; i < length; ++i) {
+        snprintf(digits, sizeof(digits), "%02x", bytes[i]);
+        result += digits;
+    }
+    return result;
+}
+
+// A short jump whose label ends up out of range is a bug in the caller
+static bool shortJumpOutOfRangeThrows() {
+    ASMBuf buf(1);
+    Assembler as(buf);
+    Label label;
+    as.jmp(label, true);
+    as.nop(128);
+    try {
+        as.bind(label);
+    } catch (const JITError &) {
+        return true;
+    }
+    return false;
+}
+
+int main() {
+    size_t failures = 0;
+    for (const auto &c : CASES) {
+        ASMBuf buf(1);
+        Assembler as(buf);
+        c.emit(as);
+        const std::string expected = c.expected;
+        const size_t length = as.offset();
+        std::string got;
+        if (length != c.padding + expected.size() / 2) {
+            got = hex(buf.bytes(), length);
+        } else {
+            got = hex(buf.bytes() + c.padding, length - c.padding);
+        }
+        if (got != expected) {
+            std::printf("FAIL %s: expected %s, got %s\n", c.name, c.expected, got.c_str());
+            ++failures;
+        }
+    }
+    if (!shortJumpOutOfRangeThrows()) {
+        std::printf("FAIL short jump out of range didn't throw\n");
+        ++failures;
+    }
+    std::printf("%zu of %zu encodings failed\n", failures, CASES.size() + 1);
+    return failures == 0 ? 0 : 1;
+}
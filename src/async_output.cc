@@ -0,0 +1,168 @@
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "async_output.hpp"
+#include "error.hpp"
+
+AsyncOutput *asyncOutput;
+
+static void futexWait(std::atomic<uint32_t> &word, uint32_t value) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+}
+
+static void futexWake(std::atomic<uint32_t> &word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// Code that exits without unwinding, like a failed lazy compile, still gets its output written
+static void stopAtExit() {
+    if (asyncOutput != nullptr) {
+        asyncOutput->stop();
+    }
+}
+
+AsyncOutput::~AsyncOutput() { stop(); }
+
+void AsyncOutput::start(bool splice) {
+    if (asyncOutput != nullptr) {
+        throw JITError("ICE: Started a second async output");
+    }
+    static bool registeredAtExit = false;
+    if (!registeredAtExit) {
+        registeredAtExit = true;
+        std::atexit(stopAtExit);
+    }
+    /// Whatever stdio holds was printed first
+    fflush(stdout);
+    struct stat st;
+    splice_ = splice && fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode);
+    current_ = 0;
+    length_ = 0;
+    pending_.store(0, std::memory_order_relaxed);
+    writer_ = std::thread([this] { writerLoop(); });
+    running_ = true;
+    asyncOutput = this;
+}
+
+void AsyncOutput::stop() {
+    if (!running_) {
+        return;
+    }
+    flush();
+    pending_.store(STOP, std::memory_order_release);
+    futexWake(pending_);
+    writer_.join();
+    running_ = false;
+    asyncOutput = nullptr;
+}
+
+void AsyncOutput::flush() {
+    handOff(true);
+    waitUntilIdle();
+}
+
+bool AsyncOutput::handOff(bool wait) {
+    if (length_ == 0) {
+        return true;
+    }
+    if (pending_.load(std::memory_order_acquire) != 0) {
+        if (!wait) {
+            return false;
+        }
+        waitUntilIdle();
+    }
+    pending_.store(length_, std::memory_order_release);
+    futexWake(pending_);
+    current_ ^= 1;
+    length_ = 0;
+    return true;
+}
+
+void AsyncOutput::waitUntilIdle() {
+    uint32_t pending;
+    while ((pending = pending_.load(std::memory_order_acquire)) != 0) {
+        futexWait(pending_, pending);
+    }
+}
+
+void AsyncOutput::writerLoop() {
+    /// The writer takes the buffers in the order they are filled
+    unsigned index = 0;
+    /// After a failed write, later output is dropped, as stdio would
+    bool ok = true;
+    while (true) {
+        uint32_t length;
+        while ((length = pending_.load(std::memory_order_acquire)) == 0) {
+            futexWait(pending_, 0);
+        }
+        if (length == STOP) {
+            return;
+        }
+        if (ok) {
+            ok = splice_ && length == BUFFER_SIZE ? spliceBuffer(buffers_[index], length)
+                                                  : writeBuffer(buffers_[index], length);
+        }
+        index ^= 1;
+        pending_.store(0, std::memory_order_release);
+        futexWake(pending_);
+    }
+}
+
+bool AsyncOutput::writeBuffer(const char *data, size_t length) {
+    while (length > 0) {
+        const ssize_t n = write(STDOUT_FILENO, data, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+bool AsyncOutput::spliceBuffer(const char *data, size_t length) {
+    iovec iov{const_cast<char *>(data), length};
+    while (iov.iov_len > 0) {
+        const ssize_t n = vmsplice(STDOUT_FILENO, &iov, 1, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /// Not a pipe we can splice into after all
+            return errno == EINVAL && writeBuffer((const char *)iov.iov_base, iov.iov_len);
+        }
+        iov.iov_base = (char *)iov.iov_base + n;
+        iov.iov_len -= n;
+    }
+    /// The pipe refers to the buffer's pages rather than holding a copy, so
+    /// it can only be filled again once the reader has emptied the pipe.
+    /// Nothing is written after it until then, so the pipe is empty exactly
+    /// when the reader got all of it.
+    int unread;
+    while (ioctl(STDOUT_FILENO, FIONREAD, &unread) == 0 && unread > 0) {
+        pollfd pfd{STDOUT_FILENO, POLLOUT, 0};
+        /// There is no event for an empty pipe, so wait until the reader
+        /// makes room, then back off briefly before looking again
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            return false;
+        }
+        if (pfd.revents & POLLERR) {
+            return false;
+        }
+        usleep(50);
+    }
+    return true;
+}
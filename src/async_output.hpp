@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+// --async-output: the program's output goes into one of two buffers while a
+// writer thread writes the other one to stdout, so that a slow reader only
+// stalls the program once both buffers are full. The buffer is handed to the
+// writer when it fills up, and at newlines if the writer is idle, unless
+// --no-flush was given. Reading input and stopping wait until the writer has
+// written everything, so output comes out in the same order and at the same
+// points as with stdio. With --splice-output, full buffers are moved into a
+// stdout pipe with vmsplice(2) instead of being copied by write(2).
+class AsyncOutput {
+  public:
+    static constexpr size_t BUFFER_SIZE = 64 * 1024;
+
+    AsyncOutput() = default;
+    AsyncOutput(const AsyncOutput &other) = delete;
+    AsyncOutput &operator=(const AsyncOutput &other) = delete;
+    ~AsyncOutput();
+
+    // Start the writer thread and send the runtime's output through it. Only
+    // one can run at a time.
+    void start(bool splice);
+    // Write everything still buffered, and end the writer thread
+    void stop();
+
+    void put(char c) {
+        buffers_[current_][length_++] = c;
+        if (length_ == BUFFER_SIZE) {
+            handOff(true);
+        }
+    }
+    // Hand the buffer to the writer, unless it is still busy with the other one
+    void handOffIfIdle() { handOff(false); }
+    // Wait until everything put so far has been written
+    void flush();
+
+  private:
+    // Hand over the buffer being filled, if it has anything in it. Returns
+    // false if the writer was busy and wait is false.
+    bool handOff(bool wait);
+    void waitUntilIdle();
+    void writerLoop();
+    // Write one buffer to stdout, returning false if stdout is gone
+    bool writeBuffer(const char *data, size_t length);
+    // vmsplice the buffer into the pipe, and wait until the reader took all of it
+    bool spliceBuffer(const char *data, size_t length);
+
+    // Length of the buffer the writer is writing, 0 while it waits for one,
+    // or STOP. Both threads wait on it with futex(2).
+    static constexpr uint32_t STOP = UINT32_MAX;
+    std::atomic<uint32_t> pending_{0};
+    alignas(4096) char buffers_[2][BUFFER_SIZE];
+    // Buffer being filled, and how much of it
+    unsigned current_{0};
+    size_t length_{0};
+    bool splice_{false};
+    bool running_{false};
+    std::thread writer_;
+};
+
+// The one that started last, which mputchar_async and friends write to
+extern AsyncOutput *asyncOutput;
@@ -0,0 +1,243 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#include "batch.hpp"
+#include "error.hpp"
+#include "interpreter.hpp"
+#include "runtime.hpp"
+
+template <typename Lanes> static bool any(const Lanes &lanes) {
+    typename Lanes::value_type bits = 0;
+    for (auto lane : lanes) {
+        bits |= lane;
+    }
+    return bits != 0;
+}
+
+template <typename CellType>
+BatchRunner<CellType>::BatchRunner(const std::vector<Instruction> &prog, Tape<CellType> &scalarTape,
+                                   const Arguments &args)
+    : prog_{prog}, args_{args}, scalarTape_{scalarTape}, tapeLength_{scalarTape.size()},
+      lanes_{tapeLength_ * LANES, args.hugePages}, jumps_(prog.size()) {
+    std::vector<size_t> open;
+    for (size_t i = 0; i < prog.size(); ++i) {
+        const auto &ins = prog[i];
+        switch (ins.code_) {
+        case IROpCode::LOOP:
+        case IROpCode::IF:
+            open.push_back(i);
+            break;
+        case IROpCode::END_LOOP:
+        case IROpCode::END_IF:
+            if (open.empty()) {
+                throw JITError("ICE: Unmatched ", ins.code_, " at ", i);
+            }
+            jumps_[i] = open.back();
+            jumps_[open.back()] = i;
+            open.pop_back();
+            break;
+        case IROpCode::MUL:
+            reach_ = std::max(reach_, (size_t)std::abs(ins.a_));
+            break;
+        default:
+            break;
+        }
+    }
+    if (args.getCharBehaviour == GetCharBehaviour::EOF_RETURNS_0) {
+        eofValue_ = 0;
+    } else if (args.getCharBehaviour == GetCharBehaviour::EOF_RETURNS_255) {
+        eofValue_ = 255;
+    }
+    for (auto &io : io_) {
+        io.inputClosed = true;
+        io.eofBehaviour = args.getCharBehaviour;
+    }
+}
+
+template <typename CellType> void BatchRunner<CellType>::run() {
+    char *line = nullptr;
+    size_t capacity = 0;
+    for (bool more = true; more;) {
+        size_t count = 0;
+        for (; count < LANES; ++count) {
+            const ssize_t length = getline(&line, &capacity, stdin);
+            if (length < 0) {
+                more = false;
+                break;
+            }
+            io_[count].input.assign(line, length);
+            io_[count].inputPos = 0;
+        }
+        if (count == 0) {
+            break;
+        }
+        runLanes(count);
+        for (size_t lane = 0; lane < count; ++lane) {
+            auto &output = io_[lane].output;
+            fwrite(output.data(), 1, output.size(), stdout);
+            output.clear();
+        }
+        if (!args_.noFlush) {
+            fflush(stdout);
+        }
+        records_ += count;
+    }
+    free(line);
+    fflush(stdout);
+}
+
+template <typename CellType> void BatchRunner<CellType>::runLanes(size_t count) {
+    Lanes mask{};
+    for (size_t lane = 0; lane < count; ++lane) {
+        mask[lane] = ~Cell{0};
+    }
+    frames_.clear();
+    size_t dp = 0;
+    minDp_ = maxDp_ = 0;
+    for (size_t i = 0; i < prog_.size(); ++i) {
+        const auto &ins = prog_[i];
+        Cell *cells = row(dp);
+        switch (ins.code_) {
+        case IROpCode::ADD: {
+            const Cell a = ins.a_;
+            for (size_t lane = 0; lane < LANES; ++lane) {
+                cells[lane] += a & mask[lane];
+            }
+        } break;
+        case IROpCode::MUL: {
+            Cell *target = row(wrapOffset(dp + ins.a_, tapeLength_));
+            const Cell b = ins.b_;
+            for (size_t lane = 0; lane < LANES; ++lane) {
+                target[lane] += Cell((unsigned)b * cells[lane]) & mask[lane];
+            }
+        } break;
+        case IROpCode::CONST: {
+            const Cell a = ins.a_;
+            for (size_t lane = 0; lane < LANES; ++lane) {
+                cells[lane] = (cells[lane] & ~mask[lane]) | (a & mask[lane]);
+            }
+        } break;
+        case IROpCode::DIVMOD:
+        case IROpCode::CMP:
+            /// The loop after it gets the same result, see idioms.hpp
+            break;
+        case IROpCode::ADP:
+            dp = wrapOffset(dp + ins.a_, tapeLength_);
+            minDp_ = std::min(minDp_, dp);
+            maxDp_ = std::max(maxDp_, dp);
+            break;
+        case IROpCode::IN:
+            for (size_t lane = 0; lane < LANES; ++lane) {
+                if (!mask[lane]) {
+                    continue;
+                }
+                auto &io = io_[lane];
+                if (io.inputPos < io.input.size()) {
+                    cells[lane] = (unsigned char)io.input[io.inputPos++];
+                } else if (eofValue_) {
+                    cells[lane] = *eofValue_;
+                }
+            }
+            break;
+        case IROpCode::OUT:
+            for (size_t lane = 0; lane < LANES; ++lane) {
+                if (mask[lane]) {
+                    io_[lane].output.push_back((char)cells[lane]);
+                }
+            }
+            break;
+        case IROpCode::LOOP:
+        case IROpCode::IF: {
+            Lanes entering, skipping;
+            for (size_t lane = 0; lane < LANES; ++lane) {
+                entering[lane] = cells[lane] != 0 ? mask[lane] : 0;
+                skipping[lane] = mask[lane] & ~entering[lane];
+            }
+            if (!any(entering)) {
+                i = jumps_[i];
+                break;
+            }
+            /// The lanes that skip it wait at its end, where the data pointer is still dp
+            frames_.push_back({skipping, dp});
+            mask = entering;
+        } break;
+        case IROpCode::END_LOOP: {
+            Lanes staying, leaving;
+            for (size_t lane = 0; lane < LANES; ++lane) {
+                staying[lane] = cells[lane] != 0 ? mask[lane] : 0;
+                leaving[lane] = mask[lane] & ~staying[lane];
+            }
+            auto &frame = frames_.back();
+            join(frame, leaving, i + 1, dp);
+            if (any(staying)) {
+                mask = staying;
+                i = jumps_[i];
+            } else {
+                mask = frame.waiting;
+                dp = frame.dp;
+                frames_.pop_back();
+            }
+        } break;
+        case IROpCode::END_IF: {
+            auto &frame = frames_.back();
+            join(frame, mask, i + 1, dp);
+            mask = frame.waiting;
+            dp = frame.dp;
+            frames_.pop_back();
+        } break;
+        default:
+            throw JITError("ICE: Unhandled instruction");
+        }
+    }
+    /// Only the rows the records could have reached need zeroing for the next ones
+    const auto [low, high] = reachedRows();
+    std::fill(row(low), row(high) + LANES, 0);
+}
+
+template <typename CellType> std::pair<size_t, size_t> BatchRunner<CellType>::reachedRows() const {
+    const ssize_t low = (ssize_t)minDp_ - (ssize_t)reach_;
+    const size_t high = maxDp_ + reach_;
+    if (low < 0 || high >= tapeLength_) {
+        return {0, tapeLength_ - 1};
+    }
+    return {low, high};
+}
+
+template <typename CellType>
+void BatchRunner<CellType>::join(Frame &frame, const Lanes &lanes, size_t pc, size_t dp) {
+    if (!any(lanes)) {
+        return;
+    }
+    if (any(frame.waiting) && frame.dp != dp) {
+        for (size_t lane = 0; lane < LANES; ++lane) {
+            if (lanes[lane]) {
+                fallBack(lane, pc, dp);
+            }
+        }
+        return;
+    }
+    for (size_t lane = 0; lane < LANES; ++lane) {
+        frame.waiting[lane] |= lanes[lane];
+    }
+    frame.dp = dp;
+}
+
+template <typename CellType> void BatchRunner<CellType>::fallBack(size_t lane, size_t pc, size_t dp) {
+    /// The rest of the lane's tape is still zero
+    const auto [low, high] = reachedRows();
+    std::fill(scalarTape_.data(), scalarTape_.data() + tapeLength_, 0);
+    const Cell *cells = row(0) + lane;
+    for (size_t i = low; i <= high; ++i) {
+        scalarTape_[i] = cells[i * LANES];
+    }
+    /// Its input is all there, so it runs to the end without suspending
+    currentSessionIO = &io_[lane];
+    interpretSuspendable(prog_, scalarTape_, args_, pc, dp, stop_, fuel_);
+    currentSessionIO = nullptr;
+    ++fallbacks_;
+}
+
+template class BatchRunner<char>;
+template class BatchRunner<short>;
+template class BatchRunner<int>;
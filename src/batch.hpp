@@ -0,0 +1,82 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <csignal>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "arguments.hpp"
+#include "ir.hpp"
+#include "runtime.hpp"
+#include "tape.hpp"
+
+// --batch: run the program once for each line of stdin, with the line as its
+// whole input, and write the outputs to stdout in the same order. LANES
+// records run at a time in lockstep, on tapes interleaved so that each cell
+// index is a row of LANES cells, one per record, which the compiler turns
+// into vector instructions. Every record runs the same instruction, masked
+// to the lanes that are active: a loop runs while any lane's cell is
+// nonzero, and the lanes that leave it early wait at its end. Lanes that
+// leave a loop with a different data pointer than the ones already waiting
+// there can't continue in lockstep, so they are finished one at a time by
+// interpretSuspendable() on a tape of their own.
+template <typename CellType> class BatchRunner {
+  public:
+    // A 256 bit AVX2 register's worth of cells
+    static constexpr size_t LANES = 32 / sizeof(CellType);
+
+    // scalarTape is where lanes that fall back to the scalar interpreter run,
+    // and its length is each record's tape length
+    BatchRunner(const std::vector<Instruction> &prog, Tape<CellType> &scalarTape, const Arguments &args);
+    BatchRunner(const BatchRunner &other) = delete;
+    BatchRunner &operator=(const BatchRunner &other) = delete;
+    // Run every line of stdin
+    void run();
+    size_t records() const { return records_; }
+    size_t fallbacks() const { return fallbacks_; }
+
+  private:
+    using Cell = std::make_unsigned_t<CellType>;
+    // Each lane's cell in a row, or each lane's bit in a mask, which is all ones or zero
+    using Lanes = std::array<Cell, LANES>;
+    // A LOOP or IF that the active lanes are in, with the lanes waiting at its end
+    struct Frame {
+        Lanes waiting;
+        size_t dp;
+    };
+
+    // Run the records in the first count lanes, starting from zeroed tapes
+    void runLanes(size_t count);
+    // Move lanes that reached the end of frame's loop with the data pointer
+    // at dp to its waiting lanes, or finish them from pc if they disagree
+    void join(Frame &frame, const Lanes &lanes, size_t pc, size_t dp);
+    void fallBack(size_t lane, size_t pc, size_t dp);
+    // The first and last row that the lanes could have changed so far
+    std::pair<size_t, size_t> reachedRows() const;
+    Cell *row(size_t dp) { return reinterpret_cast<Cell *>(lanes_.data()) + dp * LANES; }
+
+    const std::vector<Instruction> &prog_;
+    const Arguments &args_;
+    Tape<CellType> &scalarTape_;
+    const size_t tapeLength_;
+    Tape<CellType> lanes_;
+    // The other end of each LOOP, END_LOOP, IF and END_IF
+    std::vector<size_t> jumps_;
+    // How far from the data pointer MULs reach, and how far the data pointer
+    // went, which bound the rows that the lanes changed
+    size_t reach_{};
+    size_t minDp_{};
+    size_t maxDp_{};
+    std::vector<Frame> frames_;
+    // What IN reads at the end of a record, or nothing to leave the cell as it is
+    std::optional<Cell> eofValue_;
+    std::array<SessionIO, LANES> io_;
+    // Never set or used up, since --batch has no --fuel or --time-limit
+    volatile sig_atomic_t stop_{};
+    uint64_t fuel_{UINT64_MAX};
+    size_t records_{};
+    size_t fallbacks_{};
+};
@@ -1,552 +1,1584 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <map>
 #include <optional>
+#include <sys/syscall.h>
 #include <stack>
 #include <tuple>
+#include <type_traits>
 #include <vector>
 
 #include "code_generator.hpp"
+#include "elf_writer.hpp"
+#include "idioms.hpp"
 #include "runtime.hpp"
 
 // Instructions in these comments use intel syntax
 //
 // Register model:
+// rax, rcx and rdi are scratch registers, and so are xmm0-xmm2
+// rdx counts down the inline iterations of strided loops
+// rbx is the loop iterations left before the next safepoint poll, with --fuel or --time-limit
 // r10 = &bfMem[0]
 // r11 is the index into bfMem_
-// r12 is sometimes used to store the value of the current cell
+// r12 is sometimes used to store the value of the current cell (tracked by cellInR12_)
 // r13 is the address of mputchar
 // r14 is the address of mgetc
 // r15 is (BFMEM_LENGTH-1) if IS_POW_2_MEM_LENGTH, else it is BFMEM_LENGTH
 
 template <typename CellType>
-ASMBufOffset CodeGenerator<CellType>::compile(const std::vector<Instruction> &prog) {
-    std::vector<std::pair<ASMBufOffset, Instruction>> symbolMap;
+ASMBufOffset CodeGenerator<CellType>::compile(const std::vector<Instruction> &prog, size_t dp) {
+    SymbolMap symbolMap;
     buf_.set_executable(false);
     const auto startOffset = buf_.current_offset();
-    symbolMap.emplace_back(startOffset, Instruction{});
-    generatePrelude();
-    for (auto ins : prog) {
+    symbolMap.emplace_back(startOffset, Instruction{}, "jit_prelude");
+    recordIrOffset(NOT_IR);
+    generatePrelude((uintptr_t)bfMem_.data(), (uintptr_t)putChar_, (uintptr_t)getChar_, dp);
+    cellInR12_ = false;
+    loopNest_.clear();
+    epilogue_ = Label{};
+    findHotLoops(prog);
+    if (lazy_) {
+        // Stubs refer back into the program, so keep our own copy of it
+        lazyProg_ = prog;
+    }
+    const auto &generated = lazy_ ? lazyProg_ : prog;
+    findOutlinedLoops(generated);
+    generateRange(generated, 0, generated.size(), lazy_, symbolMap);
+    symbolMap.emplace_back(buf_.current_offset(), Instruction{}, "jit_epilogue");
+    recordIrOffset(NOT_IR);
+    as_.bind(epilogue_);
+    generateEpilogue();
+    generateOutOfLineCode(generated, symbolMap);
+    if (safepointsEnabled_ && !resumeTrampoline_) {
+        symbolMap.emplace_back(buf_.current_offset(), Instruction{}, "jit_resume");
+        recordIrOffset(NOT_IR);
+        generateResumeTrampoline();
+    }
+    symbolMap.emplace_back(buf_.current_offset(), Instruction{}, nullptr);
+    writePerfMap(symbolMap);
+    return startOffset;
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::compileElf(const std::vector<Instruction> &prog, const std::string &path) {
+    elf_ = true;
+    /// The executable's own IO routines go first, so the prelude knows where they are
+    Label flush;
+    generateElfFlush(flush);
+    const uintptr_t putChar = ELF_CODE_BASE + as_.offset();
+    generateElfPutChar(flush);
+    const uintptr_t getChar = ELF_CODE_BASE + as_.offset();
+    generateElfGetChar(flush);
+    Label program;
+    as_.align(16, 15);
+    as_.bind(program);
+    generatePrelude(ELF_BSS_BASE + ELF_TAPE, putChar, getChar);
+    cellInR12_ = false;
+    findHotLoops(prog);
+    findOutlinedLoops(prog);
+    SymbolMap symbolMap;
+    generateRange(prog, 0, prog.size(), false, symbolMap);
+    generateEpilogue();
+    generateOutOfLineCode(prog, symbolMap);
+    /// _start: the stack is 16 byte aligned on entry, so calling the program
+    /// leaves it as the prelude expects
+    const ASMBufOffset entry = as_.offset();
+    as_.call(program);
+    as_.call(flush);
+    as_.movImm(Reg::RAX, SYS_exit);
+    as_.xor_(Width::D, Reg::RDI, Reg::RDI);
+    as_.syscall();
+    writeElf(path, buf_, entry, BFMEM_LENGTH * sizeof(CellType));
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateElfFlush(Label &flush) {
+    /// Write out the output buffer, giving up on errors
+    Label loop, done;
+    as_.bind(flush);
+    as_.movImm(Reg::RSI, ELF_BSS_BASE);
+    as_.mov(Width::Q, Reg::RDX, mem(Reg::RSI, ELF_OUT_LEN));
+    as_.lea(Width::Q, Reg::RSI, mem(Reg::RSI, ELF_OUT_BUF));
+    as_.test(Width::Q, Reg::RDX, Reg::RDX);
+    as_.jcc(Cond::Z, done, true);
+    as_.bind(loop);
+    as_.movImm(Reg::RAX, SYS_write);
+    as_.movImm(Reg::RDI, STDOUT_FILENO);
+    as_.syscall();
+    as_.test(Width::Q, Reg::RAX, Reg::RAX);
+    as_.jcc(Cond::LE, done, true);
+    as_.add(Width::Q, Reg::RSI, Reg::RAX);
+    as_.sub(Width::Q, Reg::RDX, Reg::RAX);
+    as_.jcc(Cond::NZ, loop, true);
+    as_.bind(done);
+    as_.movImm(Reg::RSI, ELF_BSS_BASE);
+    as_.mov(Width::Q, mem(Reg::RSI, ELF_OUT_LEN), 0);
+    as_.ret();
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateElfPutChar(Label &flush) {
+    /// Buffer the character in dil, flushing when the buffer is full, and
+    /// after newlines unless --no-flush was given
+    as_.movImm(Reg::RSI, ELF_BSS_BASE);
+    as_.mov(Width::Q, Reg::RAX, mem(Reg::RSI, ELF_OUT_LEN));
+    as_.mov(Width::B, mem(Reg::RSI, Reg::RAX, 1, ELF_OUT_BUF), Reg::RDI);
+    as_.inc(Width::Q, Reg::RAX);
+    as_.mov(Width::Q, mem(Reg::RSI, ELF_OUT_LEN), Reg::RAX);
+    as_.cmp(Width::Q, Reg::RAX, ELF_IO_BUF_SIZE);
+    as_.jcc(Cond::E, flush);
+    if (!noFlush_) {
+        as_.cmp(Width::B, Reg::RDI, '\n');
+        as_.jcc(Cond::E, flush);
+    }
+    as_.ret();
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateElfGetChar(Label &flush) {
+    /// Flush pending output so prompts show up, then return the next buffered
+    /// input byte, refilling the buffer when it runs out. edi holds the
+    /// current cell, for --eof-behaviour dont-modify.
+    Label have, eof;
+    as_.push(Reg::RDI);
+    as_.call(flush);
+    as_.pop(Reg::RDI);
+    as_.movImm(Reg::RSI, ELF_BSS_BASE);
+    as_.mov(Width::Q, Reg::RCX, mem(Reg::RSI, ELF_IN_POS));
+    as_.cmp(Width::Q, Reg::RCX, mem(Reg::RSI, ELF_IN_LEN));
+    as_.jcc(Cond::L, have, true);
+    as_.push(Reg::RDI);
+    as_.movImm(Reg::RAX, SYS_read);
+    as_.movImm(Reg::RDI, STDIN_FILENO);
+    as_.lea(Width::Q, Reg::RSI, mem(Reg::RSI, ELF_IN_BUF));
+    as_.movImm(Reg::RDX, ELF_IO_BUF_SIZE);
+    as_.syscall();
+    as_.pop(Reg::RDI);
+    as_.movImm(Reg::RSI, ELF_BSS_BASE);
+    as_.test(Width::Q, Reg::RAX, Reg::RAX);
+    as_.jcc(Cond::LE, eof, true);
+    as_.mov(Width::Q, mem(Reg::RSI, ELF_IN_LEN), Reg::RAX);
+    as_.xor_(Width::D, Reg::RCX, Reg::RCX);
+    as_.bind(have);
+    as_.movzx(Width::B, Reg::RAX, mem(Reg::RSI, Reg::RCX, 1, ELF_IN_BUF));
+    as_.inc(Width::Q, Reg::RCX);
+    as_.mov(Width::Q, mem(Reg::RSI, ELF_IN_POS), Reg::RCX);
+    as_.ret();
+    as_.bind(eof);
+    switch (getCharBehaviour) {
+    case GetCharBehaviour::EOF_RETURNS_0:
+        as_.xor_(Width::D, Reg::RAX, Reg::RAX);
+        break;
+    case GetCharBehaviour::EOF_RETURNS_255:
+        as_.movImm(Reg::RAX, 255);
+        break;
+    case GetCharBehaviour::EOF_DOESNT_MODIFY:
+        as_.mov(Width::D, Reg::RAX, Reg::RDI);
+        break;
+    }
+    as_.ret();
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateRange(const std::vector<Instruction> &prog, size_t begin, size_t end,
+                                            bool lazyLoops, SymbolMap &symbolMap) {
+    for (size_t i = begin; i < end; ++i) {
+        const auto &ins = prog[i];
         // std::cout << "Instruction: " << ins << '\n';
         if (genPerfMap_) {
-            symbolMap.emplace_back(buf_.current_offset(), ins);
+            symbolMap.emplace_back(buf_.current_offset(), ins, nullptr);
+        }
+        recordIrOffset(i);
+        if (lazyLoops && ins.code_ == IROpCode::LOOP) {
+            const size_t loopEnd = matchingEndLoop(prog, i);
+            generateLazyLoopStub(i, loopEnd + 1);
+            i = loopEnd;
+            continue;
+        }
+        if ((ins.code_ == IROpCode::LOOP || ins.code_ == IROpCode::IF) && isColdLoop(ins)) {
+            /// Loops that the profile says never run go out of line, entered
+            /// by a forward branch and leaving a zero cell in r12 either way
+            const size_t loopEnd = matchingEndLoop(prog, i);
+            if (!cellInR12_) {
+                generateLoopLoadTest();
+            } else {
+                generateLoopTest();
+            }
+            generateColdPath(Cond::NZ, true, [this, &prog, i, loopEnd, lazyLoops, &symbolMap] {
+                generateLoopStart(prog, i);
+                generateRange(prog, i + 1, loopEnd + 1, lazyLoops, symbolMap);
+            });
+            i = loopEnd;
+            continue;
+        }
+        if (ins.code_ == IROpCode::LOOP && outlinedIndex_[i] != NOT_OUTLINED) {
+            /// Outlined loops leave the (zero) cell in r12, like any other
+            auto &outlined = outlinedLoops_[outlinedIndex_[i]];
+            if (!outlined.called) {
+                outlined.called = true;
+                pendingOutlined_.push_back(outlinedIndex_[i]);
+            }
+            as_.call(outlined.entry);
+            cellInR12_ = true;
+            i = matchingEndLoop(prog, i);
+            continue;
         }
         switch (ins.code_) {
         case IROpCode::ADD:
-            generateInsAdd(ins.a_);
-            break;
         case IROpCode::ADP:
-            generateInsAdp(ins.a_);
-            break;
-        case IROpCode::MUL:
-            generateInsMul(ins.a_, ins.b_);
+        case IROpCode::CONST: {
+            size_t runEnd = i + 1;
+            while (runEnd < end && (prog[runEnd].code_ == IROpCode::ADD || prog[runEnd].code_ == IROpCode::ADP ||
+                                    prog[runEnd].code_ == IROpCode::CONST)) {
+                ++runEnd;
+            }
+            generateRun(prog, i, runEnd);
+            i = runEnd - 1;
             break;
-        case IROpCode::CONST:
-            generateInsConst(ins.a_);
+        }
+        case IROpCode::MUL: {
+            size_t groupEnd = i + 1;
+            while (groupEnd < end && prog[groupEnd].code_ == IROpCode::MUL) {
+                ++groupEnd;
+            }
+            generateMulGroup(prog, i, groupEnd);
+            i = groupEnd - 1;
             break;
+        }
         case IROpCode::OUT:
             generateInsOut();
             break;
         case IROpCode::IN:
             generateInsIn();
             break;
+        case IROpCode::DIVMOD:
+            generateInsDivMod(ins);
+            break;
+        case IROpCode::CMP:
+            generateInsCompare(ins);
+            break;
         case IROpCode::LOOP:
-            generateInsLoop(ins.a_);
+        case IROpCode::IF:
+            generateLoopStart(prog, i);
             break;
         case IROpCode::END_LOOP:
             generateInsEndLoop(ins.a_);
+            loopNest_.pop_back();
+            break;
+        case IROpCode::END_IF:
+            generateInsEndIf(ins.a_);
             break;
         default:
             throw JITError("ICE: Unhandled instruction");
         }
     }
-    symbolMap.emplace_back(buf_.current_offset(), Instruction{});
-    generateEpilogue();
-    symbolMap.emplace_back(buf_.current_offset(), Instruction{});
-    if (genPerfMap_) {
-        // FIXME: make this work across multiple calls to compile()
-        for (auto i = 0u; i + 1 < symbolMap.size(); ++i) {
-            const ASMBufOffset start = symbolMap[i].first;
-            const ASMBufOffset end = symbolMap[i+1].first;
-            const size_t size = end - start;
-            perfSymbolMap_
-                << std::hex << buf_.address_at_offset(start) << ' '
-                << size << ' ' << std::dec;
-            if (i == 0) {
-                perfSymbolMap_ << "jit_prelude\n";
-            } else if (i + 2 == symbolMap.size()) {
-                perfSymbolMap_ << "jit_epilogue\n";
-            } else {
-                perfSymbolMap_ << "JIT OP: #" << i << ' ' << symbolMap[i].second << '\n';
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateLoopStart(const std::vector<Instruction> &prog, size_t i) {
+    const auto &ins = prog[i];
+    if (ins.code_ == IROpCode::IF) {
+        generateInsIf(ins.a_);
+        return;
+    }
+    loopNest_.push_back(ins.a_);
+    loopLabels_[ins.a_].tripFactor =
+        safepointsEnabled_ && !elf_ ? countedLoopTripFactor(prog, i) : std::nullopt;
+    if (auto inlineTrips = stridedLoopInlineTrips(ins)) {
+        generateInsLoop(ins.a_, &stridedLoops_.emplace_back(prog, i, BFMEM_LENGTH), *inlineTrips);
+    } else {
+        generateInsLoop(ins.a_);
+    }
+}
+
+template <typename CellType>
+std::optional<uint32_t> CodeGenerator<CellType>::countedLoopTripFactor(const std::vector<Instruction> &prog,
+                                                                      size_t loopStart) const {
+    /// Wider cells allow too many trips to go without polling the stop flag
+    if (sizeof(CellType) > 2 || prog[loopStart].b_) {
+        return std::nullopt;
+    }
+    /// The loop must come back to its cell and only ever add the same
+    /// step to it, with nothing inside that might not terminate
+    ssize_t offset = 0;
+    uint32_t step = 0;
+    for (size_t i = loopStart + 1; prog[i].code_ != IROpCode::END_LOOP; ++i) {
+        const auto &ins = prog[i];
+        const bool atCell = wrapOffset(offset, BFMEM_LENGTH) == 0;
+        switch (ins.code_) {
+        case IROpCode::ADD:
+            step += atCell ? ins.a_ : 0;
+            break;
+        case IROpCode::ADP:
+            offset += ins.a_;
+            break;
+        case IROpCode::MUL:
+            if (wrapOffset(offset + ins.a_, BFMEM_LENGTH) == 0) {
+                return std::nullopt;
+            }
+            break;
+        case IROpCode::CONST:
+            if (atCell) {
+                return std::nullopt;
             }
+            break;
+        case IROpCode::OUT:
+            break;
+        default:
+            return std::nullopt;
         }
     }
-    return startOffset;
+    if (wrapOffset(offset, BFMEM_LENGTH) != 0 || step % 2 == 0) {
+        return std::nullopt;
+    }
+    /// An odd step goes through every value of the cell before reaching zero,
+    /// after cell * (-step)^-1 trips. Each Newton step doubles the correct low
+    /// bits of the inverse, starting from the 3 that an odd number gets right.
+    const uint32_t negStep = -step;
+    uint32_t inverse = negStep;
+    for (int i = 0; i < 4; ++i) {
+        inverse *= 2 - negStep * inverse;
+    }
+    return inverse & std::numeric_limits<std::make_unsigned_t<CellType>>::max();
+}
+
+template <typename CellType>
+size_t CodeGenerator<CellType>::matchingEndLoop(const std::vector<Instruction> &prog, size_t loopStart) {
+    size_t depth = 0;
+    for (size_t i = loopStart; i < prog.size(); ++i) {
+        if (prog[i].code_ == IROpCode::LOOP || prog[i].code_ == IROpCode::IF) {
+            ++depth;
+        } else if ((prog[i].code_ == IROpCode::END_LOOP || prog[i].code_ == IROpCode::END_IF) && --depth == 0) {
+            return i;
+        }
+    }
+    throw JITError("ICE: Unmatched loop at instruction ", loopStart);
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::writePerfMap(const SymbolMap &symbolMap) {
+    if (!genPerfMap_) {
+        return;
+    }
+    for (auto i = 0u; i + 1 < symbolMap.size(); ++i) {
+        const auto &[start, ins, name] = symbolMap[i];
+        const ASMBufOffset end = std::get<0>(symbolMap[i+1]);
+        const size_t size = end - start;
+        perfSymbolMap_
+            << std::hex << buf_.address_at_offset(start) << ' '
+            << size << ' ' << std::dec;
+        if (name != nullptr) {
+            perfSymbolMap_ << name << '\n';
+        } else {
+            perfSymbolMap_ << "JIT OP: #" << i << ' ' << ins << '\n';
+        }
+    }
+    perfSymbolMap_.flush();
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::findHotLoops(const std::vector<Instruction> &prog) {
+    if (profile_) {
+        /// With a profile, hot loops are the ones that ran a noticeable share of all iterations
+        const uint64_t total = profile_->totalIterations();
+        for (const auto &ins : prog) {
+            const LoopProfile *loop;
+            if (ins.code_ == IROpCode::LOOP && (loop = profile_->find(ins.a_)) && loop->iterations > 0 &&
+                loop->iterations * PROFILE_HOT_LOOP_SHARE >= total) {
+                hotLoops_.insert(ins.a_);
+            }
+        }
+        return;
+    }
+    /// Otherwise guess that innermost loops are hot
+    std::vector<std::pair<int, bool>> openLoops;
+    for (const auto &ins : prog) {
+        if (ins.code_ == IROpCode::LOOP) {
+            if (!openLoops.empty()) {
+                openLoops.back().second = false;
+            }
+            openLoops.emplace_back(ins.a_, true);
+        } else if (ins.code_ == IROpCode::END_LOOP && !openLoops.empty()) {
+            if (openLoops.back().second) {
+                hotLoops_.insert(openLoops.back().first);
+            }
+            openLoops.pop_back();
+        }
+    }
+}
+
+template <typename CellType>
+bool CodeGenerator<CellType>::isColdLoop(const Instruction &loop) const {
+    const LoopProfile *profile = profile_ ? profile_->find(loop.a_) : nullptr;
+    return profile && profile->iterations == 0;
+}
+
+template <typename CellType>
+bool CodeGenerator<CellType>::isColdIO() const {
+    /// IO is cold unless it is in a hot loop, since it runs once per visit otherwise
+    return loopNest_.empty() || !hotLoops_.count(loopNest_.back());
+}
+
+/// Cold code is jumped to from the hot path:
+///     jcc cold          (or jmp)
+///   resume:
+///     ...
+///   cold:               <- after the epilogue
+///     ...
+///     jmp resume
+template <typename CellType>
+typename CodeGenerator<CellType>::ColdStub &
+CodeGenerator<CellType>::generateColdPath(std::optional<Cond> cond, bool cellInR12AtResume,
+                                          std::function<void()> generate, bool bindResume) {
+    auto &stub = coldStubs_.emplace_back();
+    stub.cellInR12 = cellInR12_;
+    stub.cellInR12AtResume = cellInR12AtResume;
+    stub.irIndex = currentIr_;
+    stub.generate = std::move(generate);
+    if (cond) {
+        as_.jcc(*cond, stub.entry);
+    } else {
+        as_.jmp(stub.entry);
+    }
+    if (bindResume) {
+        as_.bind(stub.resume);
+    }
+    cellInR12_ = cellInR12AtResume;
+    return stub;
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateColdCode(SymbolMap &symbolMap) {
+    /// Stubs can add more stubs, like the IO in a cold loop, which go at the end
+    for (size_t i = 0; i < coldStubs_.size(); ++i) {
+        auto &stub = coldStubs_[i];
+        if (genPerfMap_) {
+            symbolMap.emplace_back(buf_.current_offset(), Instruction{}, "jit_cold_code");
+        }
+        recordIrOffset(stub.irIndex);
+        as_.bind(stub.entry);
+        cellInR12_ = stub.cellInR12;
+        stub.generate();
+        if (stub.cellInR12AtResume && !cellInR12_) {
+            generateLoadCell();
+        }
+        as_.jmp(stub.resume);
+    }
+    coldStubs_.clear();
+}
+
+/// Loops that occur more than once, like the ones that compilers targeting
+/// brainfuck repeat all over the program, are generated once as a subroutine:
+///     call outlined             <- at each occurrence
+///     ...
+///   outlined:                  <- after the epilogue, like cold code
+///     push rax                  ; keeps calls out of the loop 16 byte aligned
+///     <the loop>
+///     pop rax
+///     ret
+/// Two loops are the same if they differ only in their loop numbers, which
+/// is found by hashing each loop with the loops inside it hashed already.
+/// Loops that are short, or short and hot, stay inline, and so do loops
+/// inside another outlined loop that only occur inside it. Safepoints leave
+/// through the epilogue, and can't resume inside a subroutine, so outlining
+/// is off with --fuel, --time-limit and --serve.
+template <typename CellType>
+void CodeGenerator<CellType>::findOutlinedLoops(const std::vector<Instruction> &prog) {
+    outlinedIndex_.assign(prog.size(), NOT_OUTLINED);
+    outlinedLoops_.clear();
+    pendingOutlined_.clear();
+    if (safepointsEnabled_ && !elf_) {
+        return;
+    }
+    auto mix = [](uint64_t hash, uint64_t value) {
+        hash ^= value + 0x9e3779b97f4a7c15 + (hash << 6) + (hash >> 2);
+        return hash * 0xff51afd7ed558ccd;
+    };
+    /// Each open loop's start and hash so far, innermost last
+    std::vector<std::pair<size_t, uint64_t>> open;
+    std::unordered_map<uint64_t, std::vector<size_t>> loopsByHash;
+    std::vector<size_t> loopEnd(prog.size());
+    for (size_t i = 0; i < prog.size(); ++i) {
+        const auto &ins = prog[i];
+        const bool isStart = ins.code_ == IROpCode::LOOP || ins.code_ == IROpCode::IF;
+        const bool isEnd = ins.code_ == IROpCode::END_LOOP || ins.code_ == IROpCode::END_IF;
+        if (isStart) {
+            open.emplace_back(i, 0);
+        }
+        if (open.empty()) {
+            continue;
+        }
+        auto &hash = open.back().second;
+        hash = mix(hash, (uint64_t)ins.code_);
+        if (!isStart && !isEnd) {
+            hash = mix(mix(hash, (uint32_t)ins.a_), (uint32_t)ins.b_);
+        } else if (isStart) {
+            hash = mix(hash, (uint32_t)ins.b_);
+        } else {
+            const auto [begin, loopHash] = open.back();
+            open.pop_back();
+            loopEnd[begin] = i;
+            if (ins.code_ == IROpCode::END_LOOP) {
+                loopsByHash[loopHash].push_back(begin);
+            }
+            if (!open.empty()) {
+                open.back().second = mix(open.back().second, loopHash);
+            }
+        }
+    }
+    /// Group the loops that are the same, and count the occurrences of each
+    std::vector<std::vector<size_t>> groups;
+    std::vector<size_t> groupOf(prog.size(), NOT_OUTLINED);
+    for (const auto &[hash, loops] : loopsByHash) {
+        if (loops.size() < 2) {
+            continue;
+        }
+        const size_t firstGroup = groups.size();
+        for (size_t begin : loops) {
+            const size_t length = loopEnd[begin] - begin + 1;
+            size_t g = firstGroup;
+            while (g < groups.size() && !sameLoop(prog, groups[g].front(), begin, length)) {
+                ++g;
+            }
+            if (g == groups.size()) {
+                groups.emplace_back();
+            }
+            groups[g].push_back(begin);
+            groupOf[begin] = g;
+        }
+    }
+    std::vector<size_t> order(groups.size());
+    std::vector<size_t> occurrences(groups.size());
+    for (size_t g = 0; g < groups.size(); ++g) {
+        order[g] = g;
+        occurrences[g] = groups[g].size();
+    }
+    auto length = [&](size_t g) { return loopEnd[groups[g].front()] - groups[g].front() + 1; };
+    /// Outer loops go first, so that when one is outlined, the loops inside
+    /// it count all of its occurrences as one
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return length(a) > length(b); });
+    for (size_t g : order) {
+        const bool hot = std::any_of(groups[g].begin(), groups[g].end(),
+                                     [&](size_t begin) { return hotLoops_.count(prog[begin].a_); });
+        if (occurrences[g] < 2 || length(g) < (hot ? HOT_MIN_OUTLINED_LENGTH : MIN_OUTLINED_LENGTH)) {
+            continue;
+        }
+        const size_t begin = groups[g].front(), end = loopEnd[begin];
+        for (size_t i = begin + 1; i < end; ++i) {
+            if (groupOf[i] != NOT_OUTLINED) {
+                occurrences[groupOf[i]] -= occurrences[g] - 1;
+            }
+        }
+        for (size_t occurrence : groups[g]) {
+            outlinedIndex_[occurrence] = outlinedLoops_.size();
+        }
+        outlinedLoops_.push_back({Label{}, begin, end, false});
+    }
+}
+
+template <typename CellType>
+bool CodeGenerator<CellType>::sameLoop(const std::vector<Instruction> &prog, size_t a, size_t b, size_t length) {
+    if (std::max(a, b) + length > prog.size()) {
+        return false;
+    }
+    /// Equal instructions give both the same nesting, so the loop at a also ends at length
+    for (size_t i = 0; i < length; ++i) {
+        const auto &x = prog[a + i], &y = prog[b + i];
+        switch (x.code_) {
+        case IROpCode::LOOP:
+        case IROpCode::IF:
+            if (x.code_ != y.code_ || x.b_ != y.b_) {
+                return false;
+            }
+            break;
+        case IROpCode::END_LOOP:
+        case IROpCode::END_IF:
+            if (x.code_ != y.code_) {
+                return false;
+            }
+            break;
+        default:
+            if (x != y) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateOutlinedLoops(const std::vector<Instruction> &prog, SymbolMap &symbolMap) {
+    /// Outlined loops can call more of them
+    while (!pendingOutlined_.empty()) {
+        auto &outlined = outlinedLoops_[pendingOutlined_.back()];
+        pendingOutlined_.pop_back();
+        alignLoopHead();
+        if (genPerfMap_) {
+            symbolMap.emplace_back(buf_.current_offset(), Instruction{}, "jit_outlined_loop");
+        }
+        recordIrOffset(outlined.begin);
+        as_.bind(outlined.entry);
+        as_.push(Reg::RAX);
+        cellInR12_ = false;
+        generateLoopStart(prog, outlined.begin);
+        generateRange(prog, outlined.begin + 1, outlined.end + 1, false, symbolMap);
+        recordIrOffset(NOT_IR);
+        as_.pop(Reg::RAX);
+        as_.ret();
+    }
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateOutOfLineCode(const std::vector<Instruction> &prog, SymbolMap &symbolMap) {
+    do {
+        generateOutlinedLoops(prog, symbolMap);
+        generateColdCode(symbolMap);
+    } while (!pendingOutlined_.empty());
+}
+
+/// Lazily compiled loops start out as this stub, which is only reached if the
+/// loop is entered at least once:
+///     push r10; push r11; push rbp      <- patched to jmp $compiledLoop
+///     mov rbp, rsp
+///     mov rdi, $this
+///     mov esi, $lazyLoopIndex
+///     mov rax, $lazyCompileEntry
+///     call rax
+///     pop rbp; pop r11; pop r10
+///     jmp rax
+/// The compiled loop jumps back to the end of the stub when it exits.
+template <typename CellType>
+void CodeGenerator<CellType>::generateLazyLoopStub(size_t begin, size_t end) {
+    /// Skip the stub entirely if the loop isn't entered
+    Label resume;
+    generateLoopLoadTest();
+    as_.jcc(Cond::Z, resume, true);
+    const ASMBufOffset stubOffset = as_.offset();
+    as_.push(Reg::R10);
+    as_.push(Reg::R11);
+    as_.push(Reg::RBP);
+    as_.mov(Width::Q, Reg::RBP, Reg::RSP);
+    as_.movImm(Reg::RDI, (uintptr_t)this);
+    as_.movImm(Reg::RSI, lazyLoops_.size());
+    as_.movImm(Reg::RAX, (uintptr_t)&CodeGenerator::lazyCompileEntry);
+    as_.call(Reg::RAX);
+    as_.pop(Reg::RBP);
+    as_.pop(Reg::R11);
+    as_.pop(Reg::R10);
+    as_.jmp(Reg::RAX);
+    as_.bind(resume);
+    lazyLoops_.push_back({begin, end, stubOffset, resume.offset()});
+    cellInR12_ = false;
+}
+
+template <typename CellType>
+uintptr_t CodeGenerator<CellType>::lazyCompileEntry(CodeGenerator *self, uint32_t lazyLoopIndex) {
+    // We are being called from jit code, so errors can't be propagated as exceptions
+    try {
+        return self->compileLazyLoop(lazyLoopIndex);
+    } catch (JITError &e) {
+        std::cout << "Fatal JITError caught: " << e.what() << '\n';
+        std::exit(1);
+    }
+}
+
+template <typename CellType>
+uintptr_t CodeGenerator<CellType>::compileLazyLoop(uint32_t lazyLoopIndex) {
+    const LazyLoop &loop = lazyLoops_.at(lazyLoopIndex);
+    SymbolMap symbolMap;
+    const ASMBufOffset loopOffset = as_.offset();
+    cellInR12_ = false;
+    generateRange(lazyProg_, loop.begin, loop.end, false, symbolMap);
+    symbolMap.emplace_back(as_.offset(), Instruction{}, "jit_lazy_loop_exit");
+    recordIrOffset(NOT_IR);
+    as_.jmpRel32(loop.resumeOffset);
+    generateOutOfLineCode(lazyProg_, symbolMap);
+    symbolMap.emplace_back(as_.offset(), Instruction{}, nullptr);
+    writePerfMap(symbolMap);
+    /// Patch the start of the stub to go straight to the compiled loop next time.
+    /// The stub is 5 bytes of pushes up to this point, which is exactly the size of the jmp.
+    {
+        const int32_t jump_instruction_length = 5;
+        const int32_t rel_off = (int32_t)loopOffset - (int32_t)loop.stubOffset - jump_instruction_length;
+        buf_.patch_val(loop.stubOffset, (uint8_t)0xe9);
+        buf_.patch_val(loop.stubOffset + 1, rel_off);
+    }
+    return buf_.address_at_offset(loopOffset);
 }
 
 template <typename CellType>
-void CodeGenerator<CellType>::generatePrelude() {
+void CodeGenerator<CellType>::generatePrelude(uintptr_t tape, uintptr_t putChar, uintptr_t getChar, size_t dp) {
     // Note: The abi requires that the stack must be 16 byte aligned, and guarantees it
     // is so before we get called.
     /// Prelude to save callee-saved registers
-    buf_.write_bytes({
-    // push %r12
-        0x41, 0x54,
-    // push %r13
-        0x41, 0x55,
-    // push %r14
-        0x41, 0x56,
-    // push %r15
-        0x41, 0x57
-    });
+    as_.push(Reg::R12);
+    as_.push(Reg::R13);
+    as_.push(Reg::R14);
+    as_.push(Reg::R15);
+    if (safepointsEnabled_ && !elf_) {
+        /// rbx holds the fuel, and pushing rbp as well keeps the stack 16 byte aligned
+        as_.push(Reg::RBX);
+        as_.push(Reg::RBP);
+    }
     /// Prelude to initialize registers as per model
-    buf_.write_bytes({
-    // mov %r10, $bfMem_
-        0x49, 0xba
-    });
-    buf_.write_val((uintptr_t)bfMem_.data());
-
-    buf_.write_bytes({
-    // xor %r11, %r11
-        0x4d, 0x31, 0xdb,
-    // mov %r13, putchar
-        0x49, 0xbd
-    });
-    buf_.write_val((uintptr_t)putChar_);
-
-    buf_.write_bytes({
-    // mov %r14, mgetc
-        0x49, 0xbe
-    });
-    buf_.write_val((uintptr_t)getChar_);
-
-    buf_.write_bytes({
-    // mov %r15, $BFMEM_LENGTH
-        0x49, 0xbf
-    });
-    buf_.write_val((size_t)BFMEM_LENGTH - (size_t)IS_POW_2_MEM_LENGTH);
+    if (serving_ && !elf_) {
+        as_.movImm(Reg::RAX, (uintptr_t)&safepoints_);
+        as_.mov(Width::Q, Reg::R10, mem(Reg::RAX, offsetof(SafepointState, tape)));
+    } else {
+        as_.movImm(Reg::R10, tape);
+    }
+    if (dp == 0) {
+        as_.xor_(Width::D, Reg::R11, Reg::R11);
+    } else {
+        as_.movImm(Reg::R11, dp);
+    }
+    as_.movImm(Reg::R13, putChar);
+    as_.movImm(Reg::R14, getChar);
+    as_.movImm(Reg::R15, (size_t)BFMEM_LENGTH - (size_t)IS_POW_2_MEM_LENGTH);
+    if (safepointsEnabled_ && !elf_) {
+        /// The first back edge polls, and takes the first slice of the fuel
+        as_.xor_(Width::D, Reg::RBX, Reg::RBX);
+    }
 }
 
 template <typename CellType>
 void CodeGenerator<CellType>::generateInsAdd(CellType step) {
-    if constexpr (std::is_same<CellType, char>::value) {
-        buf_.write_bytes({
-        // mov %r12b, [r10+r11]
-            0x47, 0x8a, 0x24, 0x1a,
-        // add %r12b, $step
-            0x41, 0x80, 0xc4, (unsigned char) step,
-        // mov [r10+r11], %r12b
-            0x47, 0x88, 0x24, 0x1a
-        });
-    } else if constexpr (std::is_same<CellType, short>::value) {
-        buf_.write_bytes({
-        // mov %r12w, [r10+r11*2]
-            0x66, 0x47, 0x8b, 0x24, 0x5a,
-        // add %r12w, $step
-            0x66, 0x41, 0x81, 0xc4
-        });
-        buf_.write_val(step);
-        buf_.write_bytes({
-        // mov [r10+r11*2], %r12w
-            0x66, 0x47, 0x89, 0x24, 0x5a
-        });
+    generateLoadCell();
+    as_.add(CELL_WIDTH, Reg::R12, step);
+    as_.mov(CELL_WIDTH, currentCell(), Reg::R12);
+    cellInR12_ = true;
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateWrapIndex(Reg index) {
+    if (IS_POW_2_MEM_LENGTH) {
+        as_.and_(Width::D, index, Reg::R15);
     } else {
-        buf_.write_bytes({
-        // mov %r12d, [r10+r11*4]
-            0x47, 0x8b, 0x24, 0x9a,
-        // add %r12d, $step
-            0x41, 0x81, 0xc4
-        });
-        buf_.write_val(step);
-        buf_.write_bytes({
-        // mov [r10+r11], %r12b
-            0x47, 0x89, 0x24, 0x9a
-        });
+        /// if (index >= r15d) index -= r15d;
+        /// This works because at this point, we know that 0 <= index < 2*r15d - 1.
+        /// Wrapping around is rare, so the subtraction is out of line.
+        as_.cmp(Width::D, index, Reg::R15);
+        generateColdPath(Cond::GE, cellInR12_, [this, index] { as_.sub(Width::D, index, Reg::R15); });
     }
 }
 
 template <typename CellType>
 void CodeGenerator<CellType>::generateInsAdp(int step) {
-    const int adjustedStep = wrapOffset(step, BFMEM_LENGTH);
+    cellInR12_ = false;
+    // Masking works on negative steps too, which keeps small steps encodable as imm8
+    const int adjustedStep = IS_POW_2_MEM_LENGTH ? step : wrapOffset(step, BFMEM_LENGTH);
     if (adjustedStep == 1) {
-        buf_.write_bytes({
-        // inc %r11
-            0x49, 0xff, 0xc3
-        });
-    } else {
-        buf_.write_bytes({
-        // add %r11, $adjustedStep
-            0x49, 0x81, 0xc3
-        });
-        buf_.write_val((uint32_t)adjustedStep);
-    }
-    if (IS_POW_2_MEM_LENGTH) {
-        buf_.write_bytes({
-        // and %r11d, r15d
-            0x45, 0x21, 0xfb
-        });
+        as_.inc(Width::Q, Reg::R11);
+    } else if (adjustedStep == -1) {
+        as_.dec(Width::Q, Reg::R11);
     } else {
-        /// r11d -= r15d * (r11d >= r15d);
-        /// This works because at this point, we know that 0 <= r11d < 2*r15d - 1
-        buf_.write_bytes({
-        // xor %eax, %eax
-            0x31, 0xc0,
-        // cmp %r11d, %r15d
-            0x45, 0x39, 0xfb,
-        // cmovge %eax, %r15d
-            0x41, 0x0f, 0x4d, 0xc7,
-        // sub %r11d, %eax
-            0x41, 0x29, 0xc3,
-        });
+        as_.add(Width::Q, Reg::R11, adjustedStep);
     }
+    generateWrapIndex(Reg::R11);
 }
 
 template <typename CellType>
 void CodeGenerator<CellType>::generateInsEndLoop(int loopNumber) {
-    const auto loopInfo = loopStarts_.at(loopNumber);
-    const uintptr_t loop_start = loopInfo.first;
-    const uintptr_t patch_loc = loopInfo.second;
-    {
-        const uintptr_t current_pos = buf_.current_offset();
-        const int32_t jump_instruction_length = 5;
-        const int32_t rel_off = (int32_t)loop_start - (int32_t)current_pos - jump_instruction_length;
-        buf_.write_bytes({
-        // jmpq $diff
-            0xe9
+    auto &labels = loopLabels_.at(loopNumber);
+    if (safepointsEnabled_ && !elf_ && !labels.strided && !labels.tripFactor) {
+        generateSafepoint(1);
+    }
+    /// Loops are rotated, so the back edge re-tests the cell and only jumps
+    /// when another iteration is needed
+    if (!cellInR12_) {
+        generateLoopLoadTest();
+    } else {
+        generateLoopTest();
+    }
+    if (labels.strided) {
+        /// Handing over to runStridedLoop happens at most once per entry
+        as_.jcc(Cond::Z, labels.exit);
+        as_.dec(Width::D, Reg::RDX);
+        as_.jcc(Cond::NZ, labels.body);
+        generateColdPath(std::nullopt, true, [this, &labels] {
+            if (safepointsEnabled_ && !elf_) {
+                /// Strided loops only pay for their inline iterations here, and
+                /// counting them again makes a scan that wraps around the tape
+                /// keep coming back
+                generateSafepoint(labels.inlineTrips);
+            }
+            generateStridedLoopCall(*labels.strided);
+            if (safepointsEnabled_ && !elf_) {
+                as_.movImm(Reg::RDX, labels.inlineTrips);
+            }
+            generateLoopLoadTest();
+            as_.jcc(Cond::NZ, labels.body);
         });
-        buf_.write_val(rel_off);
+    } else {
+        as_.jcc(Cond::NZ, labels.body);
     }
-    // patch start of jump
-    {
-        const uintptr_t current_pos = buf_.current_offset();
-        const int32_t forward_jump_instruction_length = 6;
-        const int32_t forward_off = (int32_t)current_pos - (int32_t)patch_loc - forward_jump_instruction_length;
-        const size_t forward_jump_opcode_length = 2;
-        const size_t patch_offset_loc = patch_loc + forward_jump_opcode_length;
-        buf_.patch_val(patch_offset_loc, forward_off);
+    as_.bind(labels.exit);
+    // Both ways out of the loop leave the (zero) cell value in r12
+    cellInR12_ = true;
+}
+
+/// Safepoints pay for loop iterations out of the fuel in rbx, and only look
+/// at the shared state when it runs short, taking up to SAFEPOINT_SLICE more:
+///   safepoint:                <- where resume() continues, with rbx = 0
+///     sub rbx, $backEdges     ; or rcx, the trips of a counted loop
+///     jb poll
+///   resume:
+///     ...
+///   poll:                     <- cold
+///     add rbx, $backEdges     ; undo, and give back the rest of the slice
+///     mov ecx, $backEdges
+///     mov rax, $safepoints_
+///     add [rax + fuel], rbx
+///     xor ebx, ebx
+///     cmp dword [rax + stop], 0
+///     jne stop
+///     mov rdi, [rax + fuel]
+///     cmp rdi, rcx
+///     jae refill
+///   stop:
+///     mov [rax + dp], r11
+///     mov dword [rax + stoppedAt], $index
+///     jmp epilogue
+///   refill:
+///     lea rbx, [rcx + SAFEPOINT_SLICE]
+///     cmp rdi, rbx
+///     cmovb rbx, rdi
+///     sub [rax + fuel], rbx
+///     sub rbx, rcx
+///     jmp resume
+template <typename CellType>
+void CodeGenerator<CellType>::generateSafepoint(std::optional<int32_t> backEdges, uint32_t tripFactor) {
+    static_assert(sizeof(sig_atomic_t) == 4, "The stop flag is polled as a dword");
+    const auto index = (uint32_t)safepointOffsets_.size();
+    safepointOffsets_.push_back(as_.offset());
+    if (backEdges) {
+        as_.sub(Width::Q, Reg::RBX, *backEdges);
+    } else {
+        /// The cell was tested just before, but reading it again saves
+        /// worrying about what r12 holds above the cell's width
+        as_.movzx(CELL_WIDTH, Reg::RCX, currentCell());
+        if (tripFactor != 1) {
+            as_.imul(Width::D, Reg::RCX, Reg::RCX, (int32_t)tripFactor);
+            as_.and_(Width::D, Reg::RCX, (int32_t)std::numeric_limits<std::make_unsigned_t<CellType>>::max());
+        }
+        as_.sub(Width::Q, Reg::RBX, Reg::RCX);
     }
+    generateColdPath(Cond::B, cellInR12_, [this, index, backEdges] {
+        Label stop, refill;
+        if (backEdges) {
+            as_.add(Width::Q, Reg::RBX, *backEdges);
+            as_.movImm(Reg::RCX, *backEdges);
+        } else {
+            as_.add(Width::Q, Reg::RBX, Reg::RCX);
+        }
+        as_.movImm(Reg::RAX, (uintptr_t)&safepoints_);
+        as_.add(Width::Q, mem(Reg::RAX, offsetof(SafepointState, fuel)), Reg::RBX);
+        as_.xor_(Width::D, Reg::RBX, Reg::RBX);
+        as_.cmp(Width::D, mem(Reg::RAX, offsetof(SafepointState, stop)), 0);
+        as_.jcc(Cond::NE, stop, true);
+        as_.mov(Width::Q, Reg::RDI, mem(Reg::RAX, offsetof(SafepointState, fuel)));
+        as_.cmp(Width::Q, Reg::RDI, Reg::RCX);
+        as_.jcc(Cond::AE, refill, true);
+        as_.bind(stop);
+        generateStop(index);
+        as_.bind(refill);
+        as_.lea(Width::Q, Reg::RBX, mem(Reg::RCX, SAFEPOINT_SLICE));
+        as_.cmp(Width::Q, Reg::RDI, Reg::RBX);
+        as_.cmov(Cond::B, Width::Q, Reg::RBX, Reg::RDI);
+        as_.sub(Width::Q, mem(Reg::RAX, offsetof(SafepointState, fuel)), Reg::RBX);
+        as_.sub(Width::Q, Reg::RBX, Reg::RCX);
+    });
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateStop(uint32_t index) {
+    as_.mov(Width::Q, mem(Reg::RAX, offsetof(SafepointState, dp)), Reg::R11);
+    as_.mov(Width::D, mem(Reg::RAX, offsetof(SafepointState, stoppedAt)), (int32_t)index);
+    as_.jmp(epilogue_);
 }
 
+/// Entered by resume(), to continue at the safepoint the program stopped at
+/// with the registers it expects there
+template <typename CellType>
+void CodeGenerator<CellType>::generateResumeTrampoline() {
+    resumeTrampoline_ = as_.offset();
+    generatePrelude((uintptr_t)bfMem_.data(), (uintptr_t)putChar_, (uintptr_t)getChar_);
+    as_.movImm(Reg::RAX, (uintptr_t)&safepoints_);
+    as_.mov(Width::Q, Reg::R11, mem(Reg::RAX, offsetof(SafepointState, dp)));
+    /// Any count is right for a strided loop, since it only delays the hand over
+    as_.movImm(Reg::RDX, STRIDED_LOOP_INLINE_TRIPS);
+    generateLoadCell();
+    as_.mov(Width::Q, Reg::RCX, mem(Reg::RAX, offsetof(SafepointState, resumeAddress)));
+    as_.jmp(Reg::RCX);
+}
 
 template <typename CellType>
 void CodeGenerator<CellType>::generateInsIn() {
-    if (getCharBehaviour == GetCharBehaviour::EOF_DOESNT_MODIFY) {
-        // We want to preserve all the contents of the cell if it's not modified
-        if constexpr (std::is_same<CellType, char>::value) {
-            buf_.write_bytes({
-            // movzx %edi, byte [r10+r11]
-                0x43, 0x0f, 0xb6, 0x3c, 0x1a,
-            });
-        } else if constexpr (std::is_same<CellType, short>::value) {
-            buf_.write_bytes({
-            // movzx %edi, word [r10+r11*2]
-                0x43, 0x0f, 0xb7, 0x3c, 0x5a,
-            });
-        } else {
-            buf_.write_bytes({
-            // mov %edi, [r10+r11*4]
-                0x43, 0x8b, 0x3c, 0x9a,
+    auto in = [this] {
+        /// With --serve, an IN without input suspends the session, which
+        /// tries the whole IN again once there is some
+        const auto index = (uint32_t)safepointOffsets_.size();
+        if (serving_) {
+            safepointOffsets_.push_back(as_.offset());
+        }
+        if (getCharBehaviour == GetCharBehaviour::EOF_DOESNT_MODIFY) {
+            // We want to preserve all the contents of the cell if it's not modified
+            if constexpr (CELL_WIDTH == Width::D) {
+                as_.mov(Width::D, Reg::RDI, currentCell());
+            } else {
+                as_.movzx(CELL_WIDTH, Reg::RDI, currentCell());
+            }
+        }
+        generateCall(Reg::R14);
+        if (serving_) {
+            as_.movImm(Reg::RCX, (uintptr_t)&sessionInputStarved);
+            as_.cmp(Width::B, mem(Reg::RCX), 0);
+            generateColdPath(Cond::NE, cellInR12_, [this, index] {
+                /// Give back the fuel left in rbx, which the trampoline sets to 0
+                as_.movImm(Reg::RAX, (uintptr_t)&safepoints_);
+                as_.add(Width::Q, mem(Reg::RAX, offsetof(SafepointState, fuel)), Reg::RBX);
+                generateStop(index);
             });
         }
+        as_.mov(CELL_WIDTH, currentCell(), Reg::RAX);
+        cellInR12_ = false;
+    };
+    if (isColdIO()) {
+        generateColdPath(std::nullopt, false, in);
+    } else {
+        in();
     }
-    buf_.write_bytes({
-    // push %r10
-        0x41, 0x52,
-    // push %r11
-        0x41, 0x53,
-    // push %rbp
-        0x55,
-    // mov %rbp, %rsp
-        0x48, 0x89, 0xe5,
-    // call *%r14
-        0x41, 0xff, 0xd6,
-    // pop %rbp
-        0x5d,
-    // pop %r11
-        0x41, 0x5b,
-    // pop %r10
-        0x41, 0x5a,
-    });
-    if constexpr (std::is_same<CellType, char>::value) {
-        buf_.write_bytes({
-        // mov [r10+r11], %al
-            0x43, 0x88, 0x04, 0x1a
-        });
-    } else if constexpr (std::is_same<CellType, short>::value) {
-        buf_.write_bytes({
-        // mov [r10+r11*2], %ax
-            0x66, 0x43, 0x89, 0x04, 0x5a
-        });
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateLoopLoadTest() {
+    generateLoadCell();
+    generateLoopTest();
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateLoadCell(const Mem &cell) {
+    /// Zero extending avoids merging into the old value of r12, which would
+    /// chain every load of the cell to the previous one
+    if constexpr (CELL_WIDTH == Width::D) {
+        as_.mov(Width::D, Reg::R12, cell);
     } else {
-        buf_.write_bytes({
-        // mov [r10+r11*4], %eax
-            0x43, 0x89, 0x04, 0x9a
-        });
+        as_.movzx(CELL_WIDTH, Reg::R12, cell);
     }
+    cellInR12_ = true;
 }
 
 template <typename CellType>
-void CodeGenerator<CellType>::generateInsLoop(int loopNumber) {
-    // mark start of loop
-    uintptr_t loop_start = buf_.current_offset();
-    if constexpr (std::is_same<CellType, char>::value) {
-        buf_.write_bytes({
-        // mov %r12b, [r10+r11]
-            0x47, 0x8a, 0x24, 0x1a,
-        // test %r12b, %r12b
-            0x45, 0x84, 0xe4
-        });
-    } else if constexpr (std::is_same<CellType, short>::value) {
-        buf_.write_bytes({
-        // mov %r12w, [r10+4*r11]
-            0x66, 0x47, 0x8b, 0x24, 0x5a,
-        // test %r12w, %r12w
-            0x66, 0x45, 0x85, 0xe4
-        });
+void CodeGenerator<CellType>::generateLoopTest() {
+    as_.test(CELL_WIDTH, Reg::R12, Reg::R12);
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::alignLoopHead() {
+    // Same policy as gcc's loop alignment: only pad when it's cheap to do so
+    const size_t maxPadding = 10;
+    if (!as_.align(32, maxPadding)) {
+        as_.align(16, maxPadding);
+    }
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateInsLoop(int loopNumber, const StridedLoop *strided, int32_t inlineTrips) {
+    /// Loops are emitted rotated:
+    ///     load; test; jz end
+    ///   body:
+    ///     ...
+    ///     load; test; jnz body
+    ///   end:
+    if (!cellInR12_) {
+        generateLoopLoadTest();
     } else {
-        buf_.write_bytes({
-        // mov %r12d, [r10+4*r11]
-            0x47, 0x8b, 0x24, 0x9a,
-        // test %r12d, %r12d
-            0x45, 0x85, 0xe4
-        });
+        generateLoopTest();
     }
-    // store patch_loc
-    uintptr_t patch_loc = buf_.current_offset();
-    buf_.write_bytes({
-    // jz 0
-        0x0f, 0x84, 0x00, 0x00, 0x00, 0x00
-    });
-    // add loop start info to loopStarts_
-    loopStarts_.emplace(loopNumber, std::make_pair(loop_start, patch_loc));
+    auto &labels = loopLabels_[loopNumber];
+    as_.jcc(Cond::Z, labels.exit);
+    if (strided && inlineTrips == 0) {
+        generateStridedLoopCall(*strided);
+        generateLoopLoadTest();
+        as_.jcc(Cond::Z, labels.exit);
+    } else if (strided) {
+        /// Strided loops count their iterations in edx, which nothing else
+        /// uses, and hand over to runStridedLoop once they turn out to be long
+        labels.strided = strided;
+        labels.inlineTrips = inlineTrips;
+        as_.movImm(Reg::RDX, inlineTrips);
+    } else if (labels.tripFactor) {
+        generateSafepoint(std::nullopt, *labels.tripFactor);
+    }
+    if (hotLoops_.count(loopNumber)) {
+        alignLoopHead();
+    }
+    as_.bind(labels.body);
 }
 
 template <typename CellType>
-void CodeGenerator<CellType>::generateInsMul(int offset, CellType multFactor) {
-    const size_t destOffset = wrapOffset(offset, BFMEM_LENGTH);
-    /// Strategy:
-    /// load index of remote into rcx
-    buf_.write_bytes({
-    // lea %ecx, [r11d+$destOffset]
-        0x67, 0x41, 0x8d, 0x8b
-    });
-    buf_.write_val((uint32_t)destOffset);
-    if (IS_POW_2_MEM_LENGTH) {
-        buf_.write_bytes({
-        // and %ecx, %r15d
-            0x44, 0x21, 0xf9
-        });
+void CodeGenerator<CellType>::generateInsIf(int loopNumber) {
+    /// The body leaves the cell at zero, so there is no back edge:
+    ///     load; test; jz end
+    ///     ...
+    ///   end:
+    if (!cellInR12_) {
+        generateLoopLoadTest();
     } else {
-        /// edx -= r15d * (edx >= r15d);
-        /// This works because at this point, we know that 0 <= r11d < 2*r15d - 1
-        buf_.write_bytes({
-        // xor %eax, %eax
-            0x31, 0xc0,
-        // cmp %ecx, %r15d
-            0x44, 0x39, 0xf9,
-        // cmovge %eax, %r15d
-            0x41, 0x0f, 0x4d, 0xc7,
-        // sub %ecx, %eax
-            0x29, 0xc1
-        });
+        generateLoopTest();
     }
-    if constexpr (std::is_same<CellType, char>::value) {
-        if (multFactor == 1) {
-            buf_.write_bytes({
-            /// load current cell into al
-            // mov %al, [r10+r11]
-                0x43, 0x8a, 0x04, 0x1a,
-            });
-        } else if (multFactor == -1) {
-            buf_.write_bytes({
-            /// load current cell into al, then negate it
-            // mov %al, [r10+r11]
-                0x43, 0x8a, 0x04, 0x1a,
-            // neg %al
-                0xf6, 0xd8
-            });
+    as_.jcc(Cond::Z, loopLabels_[loopNumber].exit);
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateInsEndIf(int loopNumber) {
+    /// The skipping jump leaves the cell in r12, so r12 is valid after the
+    /// if exactly when it is valid at the end of the body
+    as_.bind(loopLabels_.at(loopNumber).exit);
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateRun(const std::vector<Instruction> &prog, size_t begin, size_t end) {
+    /// Fold the run into what it does to each cell, by offset from where it starts
+    std::map<int, RunCell> folded;
+    int offset{};
+    for (size_t i = begin; i < end; ++i) {
+        const auto &ins = prog[i];
+        if (ins.code_ == IROpCode::ADP) {
+            offset += ins.a_;
+        } else if (ins.code_ == IROpCode::CONST) {
+            folded[offset] = {true, ins.a_};
         } else {
-            buf_.write_bytes({
-            /// load current cell into r12
-            // mov %r12b, [r10+r11]
-                0x47, 0x8a, 0x24, 0x1a,
-            /// mult r12 by multFactor, store in al
-            // mov %al, multFactor
-                0xb0, (unsigned char)multFactor,
-            // mul r12b
-                0x41, 0xf6, 0xe4
-            });
+            folded[offset].value += ins.a_;
         }
-        buf_.write_bytes({
-        /// add value from remote
-        // add %al, [r10+rcx]
-            0x41, 0x02, 0x04, 0x0a,
-        /// store at remote
-        // mov [r10+rcx], %al
-            0x41, 0x88, 0x04, 0x0a
-        });
-    } else if constexpr (std::is_same<CellType, short>::value) {
-        if (multFactor == 1) {
-            buf_.write_bytes({
-            /// load current cell into ax
-            // mov %ax, [r10+r11*2]
-                0x66, 0x43, 0x8b, 0x04, 0x5a
-            });
-        } else if (multFactor == -1) {
-            buf_.write_bytes({
-            /// load current cell into ax, then negate it
-            // mov %ax, [r10+r11*2]
-                0x66, 0x43, 0x8b, 0x04, 0x5a,
-            // neg %ax
-                0x66, 0xf7, 0xd8
-            });
+    }
+    std::vector<std::pair<int, RunCell>> cells;
+    for (const auto &[off, cell] : folded) {
+        if (cell.isConst || (CellType)cell.value != 0) {
+            cells.emplace_back(off, cell);
+        }
+    }
+    constexpr int64_t MAX_DISPLACEMENT = std::numeric_limits<int32_t>::max() / sizeof(CellType) - 16;
+    const int64_t minOffset = cells.empty() ? 0 : cells.front().first;
+    const int64_t maxOffset = cells.empty() ? 0 : cells.back().first;
+    if (cells.size() < 2 || maxOffset - minOffset >= BFMEM_LENGTH ||
+        std::max(std::abs(minOffset), std::abs(maxOffset)) >= MAX_DISPLACEMENT) {
+        generateRunInstructions(prog, begin, end);
+        return;
+    }
+    /// If the cells the run touches are on the tape without wrapping, they
+    /// are updated in place by offset, in vector chunks where that is
+    /// cheaper. Otherwise the run is generated as it is, out of line.
+    as_.lea(Width::D, Reg::RCX, mem(Reg::R11, minOffset));
+    as_.cmp(Width::D, Reg::RCX, BFMEM_LENGTH - 1 - (maxOffset - minOffset));
+    /// Like ADD, an addition to the cell the run ends on leaves it in r12
+    const auto last = folded.find(offset);
+    const bool lastInR12 = last != folded.end() && !last->second.isConst && (CellType)last->second.value != 0;
+    if (lastInR12) {
+        cells.erase(std::find_if(cells.begin(), cells.end(), [&](const auto &cell) { return cell.first == offset; }));
+    }
+    auto &wrapped = generateColdPath(
+        Cond::A, lastInR12, [this, &prog, begin, end] { generateRunInstructions(prog, begin, end); }, false);
+    for (size_t k = 0; k < cells.size();) {
+        const int first = cells[k].first;
+        size_t chunkCells = 0;
+        int chunkBytes = 0;
+        for (int bytes : {16, 8}) {
+            const int lanes = bytes / sizeof(CellType);
+            if (lanes < 2 || first + lanes - 1 > maxOffset) {
+                continue;
+            }
+            size_t n = 0;
+            while (k + n < cells.size() && cells[k + n].first < first + lanes) {
+                ++n;
+            }
+            if (runChunkCost(cells, k, n, bytes) < n) {
+                chunkBytes = bytes;
+                chunkCells = n;
+                break;
+            }
+        }
+        if (chunkBytes != 0) {
+            generateRunChunk(cells, k, chunkCells, chunkBytes);
+            k += chunkCells;
+            continue;
+        }
+        const Mem cell = mem(Reg::R10, Reg::R11, sizeof(CellType), first * (int)sizeof(CellType));
+        if (cells[k].second.isConst) {
+            as_.mov(CELL_WIDTH, cell, (CellType)cells[k].second.value);
         } else {
-            buf_.write_bytes({
-            /// load current cell into r12
-            // mov %r12w, [r10+r11*2]
-                0x66, 0x47, 0x8b, 0x24, 0x5a,
-            /// mult r12 by multFactor, store in ax
-            // mov %ax, multFactor
-                0x66, 0xb8,
-            });
-            buf_.write_val((CellType)multFactor);
-            buf_.write_bytes({
-            // mul r12w
-                0x66, 0x41, 0xf7, 0xe4
-            });
+            as_.add(CELL_WIDTH, cell, (CellType)cells[k].second.value);
         }
-        buf_.write_bytes({
-        /// add value from remote
-        // add %ax, [r10+rcx*2]
-            0x66, 0x41, 0x03, 0x04, 0x4a,
-        /// store at remote
-        // mov [r10+rcx*2], %ax
-            0x66, 0x41, 0x89, 0x04, 0x4a
-        });
+        ++k;
+    }
+    if (lastInR12) {
+        const Mem cell = mem(Reg::R10, Reg::R11, sizeof(CellType), offset * (int)sizeof(CellType));
+        generateLoadCell(cell);
+        as_.add(CELL_WIDTH, Reg::R12, (CellType)last->second.value);
+        as_.mov(CELL_WIDTH, cell, Reg::R12);
+    }
+    if (offset != 0) {
+        generateInsAdp(offset);
+    }
+    cellInR12_ = lastInR12;
+    as_.bind(wrapped.resume);
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateRunInstructions(const std::vector<Instruction> &prog, size_t begin,
+                                                      size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+        const auto &ins = prog[i];
+        switch (ins.code_) {
+        case IROpCode::ADD:
+            generateInsAdd(ins.a_);
+            break;
+        case IROpCode::ADP:
+            generateInsAdp(ins.a_);
+            break;
+        case IROpCode::CONST:
+            generateInsConst(ins.a_);
+            break;
+        default:
+            throw JITError("ICE: ", ins.code_, " in a run");
+        }
+    }
+}
+
+template <typename CellType>
+size_t CodeGenerator<CellType>::runChunkCost(const std::vector<std::pair<int, RunCell>> &cells, size_t k, size_t n,
+                                             int bytes) const {
+    /// Instructions generateRunChunk() emits, against one per cell done one by one
+    const size_t lanes = bytes / sizeof(CellType);
+    const bool allConst = std::all_of(cells.begin() + k, cells.begin() + k + n,
+                                      [](const auto &cell) { return cell.second.isConst; });
+    const bool anyConst = std::any_of(cells.begin() + k, cells.begin() + k + n,
+                                      [](const auto &cell) { return cell.second.isConst; });
+    const size_t constantCost = bytes == 16 ? 5 : 2;
+    if (n == lanes && allConst) {
+        return bytes == 16 ? constantCost + 1 : 2;
+    }
+    return 3 + constantCost + (anyConst ? constantCost + 1 : 0);
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateRunChunk(const std::vector<std::pair<int, RunCell>> &cells, size_t k, size_t n,
+                                               int bytes) {
+    /// A chunk of bytes starting at the first of the cells is updated as
+    ///     cells = (cells & keep) + values
+    /// where keep clears the lanes set by a CONST, and values holds the
+    /// constants and the additions. Untouched lanes keep their value.
+    const int first = cells[k].first;
+    const size_t lanes = bytes / sizeof(CellType);
+    CellType values[16 / sizeof(CellType)]{};
+    CellType keep[16 / sizeof(CellType)];
+    std::fill(std::begin(keep), std::end(keep), (CellType)-1);
+    bool anyConst = false;
+    for (size_t i = k; i < k + n; ++i) {
+        const size_t lane = cells[i].first - first;
+        values[lane] = (CellType)cells[i].second.value;
+        if (cells[i].second.isConst) {
+            keep[lane] = 0;
+            anyConst = true;
+        }
+    }
+    uint64_t valueWords[2], keepWords[2];
+    std::memcpy(valueWords, values, sizeof(values));
+    std::memcpy(keepWords, keep, sizeof(keep));
+    const Mem chunk = mem(Reg::R10, Reg::R11, sizeof(CellType), first * (int)sizeof(CellType));
+    if (n == lanes && std::all_of(std::begin(keep), std::begin(keep) + lanes, [](CellType c) { return c == 0; })) {
+        /// Only constants, so just store them
+        if (bytes == 8) {
+            if ((int64_t)valueWords[0] >= INT32_MIN && (int64_t)valueWords[0] <= INT32_MAX) {
+                as_.mov(Width::Q, chunk, (int32_t)valueWords[0]);
+            } else {
+                as_.movImm(Reg::RAX, valueWords[0]);
+                as_.mov(Width::Q, chunk, Reg::RAX);
+            }
+        } else {
+            generateVectorConstant(Xmm::XMM0, valueWords[0], valueWords[1]);
+            as_.movdqu(chunk, Xmm::XMM0);
+        }
+        return;
+    }
+    if (bytes == 8) {
+        as_.movq(Xmm::XMM0, chunk);
     } else {
-        if (multFactor == 1) {
-            buf_.write_bytes({
-            /// load current cell into al
-            // mov %eax, [r10+r11*4]
-                0x43, 0x8b, 0x04, 0x9a
-            });
-        } else if (multFactor == -1) {
-            buf_.write_bytes({
-            /// load current cell into al, then negate it
-            // mov %eax, [r10+r11*4]
-                0x43, 0x8b, 0x04, 0x9a,
-            // neg %eax
-                0xf7, 0xd8
-            });
+        as_.movdqu(Xmm::XMM0, chunk);
+    }
+    if (anyConst) {
+        generateVectorConstant(Xmm::XMM1, keepWords[0], bytes == 8 ? 0 : keepWords[1]);
+        as_.pand(Xmm::XMM0, Xmm::XMM1);
+    }
+    generateVectorConstant(Xmm::XMM1, valueWords[0], bytes == 8 ? 0 : valueWords[1]);
+    as_.padd(CELL_WIDTH, Xmm::XMM0, Xmm::XMM1);
+    if (bytes == 8) {
+        as_.movq(chunk, Xmm::XMM0);
+    } else {
+        as_.movdqu(chunk, Xmm::XMM0);
+    }
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateVectorConstant(Xmm dst, uint64_t low, uint64_t high) {
+    /// Through rax, since SSE2 has no immediate operands. xmm2 is used for the high half.
+    if (low == 0 && high == 0) {
+        as_.pxor(dst, dst);
+        return;
+    }
+    as_.movImm(Reg::RAX, low);
+    as_.movq(dst, Reg::RAX);
+    if (high == low) {
+        as_.punpcklqdq(dst, dst);
+    } else if (high != 0) {
+        as_.movImm(Reg::RAX, high);
+        as_.movq(Xmm::XMM2, Reg::RAX);
+        as_.punpcklqdq(dst, Xmm::XMM2);
+    }
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateMulGroup(const std::vector<Instruction> &prog, size_t begin, size_t end) {
+    /// A group of MULs (from one multiplication loop) reads the same source
+    /// cell, so it is loaded once, unless one of the MULs writes to it
+    int minOffset = std::numeric_limits<int>::max(), maxOffset = std::numeric_limits<int>::min();
+    for (size_t i = begin; i < end; ++i) {
+        if (wrapOffset(prog[i].a_, BFMEM_LENGTH) == 0) {
+            for (size_t j = begin; j < end; ++j) {
+                generateInsMul(prog[j].a_, prog[j].b_);
+            }
+            return;
+        }
+        minOffset = std::min(minOffset, prog[i].a_);
+        maxOffset = std::max(maxOffset, prog[i].a_);
+    }
+    if (!cellInR12_) {
+        generateLoadCell();
+    }
+    /// When there are several targets, check once whether all of them are on
+    /// the tape without wrapping, and if so address them with displacements
+    constexpr int64_t MAX_DISPLACEMENT = std::numeric_limits<int32_t>::max() / sizeof(CellType);
+    const bool direct = end - begin > 1 && (int64_t)maxOffset - minOffset < BFMEM_LENGTH &&
+                        std::max(std::abs((int64_t)minOffset), std::abs((int64_t)maxOffset)) < MAX_DISPLACEMENT;
+    Label wrapped, done;
+    if (direct) {
+        as_.lea(Width::D, Reg::RCX, mem(Reg::R11, minOffset));
+        as_.cmp(Width::D, Reg::RCX, BFMEM_LENGTH - 1 - (maxOffset - minOffset));
+        as_.jcc(Cond::A, wrapped);
+        generateMulTargets(prog, begin, end, true);
+        as_.jmp(done);
+        as_.bind(wrapped);
+    }
+    generateMulTargets(prog, begin, end, false);
+    if (direct) {
+        as_.bind(done);
+    }
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateMulTargets(const std::vector<Instruction> &prog, size_t begin, size_t end,
+                                                 bool direct) {
+    /// The source cell is in r12. Negative factors subtract the product of
+    /// the magnitude, and products are reused by consecutive equal magnitudes.
+    int productInEax = 0;
+    for (size_t i = begin; i < end; ++i) {
+        const int offset = prog[i].a_;
+        const int factor = (CellType)prog[i].b_;
+        if (factor == 0) {
+            continue;
+        }
+        Mem target = mem(Reg::R10, Reg::R11, sizeof(CellType), offset * (int)sizeof(CellType));
+        if (!direct) {
+            const int destOffset = IS_POW_2_MEM_LENGTH ? offset : wrapOffset(offset, BFMEM_LENGTH);
+            as_.lea(Width::D, Reg::RCX, mem(Reg::R11, destOffset));
+            generateWrapIndex(Reg::RCX);
+            target = mem(Reg::R10, Reg::RCX, sizeof(CellType));
+        }
+        const bool negative = factor < 0 && factor != std::numeric_limits<int>::min();
+        const int magnitude = negative ? -factor : factor;
+        Reg product = Reg::R12;
+        if (magnitude != 1) {
+            if (productInEax != magnitude) {
+                generateMulProduct(magnitude);
+                productInEax = magnitude;
+            }
+            product = Reg::RAX;
+        }
+        if (negative) {
+            as_.sub(CELL_WIDTH, target, product);
         } else {
-            buf_.write_bytes({
-            /// load current cell into r12
-            // mov %r12d, [r10+r11*4]
-                0x47, 0x8b, 0x24, 0x9a,
-            /// mult r12 by multFactor, store in al
-            // mov %eax, multFactor
-                0xb8
-            });
-            buf_.write_val((CellType)multFactor);
-            buf_.write_bytes({
-            // mul r12d
-                0x41, 0xf7, 0xe4
-            });
+            as_.add(CELL_WIDTH, target, product);
         }
-        buf_.write_bytes({
-        /// add value from remote
-        // add %al, [r10+rdx]
-            0x41, 0x03, 0x04, 0x8a,
-        /// store at remote
-        // mov [r10+rdx], %al
-            0x41, 0x89, 0x04, 0x8a
-        });
     }
 }
 
+template <typename CellType>
+void CodeGenerator<CellType>::generateMulProduct(int factor) {
+    /// eax = r12d * factor, using lea or shl where they can do it. Only the
+    /// low CELL_WIDTH bits of the result are used, so the upper bits of r12
+    /// don't matter.
+    switch (factor) {
+    case 2:
+    case 3:
+    case 5:
+    case 9:
+        as_.lea(Width::D, Reg::RAX, mem(Reg::R12, Reg::R12, factor - 1));
+        return;
+    default:
+        break;
+    }
+    if (factor > 0 && (factor & (factor - 1)) == 0) {
+        as_.mov(Width::D, Reg::RAX, Reg::R12);
+        as_.shl(Width::D, Reg::RAX, __builtin_ctz(factor));
+    } else {
+        as_.imul(Width::D, Reg::RAX, Reg::R12, factor);
+    }
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateInsMul(int offset, CellType multFactor) {
+    const int destOffset = IS_POW_2_MEM_LENGTH ? offset : wrapOffset(offset, BFMEM_LENGTH);
+    /// Strategy:
+    /// load index of remote into rcx
+    as_.lea(Width::D, Reg::RCX, mem(Reg::R11, destOffset));
+    generateWrapIndex(Reg::RCX);
+    /// load current cell into eax, and multiply it by multFactor
+    if (multFactor == 1 || multFactor == -1 || CELL_WIDTH == Width::D) {
+        as_.mov(CELL_WIDTH, Reg::RAX, currentCell());
+    } else {
+        as_.movzx(CELL_WIDTH, Reg::RAX, currentCell());
+    }
+    if (multFactor == -1) {
+        as_.neg(CELL_WIDTH, Reg::RAX);
+    } else if (multFactor != 1) {
+        as_.imul(Width::D, Reg::RAX, Reg::RAX, multFactor);
+    }
+    /// add to remote
+    as_.add(CELL_WIDTH, mem(Reg::R10, Reg::RCX, sizeof(CellType)), Reg::RAX);
+    // The remote cell is only the current cell if the offset wraps all the way around
+    if (wrapOffset(offset, BFMEM_LENGTH) == 0) {
+        cellInR12_ = false;
+    }
+}
+
+template <typename CellType>
+std::optional<int32_t> CodeGenerator<CellType>::stridedLoopInlineTrips(const Instruction &loop) const {
+    if (!loop.b_ || elf_) {
+        return std::nullopt;
+    }
+    if (!profile_) {
+        return STRIDED_LOOP_INLINE_TRIPS;
+    }
+    /// Loops that mostly run long go straight to runStridedLoop, and loops
+    /// that never ran long, or never ran at all, don't use it
+    const LoopProfile *profile = profile_->find(loop.a_);
+    const double longEntries = profile ? profile->fractionWithTrips(STRIDED_LOOP_INLINE_TRIPS) : 0;
+    if (longEntries >= 0.5) {
+        return 0;
+    } else if (longEntries > 0) {
+        return STRIDED_LOOP_INLINE_TRIPS;
+    }
+    return std::nullopt;
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateStridedLoopCall(const StridedLoop &strided) {
+    /// runStridedLoop runs the iterations it can, and leaves the scalar loop
+    /// to finish if it stops at the edge of the tape
+    as_.mov(Width::Q, Reg::RDI, Reg::R10);
+    as_.mov(Width::Q, Reg::RSI, Reg::R11);
+    as_.movImm(Reg::RDX, reinterpret_cast<uintptr_t>(&strided));
+    as_.movImm(Reg::RAX, reinterpret_cast<uintptr_t>(&runStridedLoop<CellType>));
+    generateCall(Reg::RAX);
+    as_.mov(Width::Q, Reg::R11, Reg::RAX);
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateCall(Reg function) {
+    /// r10 and r11 are caller saved, and pushing rbp keeps the stack 16 byte aligned
+    as_.push(Reg::R10);
+    as_.push(Reg::R11);
+    as_.push(Reg::RBP);
+    as_.mov(Width::Q, Reg::RBP, Reg::RSP);
+    as_.call(function);
+    as_.pop(Reg::RBP);
+    as_.pop(Reg::R11);
+    as_.pop(Reg::R10);
+}
+
 template <typename CellType>
 void CodeGenerator<CellType>::generateInsOut() {
-    buf_.write_bytes({
-    // push %r10
-        0x41, 0x52,
-    // push %r11
-        0x41, 0x53,
-    // push %rbp
-        0x55,
-    // mov %rbp, %rsp
-        0x48, 0x89, 0xe5,
-    // xor %edi, %edi
-        0x31, 0xff
-    });
-    if constexpr (std::is_same<CellType, char>::value) {
-        buf_.write_bytes({
-        // mov %dil, [r10+r11]
-            0x43, 0x8a, 0x3c, 0x1a,
-        });
-    } else if constexpr (std::is_same<CellType, short>::value) {
-        buf_.write_bytes({
-        // mov %dil, [r10+r11*2]
-            0x43, 0x8a, 0x3c, 0x5a,
-        });
+    // r12 is callee saved, and OUT doesn't modify the cell, so cellInR12_ stays valid
+    auto out = [this] {
+        as_.movzx(Width::B, Reg::RDI, currentCell());
+        generateCall(Reg::R13);
+    };
+    if (isColdIO()) {
+        generateColdPath(std::nullopt, cellInR12_, out);
     } else {
-        buf_.write_bytes({
-        // mov %dil, [r10+r11*4]
-            0x43, 0x8a, 0x3c, 0x9a,
-        });
+        out();
     }
-    buf_.write_bytes({
-    // call *%r13
-        0x41, 0xff, 0xd5,
-    // pop %rbp
-        0x5d,
-    // pop %r11
-        0x41, 0x5b,
-    // pop %r10
-        0x41, 0x5a
-    });
 }
 
 template <typename CellType>
 void CodeGenerator<CellType>::generateInsConst(int constant) {
-    if constexpr (std::is_same<CellType, char>::value) {
-        buf_.write_bytes({
-        // movb [r10+r11], $constant
-            0x43, 0xc6, 0x04, 0x1a
-        });
-    } else if constexpr (std::is_same<CellType, short>::value) {
-        buf_.write_bytes({
-        // movw [r10+r11*2], $constant
-            0x66, 0x43, 0xc7, 0x04, 0x5a
-        });
+    cellInR12_ = false;
+    as_.mov(CELL_WIDTH, currentCell(), (CellType)constant);
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateInsDivMod(const Instruction &ins) {
+    /// The same as runDivMod(), except that idioms that wrap around the tape
+    /// are left to their loop, so the cells can be addressed directly
+    const auto &idiom = DIVMOD_IDIOMS[ins.a_];
+    const auto cells = divModCells(ins);
+    if (cells.back() - cells.front() >= BFMEM_LENGTH) {
+        return;
+    }
+    auto cell = [&](int offset) {
+        return mem(Reg::R10, Reg::R11, sizeof(CellType), offset * ins.b_ * (int)sizeof(CellType));
+    };
+    auto load = [&](Reg reg, int offset) {
+        if constexpr (CELL_WIDTH == Width::D) {
+            as_.mov(Width::D, reg, cell(offset));
+        } else {
+            as_.movzx(CELL_WIDTH, reg, cell(offset));
+        }
+    };
+    Label skip, small, done;
+    as_.lea(Width::D, Reg::RCX, mem(Reg::R11, cells.front()));
+    as_.cmp(Width::D, Reg::RCX, BFMEM_LENGTH - 1 - (cells.back() - cells.front()));
+    as_.jcc(Cond::A, skip);
+    for (int zero : idiom.zeros) {
+        as_.cmp(CELL_WIDTH, cell(zero), 0);
+        as_.jcc(Cond::NZ, skip);
+    }
+    /// esi = counter, edi = period, ecx = n
+    load(Reg::RSI, idiom.counter);
+    as_.test(Width::D, Reg::RSI, Reg::RSI);
+    as_.jcc(Cond::Z, skip);
+    load(Reg::RDI, idiom.remainder);
+    as_.add(Width::D, Reg::RDI, Reg::RSI);
+    if constexpr (CELL_WIDTH == Width::D) {
+        as_.jcc(Cond::B, skip);
     } else {
-        buf_.write_bytes({
-        // movl [r10+r11*4], $constant
-            0x43, 0xc7, 0x04, 0x9a
-        });
+        as_.cmp(Width::D, Reg::RDI, std::numeric_limits<std::make_unsigned_t<CellType>>::max());
+        as_.jcc(Cond::A, skip);
+    }
+    as_.cmp(Width::D, Reg::RDI, 2);
+    as_.jcc(Cond::B, skip);
+    load(Reg::RCX, 0);
+    as_.cmp(Width::D, Reg::RCX, Reg::RSI);
+    as_.jcc(Cond::B, small, true);
+    /// Past the first reset, the rest of n goes through whole periods
+    as_.mov(Width::D, Reg::RAX, Reg::RCX);
+    as_.sub(Width::D, Reg::RAX, Reg::RSI);
+    as_.xor_(Width::D, Reg::RDX, Reg::RDX);
+    as_.div(Width::D, Reg::RDI);
+    as_.mov(CELL_WIDTH, cell(idiom.remainder), Reg::RDX);
+    as_.sub(Width::D, Reg::RDI, Reg::RDX);
+    as_.mov(CELL_WIDTH, cell(idiom.counter), Reg::RDI);
+    if (idiom.quotient != 0) {
+        as_.inc(Width::D, Reg::RAX);
+        as_.add(CELL_WIDTH, cell(idiom.quotient), Reg::RAX);
     }
-    buf_.write_val((CellType)constant);
+    as_.jmp(done, true);
+    as_.bind(small);
+    as_.sub(Width::D, Reg::RSI, Reg::RCX);
+    as_.mov(CELL_WIDTH, cell(idiom.counter), Reg::RSI);
+    as_.sub(Width::D, Reg::RDI, Reg::RSI);
+    as_.mov(CELL_WIDTH, cell(idiom.remainder), Reg::RDI);
+    as_.bind(done);
+    if (idiom.copy != 0) {
+        as_.add(CELL_WIDTH, cell(idiom.copy), Reg::RCX);
+    }
+    as_.mov(CELL_WIDTH, cell(0), 0);
+    as_.bind(skip);
+    cellInR12_ = false;
+}
+
+template <typename CellType>
+void CodeGenerator<CellType>::generateInsCompare(const Instruction &ins) {
+    /// Like generateInsDivMod(), for runCompare()
+    const auto &idiom = COMPARE_IDIOMS[ins.a_];
+    const auto cells = compareCells(ins);
+    if (cells.back() - cells.front() >= BFMEM_LENGTH) {
+        return;
+    }
+    auto cell = [&](int offset) {
+        return mem(Reg::R10, Reg::R11, sizeof(CellType), offset * ins.b_ * (int)sizeof(CellType));
+    };
+    auto load = [&](Reg reg, int offset) {
+        if constexpr (CELL_WIDTH == Width::D) {
+            as_.mov(Width::D, reg, cell(offset));
+        } else {
+            as_.movzx(CELL_WIDTH, reg, cell(offset));
+        }
+    };
+    Label skip, counts, done;
+    as_.lea(Width::D, Reg::RCX, mem(Reg::R11, cells.front()));
+    as_.cmp(Width::D, Reg::RCX, BFMEM_LENGTH - 1 - (cells.back() - cells.front()));
+    as_.jcc(Cond::A, skip);
+    as_.cmp(CELL_WIDTH, cell(idiom.one), 1);
+    as_.jcc(Cond::NZ, skip);
+    as_.cmp(CELL_WIDTH, cell(idiom.zero), 0);
+    as_.jcc(Cond::NZ, skip);
+    /// esi = counter, ecx = n
+    load(Reg::RSI, idiom.counter);
+    load(Reg::RCX, 0);
+    as_.test(Width::D, Reg::RSI, Reg::RSI);
+    as_.jcc(Cond::Z, counts, true);
+    as_.cmp(Width::D, Reg::RSI, Reg::RCX);
+    as_.jcc(Cond::A, counts, true);
+    as_.add(CELL_WIDTH, cell(idiom.x), -1);
+    as_.mov(CELL_WIDTH, cell(idiom.counter), 0);
+    as_.jmp(done, true);
+    as_.bind(counts);
+    as_.sub(Width::D, Reg::RSI, Reg::RCX);
+    as_.mov(CELL_WIDTH, cell(idiom.counter), Reg::RSI);
+    as_.bind(done);
+    as_.mov(CELL_WIDTH, cell(0), 0);
+    as_.bind(skip);
+    cellInR12_ = false;
 }
 
 template <typename CellType>
 void CodeGenerator<CellType>::generateEpilogue() {
+    /// Return the data pointer, so a later function can continue from it
+    as_.mov(Width::Q, Reg::RAX, Reg::R11);
     /// Restore callee-saved registers
-    buf_.write_bytes({
-    // pop %r15
-        0x41, 0x5f,
-    // pop %r14
-        0x41, 0x5e,
-    // pop %r13
-        0x41, 0x5d,
-    // pop %r12
-        0x41, 0x5c,
+    if (safepointsEnabled_ && !elf_) {
+        as_.pop(Reg::RBP);
+        as_.pop(Reg::RBX);
+    }
+    as_.pop(Reg::R15);
+    as_.pop(Reg::R14);
+    as_.pop(Reg::R13);
+    as_.pop(Reg::R12);
     /// Return from function
-    // ret
-        0xc3
-    });
+    as_.ret();
 }
 
 template <typename CellType>
-void CodeGenerator<CellType>::enter(ASMBufOffset offset) {
+size_t CodeGenerator<CellType>::enter(ASMBufOffset offset) {
     buf_.set_executable(true);
-    buf_.enter(offset);
+    safepoints_.stoppedAt = SafepointState::NOT_STOPPED;
+    return buf_.enter(offset);
+}
+
+template <typename CellType>
+size_t CodeGenerator<CellType>::resume() {
+    if (!stopped()) {
+        throw JITError("ICE: Resumed a program that didn't stop");
+    }
+    safepoints_.resumeAddress = buf_.address_at_offset(safepointOffsets_.at(safepoints_.stoppedAt));
+    safepoints_.stoppedAt = SafepointState::NOT_STOPPED;
+    return buf_.enter(*resumeTrampoline_);
 }
 
 template <typename CellType>
@@ -559,6 +1591,31 @@ size_t CodeGenerator<CellType>::generatedLength() const {
     return buf_.current_offset();
 }
 
+template <typename CellType>
+void CodeGenerator<CellType>::recordIrOffset(size_t irIndex) {
+    currentIr_ = irIndex;
+    if (!sampleProfile_) {
+        return;
+    }
+    /// Code is only ever appended, so the table stays sorted
+    const ASMBufOffset offset = buf_.current_offset();
+    if (!irOffsets_.empty() && irOffsets_.back().first == offset) {
+        irOffsets_.back().second = irIndex;
+    } else {
+        irOffsets_.emplace_back(offset, irIndex);
+    }
+}
+
+template <typename CellType>
+std::optional<size_t> CodeGenerator<CellType>::irIndexAt(ASMBufOffset offset) const {
+    auto it = std::upper_bound(irOffsets_.begin(), irOffsets_.end(), offset,
+                               [](ASMBufOffset offset, const auto &entry) { return offset < entry.first; });
+    if (it == irOffsets_.begin() || std::prev(it)->second == NOT_IR) {
+        return std::nullopt;
+    }
+    return std::prev(it)->second;
+}
+
 template class CodeGenerator<char>;
 template class CodeGenerator<short>;
 template class CodeGenerator<int>;
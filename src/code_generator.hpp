@@ -1,17 +1,28 @@
 #pragma once
 
 #include <cstdint>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <signal.h>
 #include <string>
+#include <tuple>
 #include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "arguments.hpp"
 #include "asmbuf.hpp"
+#include "assembler.hpp"
 #include "error.hpp"
 #include "ir.hpp"
+#include "profile.hpp"
 #include "runtime.hpp"
+#include "strided_loop.hpp"
+#include "tape.hpp"
 
 template <typename T> bool is_pow_2(T v) {
     size_t nonZeroBits = 0;
@@ -21,22 +32,171 @@ template <typename T> bool is_pow_2(T v) {
     return nonZeroBits == 1;
 }
 
+// Shared with the safepoints generated on loop back edges for --fuel and
+// --time-limit, see CodeGenerator::generateSafepoint()
+struct SafepointState {
+    static constexpr uint32_t NOT_STOPPED = std::numeric_limits<uint32_t>::max();
+    // Loop iterations the program may still run, beyond the slice of them in rbx
+    uint64_t fuel{std::numeric_limits<int64_t>::max()};
+    // Set, from a signal handler or another thread, to stop the program at its next poll
+    volatile sig_atomic_t stop{};
+    // Safepoint the program stopped at, with the data pointer it had there
+    uint32_t stoppedAt{NOT_STOPPED};
+    uint64_t dp{};
+    // Where the resume trampoline jumps to
+    uintptr_t resumeAddress{};
+    // With --serve, the tape of the session that runs, since sessions share the code
+    uintptr_t tape{};
+};
+
 template <typename CellType>
 class CodeGenerator {
   private:
-    void generatePrelude();
+    // (start offset, instruction, name), where a null name means the instruction is used
+    using SymbolMap = std::vector<std::tuple<ASMBufOffset, Instruction, const char *>>;
+    struct LazyLoop {
+        // Range of lazyProg_ covered by the loop
+        size_t begin;
+        size_t end;
+        ASMBufOffset stubOffset;
+        ASMBufOffset resumeOffset;
+    };
+    // Rarely run code, generated after the hot code and jumping back to it
+    struct ColdStub {
+        Label entry;
+        Label resume;
+        bool cellInR12{};         // cellInR12_ where the stub is entered
+        bool cellInR12AtResume{}; // What the hot code expects where it resumes
+        size_t irIndex{};         // Instruction the stub is generated for, see irOffsets_
+        std::function<void()> generate;
+    };
+    // A loop that occurs more than once, generated once after the hot code as
+    // a subroutine that each occurrence calls, see findOutlinedLoops()
+    struct OutlinedLoop {
+        Label entry;
+        // The first occurrence, which is what gets generated
+        size_t begin{};
+        size_t end{};
+        bool called{};
+    };
+    void generateRange(const std::vector<Instruction> &prog, size_t begin, size_t end, bool lazyLoops,
+                       SymbolMap &symbolMap);
+    // LOOP or IF instruction, when not handled as a lazy or cold loop
+    void generateLoopStart(const std::vector<Instruction> &prog, size_t i);
+    static size_t matchingEndLoop(const std::vector<Instruction> &prog, size_t loopStart);
+    void writePerfMap(const SymbolMap &symbolMap);
+    // Note that the code from here on is for instruction irIndex, for --sample-profile
+    void recordIrOffset(size_t irIndex);
+    void generateLazyLoopStub(size_t begin, size_t end);
+    static uintptr_t lazyCompileEntry(CodeGenerator *self, uint32_t lazyLoopIndex);
+    uintptr_t compileLazyLoop(uint32_t lazyLoopIndex);
+    void findHotLoops(const std::vector<Instruction> &prog);
+    bool isColdLoop(const Instruction &loop) const;
+    bool isColdIO() const;
+    // Jump to generate()'s code out of line when cond holds, or always without one.
+    // The cold code jumps back to the stub's resume label, bound right after the
+    // jump unless bindResume is false.
+    ColdStub &generateColdPath(std::optional<Cond> cond, bool cellInR12AtResume, std::function<void()> generate,
+                               bool bindResume = true);
+    void generateColdCode(SymbolMap &symbolMap);
+    // Choose the loops of prog to outline
+    void findOutlinedLoops(const std::vector<Instruction> &prog);
+    // Whether the loops starting at a and b are the same, apart from their loop numbers
+    static bool sameLoop(const std::vector<Instruction> &prog, size_t a, size_t b, size_t length);
+    // Generate the subroutines of the outlined loops that have been called
+    void generateOutlinedLoops(const std::vector<Instruction> &prog, SymbolMap &symbolMap);
+    // Generate the cold code and the outlined loops, which can each lead to more of the other
+    void generateOutOfLineCode(const std::vector<Instruction> &prog, SymbolMap &symbolMap);
+    void generatePrelude(uintptr_t tape, uintptr_t putChar, uintptr_t getChar, size_t dp = 0);
+    void generateElfFlush(Label &flush);
+    void generateElfPutChar(Label &flush);
+    void generateElfGetChar(Label &flush);
     void generateInsAdd(CellType step);
     void generateInsAdp(int step);
     void generateInsEndLoop(int loopNumber);
+    // Pay for backEdges loop iterations out of the fuel, and poll the stop flag
+    // when it runs out. Without backEdges, pay at the entry of a counted loop
+    // for all of its trips, which are its cell times tripFactor.
+    void generateSafepoint(std::optional<int32_t> backEdges, uint32_t tripFactor = 1);
+    // For a loop that runs as many times as its cell at entry says, modulo the
+    // cell width, the factor that turns the cell into its trip count
+    std::optional<uint32_t> countedLoopTripFactor(const std::vector<Instruction> &prog, size_t loopStart) const;
+    void generateResumeTrampoline();
+    // Save the data pointer where resume() continues from safepoint index, and
+    // leave through the epilogue. rax holds &safepoints_.
+    void generateStop(uint32_t index);
+    void generateInsEndIf(int loopNumber);
     void generateInsIn();
-    void generateInsLoop(int loopNumber);
+    void generateInsLoop(int loopNumber, const StridedLoop *strided = nullptr, int32_t inlineTrips = 0);
+    void generateInsIf(int loopNumber);
     void generateInsMul(int offset, CellType multFactor);
+    // What a run of ADD, ADP and CONST does to one cell
+    struct RunCell {
+        bool isConst{};
+        int value{};
+    };
+    void generateRun(const std::vector<Instruction> &prog, size_t begin, size_t end);
+    void generateRunInstructions(const std::vector<Instruction> &prog, size_t begin, size_t end);
+    size_t runChunkCost(const std::vector<std::pair<int, RunCell>> &cells, size_t k, size_t n, int bytes) const;
+    void generateRunChunk(const std::vector<std::pair<int, RunCell>> &cells, size_t k, size_t n, int bytes);
+    void generateVectorConstant(Xmm dst, uint64_t low, uint64_t high);
+    void generateMulGroup(const std::vector<Instruction> &prog, size_t begin, size_t end);
+    void generateMulTargets(const std::vector<Instruction> &prog, size_t begin, size_t end, bool direct);
+    void generateMulProduct(int factor);
     void generateInsOut();
     void generateInsConst(int constant);
+    void generateInsDivMod(const Instruction &ins);
+    void generateInsCompare(const Instruction &ins);
     void generateEpilogue();
-    ASMBuf buf_{4};
-    std::vector<CellType> &bfMem_;
-    std::unordered_map<size_t, std::pair<uintptr_t, uintptr_t>> loopStarts_;
+    void generateLoopLoadTest();
+    // Load the current cell, or the given one, into r12
+    void generateLoadCell(const Mem &cell = currentCell());
+    void generateLoopTest();
+    void generateWrapIndex(Reg index);
+    void generateCall(Reg function);
+    // Iterations to run before calling runStridedLoop, or nullopt for a plain loop
+    std::optional<int32_t> stridedLoopInlineTrips(const Instruction &loop) const;
+    void generateStridedLoopCall(const StridedLoop &strided);
+    void alignLoopHead();
+    static Mem currentCell() { return mem(Reg::R10, Reg::R11, sizeof(CellType)); }
+    static constexpr Width CELL_WIDTH{static_cast<Width>(sizeof(CellType))};
+    struct LoopLabels {
+        Label body;
+        Label exit;
+        const StridedLoop *strided{};
+        int32_t inlineTrips{};
+        // How the loop pays for its iterations with safepoints enabled: on every
+        // back edge, or with a tripFactor at entry, or when strided, at the hand over
+        std::optional<uint32_t> tripFactor;
+    };
+    // Length in instructions, LOOP and END_LOOP included, from which loops
+    // that occur more than once are outlined. Hot loops stay inline for
+    // longer, since they pay for the call more often.
+    static constexpr size_t MIN_OUTLINED_LENGTH = 16;
+    static constexpr size_t HOT_MIN_OUTLINED_LENGTH = 64;
+    // Loop iterations between two polls of the stop flag, each costing a trip to cold code
+    static constexpr uint32_t SAFEPOINT_SLICE = 1 << 16;
+    // Iterations a strided loop runs in place before handing over to runStridedLoop
+    static constexpr int32_t STRIDED_LOOP_INLINE_TRIPS = 64;
+    // With a profile, loops running at least 1/PROFILE_HOT_LOOP_SHARE of all iterations are hot
+    static constexpr uint64_t PROFILE_HOT_LOOP_SHARE = 1000;
+    ASMBuf buf_;
+    Assembler as_{buf_};
+    Tape<CellType> &bfMem_;
+    std::unordered_map<size_t, LoopLabels> loopLabels_;
+    // Loops whose heads get aligned: innermost loops, or the hot ones in the profile
+    std::unordered_set<int> hotLoops_;
+    // Numbers of the LOOPs around the instruction being generated, innermost last
+    std::vector<int> loopNest_;
+    std::deque<ColdStub> coldStubs_;
+    static constexpr size_t NOT_OUTLINED = std::numeric_limits<size_t>::max();
+    // Index into outlinedLoops_ of each LOOP of the program being compiled, or NOT_OUTLINED
+    std::vector<size_t> outlinedIndex_;
+    std::vector<OutlinedLoop> outlinedLoops_;
+    // Outlined loops that have been called, but not generated yet
+    std::vector<size_t> pendingOutlined_;
+    // True if r12 currently holds the value of the current cell
+    bool cellInR12_{false};
     GetCharFunc getChar_;
     PutCharFunc putChar_;
     GetCharBehaviour getCharBehaviour;
@@ -46,11 +206,40 @@ class CodeGenerator {
     const bool IS_POW_2_MEM_LENGTH{is_pow_2(BFMEM_LENGTH)};
     const bool genPerfMap_{false};
     std::ofstream perfSymbolMap_;
+    // Marks code not generated for an instruction in irOffsets_
+    static constexpr size_t NOT_IR = std::numeric_limits<size_t>::max();
+    const bool sampleProfile_{false};
+    // (start offset, instruction index) for each piece of code, in order of offset
+    std::vector<std::pair<ASMBufOffset, size_t>> irOffsets_;
+    // Index of the instruction being generated
+    size_t currentIr_{NOT_IR};
+    const bool lazy_{false};
+    // Set when generating a standalone executable, which can't call back into this process
+    bool elf_{false};
+    const bool noFlush_;
+    const Profile *profile_;
+    std::vector<Instruction> lazyProg_;
+    std::vector<LazyLoop> lazyLoops_;
+    // Descriptors passed to runStridedLoop, a deque so that their addresses are stable
+    std::deque<StridedLoop> stridedLoops_;
+    // --serve, which suspends the program at an IN that has no input yet
+    const bool serving_{false};
+    // --fuel, --time-limit or --serve, which put safepoints on loop back edges
+    const bool safepointsEnabled_{false};
+    SafepointState safepoints_;
+    // Offset of each safepoint, which resume() continues from
+    std::vector<ASMBufOffset> safepointOffsets_;
+    std::optional<ASMBufOffset> resumeTrampoline_;
+    // Epilogue of the function being compiled, which safepoints leave through
+    Label epilogue_;
 
   public:
-    CodeGenerator(std::vector<CellType> &bfMem, const Arguments &args)
-        : bfMem_{bfMem}, getChar_{getCharFunc(args)},
-          putChar_{putCharFunc(args)}, getCharBehaviour{args.getCharBehaviour}, genPerfMap_{args.genSyms} {
+    CodeGenerator(Tape<CellType> &bfMem, const Arguments &args, const Profile *profile = nullptr)
+        : buf_{4, args.lazyJit ? ASMBufMapping::DualMapped : ASMBufMapping::Private}, bfMem_{bfMem},
+          getChar_{getCharFunc(args)}, putChar_{putCharFunc(args)}, getCharBehaviour{args.getCharBehaviour},
+          genPerfMap_{args.genSyms}, sampleProfile_{args.sampleProfile}, lazy_{args.lazyJit}, noFlush_{args.noFlush},
+          profile_{profile}, serving_{args.servePort != 0},
+          safepointsEnabled_{args.fuel > 0 || args.timeLimit > 0 || serving_} {
         if (genPerfMap_) {
             size_t pid = getpid();
             std::stringstream ss;
@@ -58,8 +247,21 @@ class CodeGenerator {
             perfSymbolMap_.open(ss.str());
         }
     }
-    ASMBufOffset compile(const std::vector<Instruction> &prog);
-    void enter(ASMBufOffset);
+    // Append prog as a function starting with the data pointer at dp, see enter()
+    ASMBufOffset compile(const std::vector<Instruction> &prog, size_t dp = 0);
+    // Write prog as a static executable with its own tape and IO, see elf_writer.hpp
+    void compileElf(const std::vector<Instruction> &prog, const std::string &path);
+    // Run a compiled function, returning the data pointer it ends with
+    size_t enter(ASMBufOffset);
+    // With --fuel or --time-limit, whether the last enter() or resume() returned
+    // because the program stopped at a safepoint, rather than because it finished
+    bool stopped() const { return safepoints_.stoppedAt != SafepointState::NOT_STOPPED; }
+    // Continue a program from the safepoint it stopped at, returning like enter()
+    size_t resume();
+    SafepointState &safepoints() { return safepoints_; }
     std::string instructionHexDump() const;
     size_t generatedLength() const;
+    uintptr_t codeAddress() const { return buf_.address_at_offset(0); }
+    // Index of the instruction the code at offset was generated for, with --sample-profile
+    std::optional<size_t> irIndexAt(ASMBufOffset offset) const;
 };
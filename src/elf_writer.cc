@@ -0,0 +1,61 @@
+#include <cstring>
+#include <string>
+#include <elf.h>
+#include <fstream>
+#include <sys/stat.h>
+
+#include "elf_writer.hpp"
+#include "error.hpp"
+
+void writeElf(const std::string &path, const ASMBuf &buf, ASMBufOffset entryOffset, size_t tapeBytes) {
+    static_assert(sizeof(Elf64_Ehdr) + 2 * sizeof(Elf64_Phdr) <= ELF_CODE_OFFSET);
+    const uint64_t fileSize = ELF_CODE_OFFSET + buf.current_offset();
+    if (ELF_BASE + fileSize > ELF_BSS_BASE) {
+        throw JITError("Generated code is too big for --emit-elf");
+    }
+
+    Elf64_Ehdr header{};
+    memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS64;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    header.e_type = ET_EXEC;
+    header.e_machine = EM_X86_64;
+    header.e_version = EV_CURRENT;
+    header.e_entry = ELF_CODE_BASE + entryOffset;
+    header.e_phoff = sizeof(Elf64_Ehdr);
+    header.e_ehsize = sizeof(Elf64_Ehdr);
+    header.e_phentsize = sizeof(Elf64_Phdr);
+    header.e_phnum = 2;
+
+    Elf64_Phdr code{};
+    code.p_type = PT_LOAD;
+    code.p_flags = PF_R | PF_X;
+    code.p_offset = 0;
+    code.p_vaddr = code.p_paddr = ELF_BASE;
+    code.p_filesz = code.p_memsz = fileSize;
+    code.p_align = PAGE_SIZE;
+
+    Elf64_Phdr bss{};
+    bss.p_type = PT_LOAD;
+    bss.p_flags = PF_R | PF_W;
+    bss.p_offset = 0;
+    bss.p_vaddr = bss.p_paddr = ELF_BSS_BASE;
+    bss.p_filesz = 0;
+    bss.p_memsz = ELF_TAPE + tapeBytes;
+    bss.p_align = PAGE_SIZE;
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(&code), sizeof(code));
+    out.write(reinterpret_cast<const char *>(&bss), sizeof(bss));
+    const std::string padding(ELF_CODE_OFFSET - sizeof(header) - sizeof(code) - sizeof(bss), '\0');
+    out.write(padding.data(), padding.size());
+    out.write(reinterpret_cast<const char *>(buf.bytes()), buf.current_offset());
+    out.close();
+    if (!out.good()) {
+        throw JITError("Failed to write \"", path, "\"");
+    }
+    chmod(path.c_str(), 0755);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "asmbuf.hpp"
+
+// Memory layout of executables written by --emit-elf. The file is mapped
+// at ELF_BASE, with the code following the headers at a 64 byte aligned
+// offset, so code at buffer offset x runs at ELF_CODE_BASE + x and loop
+// alignment is preserved. Everything else lives in a zero filled segment
+// at ELF_BSS_BASE, far enough away that it doesn't depend on the code size.
+constexpr uint64_t ELF_BASE = 0x400000;
+constexpr uint64_t ELF_CODE_OFFSET = 0x100;
+constexpr uint64_t ELF_CODE_BASE = ELF_BASE + ELF_CODE_OFFSET;
+constexpr uint64_t ELF_BSS_BASE = 0x40000000;
+
+// Offsets into the bss segment
+constexpr int32_t ELF_IO_BUF_SIZE = 64 * 1024;
+constexpr int32_t ELF_OUT_LEN = 0;
+constexpr int32_t ELF_IN_POS = 8;
+constexpr int32_t ELF_IN_LEN = 16;
+constexpr int32_t ELF_OUT_BUF = PAGE_SIZE;
+constexpr int32_t ELF_IN_BUF = ELF_OUT_BUF + ELF_IO_BUF_SIZE;
+constexpr int32_t ELF_TAPE = ELF_IN_BUF + ELF_IO_BUF_SIZE;
+
+// Write a static executable containing buf, starting at entryOffset, with
+// a bss segment big enough for a tape of tapeBytes
+void writeElf(const std::string &path, const ASMBuf &buf, ASMBufOffset entryOffset, size_t tapeBytes);
@@ -1,16 +1,28 @@
+#include <cstdio>
 #include <ctime>
 #include <fstream>
+#include <limits>
+#include <optional>
 
 #include "arguments.hpp"
+#include "async_output.hpp"
+#include "batch.hpp"
 #include "code_generator.hpp"
 #include "engine.hpp"
+#include "fork_server.hpp"
 #include "interpreter.hpp"
+#include "loop_tree.hpp"
 #include "optimizer.hpp"
 #include "parser.hpp"
+#include "profile.hpp"
+#include "sample_profiler.hpp"
+#include "session_server.hpp"
+#include "tape_sizing.hpp"
+#include "watchdog.hpp"
 
 template <typename CellType>
 Engine<CellType>::Engine(const Arguments &arguments)
-    : rdbuf_(RDBUF_SIZE, 0), arguments_{arguments}, bfMem_(arguments_.bfMemLength, 0), optimizer_{arguments} {}
+    : rdbuf_(RDBUF_SIZE, 0), arguments_{arguments}, optimizer_{arguments} {}
 
 static double time() {
     static std::clock_t startTime = std::clock();
@@ -20,7 +32,70 @@ static double time() {
     return duration;
 }
 
+// Run compiled code to its end, or until it stops at a safepoint for good:
+// out of --fuel, or past --time-limit once the watchdog asks it to stop.
+// Stops before the time limit are only time slices, after which it resumes.
+template <typename CellType>
+static size_t runCompiled(CodeGenerator<CellType> &codeGenerator, ASMBufOffset offset, const Arguments &arguments,
+                          const Watchdog &watchdog) {
+    auto &safepoints = codeGenerator.safepoints();
+    size_t dp = codeGenerator.enter(offset);
+    while (codeGenerator.stopped()) {
+        if (!safepoints.stop) {
+            throw JITError("Ran out of fuel after ", arguments.fuel, " loop iterations");
+        }
+        if (watchdog.expired()) {
+            throw JITError("Exceeded the time limit of ", arguments.timeLimit, " seconds");
+        }
+        safepoints.stop = 0;
+        dp = codeGenerator.resume();
+    }
+    return dp;
+}
+
+// The interpreter's counterpart of SafepointState, polled and paid out of on
+// its loop back edges
+struct InterpreterLimits {
+    volatile sig_atomic_t stop{};
+    uint64_t fuel;
+    Watchdog watchdog;
+
+    explicit InterpreterLimits(const Arguments &arguments)
+        : fuel{arguments.fuel > 0 ? arguments.fuel : std::numeric_limits<uint64_t>::max()} {}
+    void start(const Arguments &arguments) {
+        if (arguments.timeLimit > 0) {
+            watchdog.start(&stop, arguments.timeLimit);
+        }
+    }
+};
+
+// The same for the interpreter, which only needs to stop when there is a limit
+template <typename CellType>
+static size_t runInterpreted(const std::vector<Instruction> &prog, Tape<CellType> &bfMem, const Arguments &arguments,
+                             Profile *profile, size_t dp, InterpreterLimits &limits) {
+    if (arguments.fuel == 0 && arguments.timeLimit == 0) {
+        return interpret(prog, bfMem, arguments, profile, dp);
+    }
+    size_t pc = 0;
+    dp = interpretSuspendable(prog, bfMem, arguments, pc, dp, limits.stop, limits.fuel, profile);
+    while (pc < prog.size()) {
+        if (!limits.stop) {
+            throw JITError("Ran out of fuel after ", arguments.fuel, " loop iterations");
+        }
+        if (limits.watchdog.expired()) {
+            throw JITError("Exceeded the time limit of ", arguments.timeLimit, " seconds");
+        }
+        limits.stop = 0;
+        dp = interpretSuspendable(prog, bfMem, arguments, pc, dp, limits.stop, limits.fuel, profile);
+    }
+    return dp;
+}
+
 template <typename CellType> void Engine<CellType>::run() {
+    if (arguments_.stream) {
+        runStreaming();
+        return;
+    }
     std::ifstream in;
     in.rdbuf()->pubsetbuf(rdbuf_.data(), RDBUF_SIZE);
 
@@ -33,10 +108,11 @@ template <typename CellType> void Engine<CellType>::run() {
         parser_.feed(in);
         in.close();
     }
-    auto prog = parser_.compile();
+    auto tree = parser_.compile();
     if (arguments_.optimize) {
-        optimizer_.optimize(prog);
+        optimizer_.optimize(tree);
     }
+    auto prog = tree.lower();
     if (arguments_.dumpCode) {
         std::cout << "Code:\n";
         for (auto ins: prog) {
@@ -46,40 +122,240 @@ template <typename CellType> void Engine<CellType>::run() {
     if (arguments_.verbose) {
         std::cout << "Compiled in " << time() << " seconds\n";
     }
+    std::optional<Profile> profile;
+    if (!arguments_.profileUse.empty() && arguments_.profileGenerate.empty()) {
+        profile = Profile::load(arguments_.profileUse, prog);
+    }
+    const Profile *profilePtr = profile ? &*profile : nullptr;
+    size_t tapeLength = arguments_.bfMemLength;
+    if (arguments_.autoMemSize) {
+        tapeLength = autoTapeLength(prog, profilePtr, tapeLength, arguments_.verbose);
+    }
+    auto &bfMem = bfMem_.emplace(tapeLength, arguments_.hugePages);
+    /// Runs while the program does, and is stopped before anything else is
+    /// printed, so that the program's output stays in order
+    AsyncOutput asyncOutput;
+    if (!arguments_.profileGenerate.empty()) {
+        Profile generated(prog, tapeLength);
+        time();
+        InterpreterLimits limits(arguments_);
+        limits.start(arguments_);
+        if (arguments_.asyncOutput) {
+            asyncOutput.start(arguments_.spliceOutput);
+        }
+        runInterpreted(prog, bfMem, arguments_, &generated, 0, limits);
+        asyncOutput.stop();
+        limits.watchdog.stop();
+        generated.save(arguments_.profileGenerate);
+        if (arguments_.verbose) {
+            std::cout << '\n';
+            std::cout << "Profiled " << generated.totalIterations() << " loop iterations in " << time()
+                      << " seconds\n";
+        }
+        return;
+    }
+    if (!arguments_.emitElf.empty()) {
+        CodeGenerator<CellType> codeGenerator(bfMem, arguments_, profilePtr);
+        codeGenerator.compileElf(prog, arguments_.emitElf);
+        if (arguments_.verbose) {
+            std::cout << "Wrote " << codeGenerator.generatedLength() << " bytes of code to " << arguments_.emitElf
+                      << '\n';
+        }
+        return;
+    }
+    if (arguments_.batch) {
+        if (!arguments_.dryRun) {
+            /// bfMem is where lanes that fall back to the scalar interpreter run
+            BatchRunner<CellType> runner(prog, bfMem, arguments_);
+            time();
+            runner.run();
+            if (arguments_.verbose) {
+                std::cout << "Ran " << runner.records() << " records in " << time() << " seconds, "
+                          << runner.fallbacks() << " of them fell back to the scalar interpreter\n";
+            }
+        }
+        return;
+    }
+    if (arguments_.servePort != 0 && !arguments_.dryRun) {
+        SessionServer<CellType> server(prog, bfMem, arguments_, profilePtr);
+        server.run();
+        return;
+    }
     if (!arguments_.dryRun) {
         if (arguments_.useInterpreter) {
             time();
-            interpret(prog, bfMem_, arguments_);
+            if (!arguments_.forkServerJobs.empty()) {
+                forkServerStart(arguments_.forkServerJobs);
+            }
+            InterpreterLimits limits(arguments_);
+            limits.start(arguments_);
+            if (arguments_.asyncOutput) {
+                asyncOutput.start(arguments_.spliceOutput);
+            }
+            runInterpreted(prog, bfMem, arguments_, nullptr, 0, limits);
+            asyncOutput.stop();
+            limits.watchdog.stop();
+            if (!arguments_.forkServerJobs.empty()) {
+                forkServerFinish();
+            }
             if (arguments_.verbose) {
                 std::cout << '\n';
                 std::cout << "Executed in " << time() << " seconds\n";
             }
         } else {
-            CodeGenerator codeGenerator(bfMem_, arguments_);
+            CodeGenerator codeGenerator(bfMem, arguments_, profilePtr);
+            if (arguments_.fuel > 0) {
+                codeGenerator.safepoints().fuel = arguments_.fuel;
+            }
             auto offset = codeGenerator.compile(prog);
             if (arguments_.verbose) {
                 std::cout << "Used " << codeGenerator.generatedLength() << " bytes\n";
-                std::cout << "Running with mem-size: " << arguments_.bfMemLength << " bytes\n";
+                std::cout << "Running with mem-size: " << bfMem.size() << " bytes\n";
             }
             if (arguments_.dumpCode) {
                 std::cout << "Instructions : " << codeGenerator.instructionHexDump() << '\n';
             }
 
             time();
-            codeGenerator.enter(offset);
+            if (!arguments_.forkServerJobs.empty()) {
+                forkServerStart(arguments_.forkServerJobs);
+            }
+            SampleProfiler sampler;
+            if (arguments_.sampleProfile) {
+                sampler.start(codeGenerator.codeAddress());
+            }
+            Watchdog watchdog;
+            if (arguments_.timeLimit > 0) {
+                watchdog.start(&codeGenerator.safepoints().stop, arguments_.timeLimit);
+            }
+            if (arguments_.asyncOutput) {
+                asyncOutput.start(arguments_.spliceOutput);
+            }
+            runCompiled(codeGenerator, offset, arguments_, watchdog);
+            asyncOutput.stop();
+            watchdog.stop();
+            sampler.stop();
+            if (!arguments_.forkServerJobs.empty()) {
+                forkServerFinish();
+            }
+            if (arguments_.sampleProfile) {
+                std::cout.flush();
+                sampler.report(std::cerr, prog, codeGenerator.generatedLength(),
+                               [&](size_t offset) { return codeGenerator.irIndexAt(offset); });
+            }
             if (arguments_.verbose) {
                 std::cout << '\n';
                 std::cout << "Executed in " << time() << " seconds\n";
+                if (arguments_.lazyJit) {
+                    std::cout << "Used " << codeGenerator.generatedLength() << " bytes after lazy compilation\n";
+                }
             }
         }
+        if (arguments_.verbose) {
+            std::cout << "Touched " << bfMem.residentBytes() << " bytes of tape\n";
+        }
         if (arguments_.dumpMem) {
-            std::cout << "Mem: ";
-            for (auto i = 0u; i < std::min((size_t)32, bfMem_.size()); ++i) {
-                std::cout << (int)bfMem_[i] << ' ';
+            dumpMemory();
+        }
+    }
+}
+
+// The source is parsed as it arrives. Whenever the input read so far ends
+// outside of any loop, the top level code since the last chunk is compiled
+// (or interpreted) and run right away, continuing on the tape and from the
+// data pointer the previous chunk left. A whole file that is already there
+// is one chunk; a pipe gives one whenever it runs dry between loops.
+template <typename CellType> void Engine<CellType>::runStreaming() {
+    std::ifstream in;
+    in.rdbuf()->pubsetbuf(rdbuf_.data(), RDBUF_SIZE);
+    /// The program isn't known up front, so --mem-size=auto keeps the default size
+    auto &bfMem = bfMem_.emplace(arguments_.bfMemLength, arguments_.hugePages);
+    std::optional<CodeGenerator<CellType>> codeGenerator;
+    Watchdog watchdog;
+    /// Shared by the chunks, so the limits are for the whole program
+    InterpreterLimits limits(arguments_);
+    if (arguments_.useInterpreter && !arguments_.dryRun) {
+        limits.start(arguments_);
+    } else if (!arguments_.useInterpreter) {
+        codeGenerator.emplace(bfMem, arguments_);
+        if (arguments_.fuel > 0) {
+            codeGenerator->safepoints().fuel = arguments_.fuel;
+        }
+        if (arguments_.timeLimit > 0 && !arguments_.dryRun) {
+            watchdog.start(&codeGenerator->safepoints().stop, arguments_.timeLimit);
+        }
+    }
+    AsyncOutput asyncOutput;
+    if (arguments_.asyncOutput && !arguments_.dryRun) {
+        asyncOutput.start(arguments_.spliceOutput);
+    }
+    size_t dp{};
+    size_t chunks{};
+    time();
+    for (auto &fileName : arguments_.fileNames) {
+        in.open(fileName);
+        if (!in.good()) {
+            throw JITError("Failed to open file \"", fileName, "\"");
+        }
+        for (bool more = true; more;) {
+            more = parser_.feedAvailable(in);
+            LoopTree *tree = parser_.chunk();
+            if (tree == nullptr) {
+                continue;
             }
-            std::cout << '\n';
+            /// Only the first chunk starts on a zeroed tape
+            if (arguments_.optimize) {
+                optimizer_.optimize(*tree, chunks == 0);
+            }
+            ++chunks;
+            const auto prog = tree->lower();
+            tree->root().clear();
+            if (arguments_.dumpCode) {
+                std::cout << "Code:\n";
+                for (auto ins : prog) {
+                    std::cout << ins << '\n';
+                }
+            }
+            if (arguments_.dryRun) {
+                continue;
+            }
+            /// Messages about the chunk come before its output, and the
+            /// output before the messages about the next one
+            if (arguments_.asyncOutput) {
+                fflush(stdout);
+            }
+            if (codeGenerator) {
+                dp = runCompiled(*codeGenerator, codeGenerator->compile(prog, dp), arguments_, watchdog);
+            } else {
+                dp = runInterpreted(prog, bfMem, arguments_, nullptr, dp, limits);
+            }
+            asyncOutput.flush();
+        }
+        in.close();
+    }
+    asyncOutput.stop();
+    watchdog.stop();
+    limits.watchdog.stop();
+    /// Reports a [ that the input never closed
+    parser_.compile();
+    if (arguments_.verbose) {
+        std::cout << '\n';
+        std::cout << "Streamed " << chunks << " chunks in " << time() << " seconds\n";
+        if (codeGenerator) {
+            std::cout << "Used " << codeGenerator->generatedLength() << " bytes\n";
         }
     }
+    if (arguments_.dumpMem && !arguments_.dryRun) {
+        dumpMemory();
+    }
+}
+
+template <typename CellType> void Engine<CellType>::dumpMemory() const {
+    std::cout << "Mem: ";
+    for (auto i = 0u; i < std::min((size_t)32, bfMem_->size()); ++i) {
+        std::cout << (int)(*bfMem_)[i] << ' ';
+    }
+    std::cout << '\n';
 }
 
 template class Engine<char>;
@@ -1,11 +1,13 @@
 #pragma once
 
+#include <optional>
 #include <vector>
 
 #include "arguments.hpp"
 #include "error.hpp"
 #include "optimizer.hpp"
 #include "parser.hpp"
+#include "tape.hpp"
 
 template <typename CellType> class Engine {
   public:
@@ -14,10 +16,15 @@ template <typename CellType> class Engine {
     void run();
 
   private:
+    // --stream: run each chunk of the source as soon as it has been read
+    void runStreaming();
+    void dumpMemory() const;
+
     static constexpr size_t RDBUF_SIZE = 256 * 1024;
     std::vector<char> rdbuf_;
     const Arguments &arguments_;
-    std::vector<CellType> bfMem_;
+    // Created once the program is known, since its size may depend on it
+    std::optional<Tape<CellType>> bfMem_;
     Optimizer optimizer_;
     Parser parser_{arguments_};
 };
@@ -0,0 +1,128 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "error.hpp"
+#include "fork_server.hpp"
+#include "watchdog.hpp"
+
+struct Job {
+    std::string input;
+    std::string output;
+};
+
+static std::vector<Job> jobs;
+// Output written before the first read, and where stdout pointed before that
+static int captureFd = -1;
+static int savedStdout = -1;
+static bool ranJobs = false;
+
+static void restoreStdout() {
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+    close(captureFd);
+}
+
+// Create the job's output file, starting with the captured output
+static int openOutput(const Job &job) {
+    int fd = open(job.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    fstat(captureFd, &st);
+    off_t offset = 0;
+    while (offset < st.st_size) {
+        if (sendfile(fd, captureFd, &offset, st.st_size - offset) <= 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+void forkServerStart(const std::string &jobFile) {
+    std::ifstream in(jobFile);
+    if (!in.good()) {
+        throw JITError("Failed to open job file \"", jobFile, "\"");
+    }
+    std::string line;
+    for (size_t lineNo = 1; std::getline(in, line); ++lineNo) {
+        std::istringstream fields(line);
+        Job job;
+        if (!(fields >> job.input)) {
+            continue;
+        }
+        if (!(fields >> job.output)) {
+            throw JITError(jobFile, ":", lineNo, ": expected \"INPUT OUTPUT\"");
+        }
+        jobs.push_back(std::move(job));
+    }
+    fflush(stdout);
+    captureFd = memfd_create("bf-fork-server-output", 0);
+    savedStdout = dup(STDOUT_FILENO);
+    if (captureFd < 0 || savedStdout < 0 || dup2(captureFd, STDOUT_FILENO) < 0) {
+        throw JITError("Failed to capture stdout for the fork server");
+    }
+}
+
+void forkServerRunJobs() {
+    if (ranJobs) {
+        return;
+    }
+    ranJobs = true;
+    fflush(stdout);
+    int failed = 0;
+    for (const auto &job : jobs) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            throw JITError("fork failed");
+        }
+        if (pid == 0) {
+            int fd = openOutput(job);
+            if (fd < 0 || !freopen(job.input.c_str(), "r", stdin) || !Watchdog::restartAfterFork()) {
+                std::cerr << "Failed to set up job \"" << job.input << "\" -> \"" << job.output << "\"\n";
+                _exit(1);
+            }
+            dup2(fd, STDOUT_FILENO);
+            close(fd);
+            close(savedStdout);
+            close(captureFd);
+            return;
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            std::cerr << "Job \"" << job.input << "\" failed\n";
+            ++failed;
+        }
+    }
+    restoreStdout();
+    std::exit(failed == 0 ? 0 : 1);
+}
+
+void forkServerFinish() {
+    if (ranJobs) {
+        return;
+    }
+    fflush(stdout);
+    for (const auto &job : jobs) {
+        int fd = openOutput(job);
+        if (fd < 0) {
+            restoreStdout();
+            throw JITError("Failed to write job output \"", job.output, "\"");
+        }
+        close(fd);
+    }
+    restoreStdout();
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+
+// Fork server mode runs the program once up to its first read from stdin,
+// then forks a child per job that continues from that point with the job's
+// input and output files. Output written before the first read is captured
+// and replayed into every job's output.
+
+// Read the job file, one "INPUT OUTPUT" pair per line, and start capturing stdout
+void forkServerStart(const std::string &jobFile);
+// Called on the first read from stdin. Only returns in the children; the
+// server waits for each job in turn and then exits.
+void forkServerRunJobs();
+// Called after the program finished. If it never read from stdin, its
+// captured output is written to every job's output file.
+void forkServerFinish();
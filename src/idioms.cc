@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+#include "idioms.hpp"
+
+// From https://esolangs.org/wiki/Brainfuck_algorithms
+const std::vector<DivModIdiom> DIVMOD_IDIOMS{
+    /// n d 0 0 0 0 -> 0 d-n%d n%d n/d 0 0
+    {"[->-[>+>>]>[+[-<+>]>+>>]<<<<<]", 1, 2, 3, 0, {4, 5}},
+    /// n 0 d 0 0 0 0 -> 0 n d-n%d n%d n/d 0 0
+    {"[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]", 2, 3, 4, 1, {5, 6}},
+    /// 0 n d 0 0 0 -> 0 0 d-n%d n%d 0 0
+    {"[>->+<[>]>[<+>-]<<[<]>-]", 1, 2, 0, 0, {-1, 3, 4}},
+};
+
+template <typename F> static void forEachCell(const DivModIdiom &idiom, F f) {
+    for (int cell : {0, idiom.counter, idiom.remainder, idiom.quotient, idiom.copy}) {
+        f(cell);
+    }
+    for (int cell : idiom.zeros) {
+        f(cell);
+    }
+}
+
+std::vector<int> divModCells(const Instruction &ins) {
+    std::vector<int> cells;
+    forEachCell(DIVMOD_IDIOMS.at(ins.a_), [&](int cell) { cells.push_back(cell * ins.b_); });
+    std::sort(cells.begin(), cells.end());
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+    return cells;
+}
+
+template <typename CellType> bool runDivMod(CellType *tape, size_t tapeLength, size_t dp, const Instruction &ins) {
+    using Cell = std::make_unsigned_t<CellType>;
+    const auto &idiom = DIVMOD_IDIOMS[ins.a_];
+    /// The closed form assumes the cells are distinct
+    int minCell = 0, maxCell = 0;
+    forEachCell(idiom, [&](int cell) {
+        minCell = std::min(minCell, cell);
+        maxCell = std::max(maxCell, cell);
+    });
+    if ((size_t)(maxCell - minCell) >= tapeLength) {
+        return false;
+    }
+    auto cell = [&](int offset) -> Cell & {
+        return reinterpret_cast<Cell &>(tape[wrapOffset(dp + offset * ins.b_, tapeLength)]);
+    };
+    for (int zero : idiom.zeros) {
+        if (cell(zero) != 0) {
+            return false;
+        }
+    }
+    /// A counter of 0 counts down through every value of the cell first, and
+    /// the inner loops of the first two lose their way with a period of 1
+    const uint64_t n = cell(0), counter = cell(idiom.counter), remainder = cell(idiom.remainder);
+    const uint64_t period = counter + remainder;
+    if (counter == 0 || period < 2 || period > std::numeric_limits<Cell>::max()) {
+        return false;
+    }
+    uint64_t resets = 0;
+    if (n < counter) {
+        cell(idiom.counter) = counter - n;
+        cell(idiom.remainder) = remainder + n;
+    } else {
+        resets = 1 + (n - counter) / period;
+        cell(idiom.counter) = period - (n - counter) % period;
+        cell(idiom.remainder) = (n - counter) % period;
+    }
+    if (idiom.quotient != 0) {
+        cell(idiom.quotient) += resets;
+    }
+    if (idiom.copy != 0) {
+        cell(idiom.copy) += n;
+    }
+    cell(0) = 0;
+    return true;
+}
+
+template bool runDivMod<char>(char *tape, size_t tapeLength, size_t dp, const Instruction &ins);
+template bool runDivMod<short>(short *tape, size_t tapeLength, size_t dp, const Instruction &ins);
+template bool runDivMod<int>(int *tape, size_t tapeLength, size_t dp, const Instruction &ins);
+
+const std::vector<CompareIdiom> COMPARE_IDIOMS{
+    /// x y n counter 1 0
+    {"[>-[>-]>[<<<<->>[-]+>>->]<+<<-]", -2, 1, 2, 3},
+    /// x n counter 1 0
+    {"[>-[>-]>[<<<->[-]+>>->]<+<<-]", -1, 1, 2, 3},
+};
+
+std::vector<int> compareCells(const Instruction &ins) {
+    const auto &idiom = COMPARE_IDIOMS.at(ins.a_);
+    std::vector<int> cells;
+    for (int cell : {0, idiom.x, idiom.counter, idiom.one, idiom.zero}) {
+        cells.push_back(cell * ins.b_);
+    }
+    std::sort(cells.begin(), cells.end());
+    return cells;
+}
+
+std::vector<int> idiomCells(const Instruction &ins) {
+    return ins.code_ == IROpCode::CMP ? compareCells(ins) : divModCells(ins);
+}
+
+template <typename CellType> bool runCompare(CellType *tape, size_t tapeLength, size_t dp, const Instruction &ins) {
+    using Cell = std::make_unsigned_t<CellType>;
+    const auto &idiom = COMPARE_IDIOMS[ins.a_];
+    const auto cells = compareCells(ins);
+    if ((size_t)(cells.back() - cells.front()) >= tapeLength) {
+        return false;
+    }
+    auto cell = [&](int offset) -> Cell & {
+        return reinterpret_cast<Cell &>(tape[wrapOffset(dp + offset * ins.b_, tapeLength)]);
+    };
+    if (cell(idiom.one) != 1 || cell(idiom.zero) != 0) {
+        return false;
+    }
+    /// A counter of 0 counts down through every value of the cell first,
+    /// which takes longer than n can last
+    const Cell n = cell(0), counter = cell(idiom.counter);
+    if (counter != 0 && counter <= n) {
+        cell(idiom.x) -= 1;
+        cell(idiom.counter) = 0;
+    } else {
+        cell(idiom.counter) = counter - n;
+    }
+    cell(0) = 0;
+    return true;
+}
+
+template bool runCompare<char>(char *tape, size_t tapeLength, size_t dp, const Instruction &ins);
+template bool runCompare<short>(short *tape, size_t tapeLength, size_t dp, const Instruction &ins);
+template bool runCompare<int>(int *tape, size_t tapeLength, size_t dp, const Instruction &ins);
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "ir.hpp"
+
+// Well known loops that take time proportional to a cell's value, but have a
+// closed form. The optimizer compiles each one's source, and its mirror image
+// with < and > swapped, and puts a DIVMOD or CMP before every loop of the same
+// shape. These compute the loop's result at once when the cells it steers by
+// are in the state the idiom expects, leaving the loop with a zero cell to
+// skip. Otherwise they do nothing, and the loop runs as written. So they don't
+// depend on what the program left around the loop, and a backend that
+// doesn't implement them can skip them.
+//
+// All of these are divmod loops: each iteration takes 1 from the cell at 0
+// (n), and 1 from counter, and adds it to remainder. When counter reaches 0,
+// it is set back to the sum of the two and remainder to 0. Starting from
+// counter = d and remainder = 0, they end at d - n % d and n % d.
+struct DivModIdiom {
+    const char *source;
+    // Offsets from the cell at 0, for DIVMOD's b_ = 1, or negated for -1
+    int counter;
+    int remainder;
+    // Incremented each time counter is set back, so it gains n / d, or 0 if none
+    int quotient;
+    // Gets n added, or 0 if none
+    int copy;
+    // Cells that the inner loops use to steer, which must be zero
+    std::vector<int> zeros;
+};
+
+// Indexed by DIVMOD's a_
+extern const std::vector<DivModIdiom> DIVMOD_IDIOMS;
+
+// Every cell ins (a DIVMOD) reads or writes, by offset from the data pointer
+std::vector<int> divModCells(const Instruction &ins);
+
+// Run the DIVMOD ins with the data pointer at dp, see above. Returns false if
+// the cells weren't in range, so the loop has to run.
+template <typename CellType> bool runDivMod(CellType *tape, size_t tapeLength, size_t dp, const Instruction &ins);
+
+// The loop that x = x < y ends with: each iteration takes 1 from the cell at
+// 0 (n, a copy of x) and 1 from counter (a copy of y). If counter reaches 0
+// first, x loses 1 and the loop ends. Starting from x = 1, x is left at
+// x < y. The loop steers with the two cells after counter, which hold 1 and
+// 0 between iterations.
+struct CompareIdiom {
+    const char *source;
+    // Offsets from the cell at 0, for CMP's b_ = 1, or negated for -1
+    int x;
+    int counter;
+    // The cells that must hold 1 and 0
+    int one;
+    int zero;
+};
+
+// Indexed by CMP's a_
+extern const std::vector<CompareIdiom> COMPARE_IDIOMS;
+
+// Every cell ins (a CMP) reads or writes, by offset from the data pointer
+std::vector<int> compareCells(const Instruction &ins);
+
+// Run the CMP ins with the data pointer at dp, like runDivMod()
+template <typename CellType> bool runCompare(CellType *tape, size_t tapeLength, size_t dp, const Instruction &ins);
+
+// divModCells() or compareCells(), whichever ins is
+std::vector<int> idiomCells(const Instruction &ins);
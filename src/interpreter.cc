@@ -3,14 +3,17 @@
 
 #include "arguments.hpp"
 #include "error.hpp"
+#include "idioms.hpp"
 #include "interpreter.hpp"
 #include "ir.hpp"
 #include "runtime.hpp"
 
-template <typename CellType>
-void interpret(const std::vector<Instruction> &prog, std::vector<CellType> &bfMem, const Arguments &args) {
+// The profiling and suspendable interpreters are separate instantiations, so plain runs don't pay for them
+template <typename CellType, bool PROFILE, bool SUSPENDABLE = false>
+static size_t run(const std::vector<Instruction> &prog, Tape<CellType> &bfMem, const Arguments &args,
+                  Profile *profile, ssize_t dp, size_t &pc, volatile sig_atomic_t *stop = nullptr,
+                  uint64_t *fuel = nullptr) {
     const ssize_t BFMEM_LENGTH = bfMem.size();
-    ssize_t dp{};
     auto mputchar = putCharFunc(args);
     auto mGetCharFunc = getCharFunc(args);
     std::function<int()> mgetchar = [&]() { return mGetCharFunc(0); };
@@ -23,12 +26,14 @@ void interpret(const std::vector<Instruction> &prog, std::vector<CellType> &bfMe
         const auto &ins = prog[i];
         switch (ins.code_) {
         case IROpCode::LOOP:
+        case IROpCode::IF:
             if (ins.a_ >= (ssize_t)loopPositions.size()) {
                 loopPositions.resize(ins.a_ + 1);
             }
             loopPositions[ins.a_].first = i;
             break;
         case IROpCode::END_LOOP:
+        case IROpCode::END_IF:
             if (ins.a_ >= (ssize_t)loopPositions.size()) {
                 loopPositions.resize(ins.a_ + 1);
             }
@@ -38,7 +43,10 @@ void interpret(const std::vector<Instruction> &prog, std::vector<CellType> &bfMe
             break;
         }
     }
-    for (size_t i = 0; i < prog.size(); ++i) {
+    if constexpr (PROFILE) {
+        profile->touchCell(dp);
+    }
+    for (size_t i = pc; i < prog.size(); ++i) {
         auto &ins = prog[i];
         switch (ins.code_) {
         case IROpCode::ADD:
@@ -47,33 +55,143 @@ void interpret(const std::vector<Instruction> &prog, std::vector<CellType> &bfMe
         case IROpCode::MUL: {
             auto remote = wrapOffset(dp + ins.a_, BFMEM_LENGTH);
             bfMem[remote] += ins.b_ * bfMem[dp];
+            if constexpr (PROFILE) {
+                profile->touchCell(remote);
+            }
         } break;
         case IROpCode::CONST:
             bfMem[dp] = ins.a_;
             break;
+        case IROpCode::DIVMOD:
+        case IROpCode::CMP:
+            if (ins.code_ == IROpCode::DIVMOD) {
+                runDivMod(bfMem.data(), BFMEM_LENGTH, dp, ins);
+            } else {
+                runCompare(bfMem.data(), BFMEM_LENGTH, dp, ins);
+            }
+            if constexpr (PROFILE) {
+                for (int cell : idiomCells(ins)) {
+                    profile->touchCell(wrapOffset(dp + cell, BFMEM_LENGTH));
+                }
+            }
+            break;
         case IROpCode::ADP:
             dp = wrapOffset(dp + ins.a_, BFMEM_LENGTH);
+            if constexpr (PROFILE) {
+                profile->touchCell(dp);
+            }
             break;
-        case IROpCode::IN:
-            bfMem[dp] = mgetchar();
-            break;
+        case IROpCode::IN: {
+            const auto c = mgetchar();
+            if constexpr (SUSPENDABLE) {
+                if (sessionInputStarved) {
+                    pc = i;
+                    return dp;
+                }
+            }
+            bfMem[dp] = c;
+        } break;
         case IROpCode::OUT:
             mputchar(bfMem[dp] & 0xff);
             break;
         case IROpCode::LOOP:
+            if constexpr (PROFILE) {
+                profile->loop(ins.a_).trips = 0;
+            }
             if (bfMem[dp] == 0) {
+                if constexpr (PROFILE) {
+                    profile->loop(ins.a_).recordExit(0);
+                }
                 i = loopPositions[ins.a_].second;
+            } else if constexpr (PROFILE) {
+                ++profile->loop(ins.a_).trips;
+                profile->loop(ins.a_).recordIteration(dp);
             }
             break;
         case IROpCode::END_LOOP:
-            i = loopPositions[ins.a_].first - 1;
+            if constexpr (PROFILE) {
+                // Re-test here rather than at the LOOP, which would count as a new entry
+                if (bfMem[dp] != 0) {
+                    ++profile->loop(ins.a_).trips;
+                    profile->loop(ins.a_).recordIteration(dp);
+                    i = loopPositions[ins.a_].first;
+                    if constexpr (SUSPENDABLE) {
+                        /// The iteration is recorded, so this continues in the body
+                        if (*stop || --*fuel == 0) {
+                            pc = i + 1;
+                            return dp;
+                        }
+                    }
+                } else {
+                    profile->loop(ins.a_).recordExit(profile->loop(ins.a_).trips);
+                }
+            } else {
+                if constexpr (SUSPENDABLE) {
+                    /// Continuing at the LOOP re-tests the cell
+                    if (*stop || --*fuel == 0) {
+                        pc = loopPositions[ins.a_].first;
+                        return dp;
+                    }
+                }
+                i = loopPositions[ins.a_].first - 1;
+            }
+            break;
+        case IROpCode::IF:
+            if (bfMem[dp] == 0) {
+                if constexpr (PROFILE) {
+                    profile->loop(ins.a_).recordExit(0);
+                }
+                i = loopPositions[ins.a_].second;
+            } else if constexpr (PROFILE) {
+                profile->loop(ins.a_).recordIteration(dp);
+            }
+            break;
+        case IROpCode::END_IF:
+            if constexpr (PROFILE) {
+                profile->loop(ins.a_).recordExit(1);
+            }
             break;
         default:
             throw JITError("ICE: Unhandled instruction");
         }
     }
+    pc = prog.size();
+    return dp;
+}
+
+template <typename CellType>
+size_t interpret(const std::vector<Instruction> &prog, Tape<CellType> &bfMem, const Arguments &args,
+                 Profile *profile, size_t dp) {
+    size_t pc = 0;
+    if (profile) {
+        return run<CellType, true>(prog, bfMem, args, profile, dp, pc);
+    } else {
+        return run<CellType, false>(prog, bfMem, args, nullptr, dp, pc);
+    }
+}
+
+template <typename CellType>
+size_t interpretSuspendable(const std::vector<Instruction> &prog, Tape<CellType> &bfMem, const Arguments &args,
+                            size_t &pc, size_t dp, volatile sig_atomic_t &stop, uint64_t &fuel, Profile *profile) {
+    if (profile) {
+        return run<CellType, true, true>(prog, bfMem, args, profile, dp, pc, &stop, &fuel);
+    } else {
+        return run<CellType, false, true>(prog, bfMem, args, nullptr, dp, pc, &stop, &fuel);
+    }
 }
 
-template void interpret(const std::vector<Instruction> &prog, std::vector<char> &bfMem, const Arguments &args);
-template void interpret(const std::vector<Instruction> &prog, std::vector<short> &bfMem, const Arguments &args);
-template void interpret(const std::vector<Instruction> &prog, std::vector<int> &bfMem, const Arguments &args);
+template size_t interpret(const std::vector<Instruction> &prog, Tape<char> &bfMem, const Arguments &args,
+                          Profile *profile, size_t dp);
+template size_t interpret(const std::vector<Instruction> &prog, Tape<short> &bfMem, const Arguments &args,
+                          Profile *profile, size_t dp);
+template size_t interpret(const std::vector<Instruction> &prog, Tape<int> &bfMem, const Arguments &args,
+                          Profile *profile, size_t dp);
+template size_t interpretSuspendable(const std::vector<Instruction> &prog, Tape<char> &bfMem,
+                                     const Arguments &args, size_t &pc, size_t dp, volatile sig_atomic_t &stop,
+                                     uint64_t &fuel, Profile *profile);
+template size_t interpretSuspendable(const std::vector<Instruction> &prog, Tape<short> &bfMem,
+                                     const Arguments &args, size_t &pc, size_t dp, volatile sig_atomic_t &stop,
+                                     uint64_t &fuel, Profile *profile);
+template size_t interpretSuspendable(const std::vector<Instruction> &prog, Tape<int> &bfMem,
+                                     const Arguments &args, size_t &pc, size_t dp, volatile sig_atomic_t &stop,
+                                     uint64_t &fuel, Profile *profile);
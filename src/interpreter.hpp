@@ -1,10 +1,27 @@
 #pragma once
 
+#include <csignal>
 #include <cstdint>
 #include <vector>
 
 #include "arguments.hpp"
 #include "ir.hpp"
+#include "profile.hpp"
+#include "tape.hpp"
 
+// Run prog from data pointer dp, recording loop counts into profile if it
+// isn't null. Returns the data pointer prog ends with.
 template <typename CellType>
-void interpret(const std::vector<Instruction> &prog, std::vector<CellType> &bfMem, const Arguments &args);
+size_t interpret(const std::vector<Instruction> &prog, Tape<CellType> &bfMem, const Arguments &args,
+                 Profile *profile = nullptr, size_t dp = 0);
+
+// --serve, --fuel and --time-limit: run prog from instruction pc and data
+// pointer dp until it ends, or until it suspends at an IN that finds no input
+// (see SessionIO) or at a loop back edge, once stop is set or fuel runs out.
+// Each back edge takes one loop iteration from fuel. Leaves pc where to
+// continue from, which is prog.size() once prog has ended, and returns the
+// data pointer.
+template <typename CellType>
+size_t interpretSuspendable(const std::vector<Instruction> &prog, Tape<CellType> &bfMem, const Arguments &args,
+                            size_t &pc, size_t dp, volatile sig_atomic_t &stop, uint64_t &fuel,
+                            Profile *profile = nullptr);
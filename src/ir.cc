@@ -66,6 +66,18 @@ std::ostream &operator<<(std::ostream &os, IROpCode code) {
     case IROpCode::END_LOOP:
         op = "END_LOOP";
         break;
+    case IROpCode::IF:
+        op = "IF";
+        break;
+    case IROpCode::END_IF:
+        op = "END_IF";
+        break;
+    case IROpCode::DIVMOD:
+        op = "DIVMOD";
+        break;
+    case IROpCode::CMP:
+        op = "CMP";
+        break;
     case IROpCode::INVALID:
         op = "INVALID";
         break;
@@ -10,8 +10,12 @@ enum class IROpCode {
     ADP,      // Add to data pointer
     IN,       // call mgetc()
     OUT,      // call mputc()
-    LOOP,     // Start of loop
+    LOOP,     // Start of loop, b_ is 1 if the loop is strided (see StridedLoop)
     END_LOOP, // End of loop
+    IF,       // Start of a loop that runs at most once, so it has no back edge
+    END_IF,   // End of such a loop
+    DIVMOD,   // Closed form of the loop after it, of shape DIVMOD_IDIOMS[a_] mirrored if b_ is -1 (see idioms.hpp)
+    CMP,      // The same for COMPARE_IDIOMS[a_]
     INVALID   // Not a valid instruction
 };
 
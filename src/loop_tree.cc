@@ -0,0 +1,130 @@
+#include <algorithm>
+
+#include "idioms.hpp"
+#include "loop_tree.hpp"
+
+void LoopTree::openLoop() {
+    open_.emplace_back(root_.size(), loops_.size());
+    loops_.emplace_back();
+}
+
+void LoopTree::closeLoop() {
+    if (open_.empty()) {
+        throw JITError("ICE: Closed a loop that wasn't opened");
+    }
+    const auto [start, id] = open_.back();
+    open_.pop_back();
+    auto &loop = loops_[id];
+    loop.body_.assign(root_.begin() + start, root_.end());
+    root_.erase(root_.begin() + start, root_.end());
+    summarize(loop);
+    root_.emplace_back(IROpCode::LOOP, id);
+}
+
+void LoopTree::summarize(Loop &loop) const {
+    auto &summary = loop.summary_;
+    summary = {};
+    int offset{};
+    auto touch = [&](int off) {
+        summary.minOffset = std::min(summary.minOffset, off);
+        summary.maxOffset = std::max(summary.maxOffset, off);
+    };
+    for (const auto &ins : loop.body_) {
+        switch (ins.code_) {
+        case IROpCode::LOOP: {
+            const auto &inner = this->loop(ins).summary_;
+            summary.hasLoops = true;
+            summary.hasIO |= inner.hasIO;
+            if (inner.deltaKnown && inner.netDelta == 0) {
+                touch(offset + inner.minOffset);
+                touch(offset + inner.maxOffset);
+            } else {
+                summary.deltaKnown = false;
+            }
+            break;
+        }
+        case IROpCode::ADP:
+            offset += ins.a_;
+            break;
+        case IROpCode::MUL:
+            touch(offset);
+            touch(offset + ins.a_);
+            break;
+        case IROpCode::DIVMOD:
+        case IROpCode::CMP:
+            for (int cell : idiomCells(ins)) {
+                touch(offset + cell);
+            }
+            break;
+        case IROpCode::IN:
+        case IROpCode::OUT:
+            summary.hasIO = true;
+            touch(offset);
+            break;
+        case IROpCode::ADD:
+        case IROpCode::CONST:
+            touch(offset);
+            break;
+        default:
+            break;
+        }
+    }
+    summary.netDelta = offset;
+    if (!summary.deltaKnown) {
+        summary.netDelta = summary.minOffset = summary.maxOffset = 0;
+    }
+}
+
+std::vector<Instruction> LoopTree::lower() const {
+    std::vector<Instruction> out;
+    out.reserve(instructionCount());
+    /// The regions being lowered, with the next instruction in each, and the
+    /// LOOP that contains it. Nesting can be as deep as the program is long,
+    /// so this doesn't recurse.
+    struct Open {
+        const Region *region;
+        size_t next;
+        const Instruction *loop;
+    };
+    std::vector<Open> open{{&root_, 0, nullptr}};
+    while (!open.empty()) {
+        auto &top = open.back();
+        if (top.next == top.region->size()) {
+            if (top.loop != nullptr) {
+                out.emplace_back(loop(*top.loop).once_ ? IROpCode::END_IF : IROpCode::END_LOOP, top.loop->a_);
+            }
+            open.pop_back();
+            continue;
+        }
+        const auto &ins = (*top.region)[top.next++];
+        if (ins.code_ != IROpCode::LOOP) {
+            out.push_back(ins);
+            continue;
+        }
+        const auto &inner = loop(ins);
+        if (inner.once_) {
+            out.emplace_back(IROpCode::IF, ins.a_);
+        } else {
+            out.emplace_back(IROpCode::LOOP, ins.a_, inner.strided_ ? 1 : 0);
+        }
+        open.push_back({&inner.body_, 0, &ins});
+    }
+    return out;
+}
+
+size_t LoopTree::instructionCount() const {
+    size_t count = 0;
+    std::vector<const Region *> pending{&root_};
+    while (!pending.empty()) {
+        const auto &region = *pending.back();
+        pending.pop_back();
+        count += region.size();
+        for (const auto &ins : region) {
+            if (ins.code_ == IROpCode::LOOP) {
+                pending.push_back(&loop(ins).body_);
+                ++count;
+            }
+        }
+    }
+    return count;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <utility>
+#include <vector>
+
+#include "error.hpp"
+#include "ir.hpp"
+
+// Straight-line instructions and nested loops. A LOOP instruction in a
+// region stands for a whole loop, with a_ indexing the tree's loop table.
+// Loops are numbered in the order of their [ in the source, and keep their
+// numbers through optimization and lowering, so profiles can refer to them.
+using Region = std::vector<Instruction>;
+
+// Facts about one iteration of a loop body, with offsets relative to the
+// data pointer at the start of the iteration
+struct LoopSummary {
+    int netDelta{};        // Data pointer change per iteration, valid if deltaKnown
+    bool deltaKnown{true}; // False if an inner loop moves the data pointer
+    bool hasIO{};          // The body or an inner loop contains IN or OUT
+    bool hasLoops{};       // The body contains inner loops
+    int minOffset{};       // Range of cells touched, valid if deltaKnown
+    int maxOffset{};
+};
+
+struct Loop {
+    Region body_;
+    LoopSummary summary_;
+    bool strided_{false}; // Lowered to a vectorized scan, see StridedLoop
+    bool once_{false};    // The body leaves the tested cell at zero, lowered to IF/END_IF
+};
+
+// Program as a tree of loops. The parser builds it in program order, and it
+// is lowered to the flat form the backends use.
+class LoopTree {
+  public:
+    void append(const Instruction &ins) { root_.push_back(ins); }
+    void openLoop();
+    void closeLoop();
+    size_t openLoops() const { return open_.size(); }
+
+    Region &root() { return root_; }
+    Loop &loop(const Instruction &ins) { return loops_[ins.a_]; }
+    const Loop &loop(const Instruction &ins) const { return loops_[ins.a_]; }
+    // Recompute a loop's summary from its body and the summaries of inner loops
+    void summarize(Loop &loop) const;
+    // Flat program, with LOOP and END_LOOP (or IF and END_IF) carrying the loop's number in a_
+    std::vector<Instruction> lower() const;
+    size_t instructionCount() const;
+
+  private:
+    // While building, the bodies of open loops are kept at the end of root_,
+    // so that each body is allocated once, at its final size
+    Region root_;
+    // Where the body of each open loop starts in root_, and its number, innermost last
+    std::vector<std::pair<size_t, int>> open_;
+    std::vector<Loop> loops_;
+};
@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "arguments.hpp"
+#include "code_generator.hpp"
+#include "error.hpp"
+#include "optimizer.hpp"
+#include "parser.hpp"
+#include "tape.hpp"
+
+// make microbench: times each stage of the compiler on its own, on synthetic
+// programs of a given size and shape, without running them. Each stage is
+// timed over a number of repetitions after a warm up run, and reported per
+// source instruction, with the standard deviation between repetitions.
+
+static void printUsage(const char *progName) {
+    std::cout << "Usage: " << progName << " [OPTIONS] [shapes]\n\n"
+              << "Time the parser, optimizer and code generator on synthetic programs\n\n"
+              << "Shapes: straight, nested, copy, mixed (default: all of them)\n\n"
+              << "Options:\n"
+              << "  -s, --size INSTRUCTIONS    Length of each program (default: 262144)\n"
+              << "  -r, --repetitions N        Timed runs of each stage (default: 10)\n"
+              << "  -w, --cell-bit-width BITS  Width of cell in bits (8, 16, or 32, default: 8)\n"
+              << "  -h, --help                 Print this help message\n";
+}
+
+// Long runs of + - < > without loops, which the optimizer folds into offset updates
+static std::string straightProgram(size_t size, std::mt19937 &rng) {
+    static const char ops[] = "+-<>";
+    std::string source;
+    source.reserve(size);
+    while (source.size() < size) {
+        const char op = ops[rng() % 4];
+        source.append(1 + rng() % 8, op);
+    }
+    source.resize(size);
+    return source;
+}
+
+// Loops nested up to 64 deep, each with a little straight line code
+static std::string nestedProgram(size_t size, std::mt19937 &rng) {
+    std::string source;
+    source.reserve(size + 1024);
+    while (source.size() < size) {
+        const size_t depth = 1 + rng() % 64;
+        for (size_t i = 0; i < depth; ++i) {
+            source += "+[>";
+            source.append(1 + rng() % 4, '+');
+        }
+        for (size_t i = 0; i < depth; ++i) {
+            source += "<-]";
+        }
+    }
+    return source;
+}
+
+// Loops that the optimizer turns into MUL, with a few targets at various offsets
+static std::string copyProgram(size_t size, std::mt19937 &rng) {
+    std::string source;
+    source.reserve(size + 1024);
+    while (source.size() < size) {
+        source += "[-";
+        const size_t targets = 1 + rng() % 4;
+        int offset = 0;
+        for (size_t i = 0; i < targets; ++i) {
+            const int next = 1 + rng() % 6;
+            source.append(next, '>');
+            source.append(1 + rng() % 5, rng() % 2 ? '+' : '-');
+            offset += next;
+        }
+        source.append(offset, '<');
+        source += "]>";
+    }
+    return source;
+}
+
+// Random balanced code mixing all of the above with IO and scan loops
+static std::string mixedProgram(size_t size, std::mt19937 &rng) {
+    std::string source;
+    source.reserve(size + 1024);
+    int depth = 0;
+    while (source.size() < size || depth > 0) {
+        const unsigned pick = rng() % 16;
+        if (source.size() >= size || (pick == 0 && depth > 0)) {
+            source += ']';
+            --depth;
+        } else if (pick == 1 && depth < 32) {
+            source += '[';
+            ++depth;
+        } else if (pick == 2) {
+            source += rng() % 2 ? "[-]" : "[>>]";
+        } else if (pick == 3) {
+            source += rng() % 2 ? '.' : ',';
+        } else {
+            source.append(1 + rng() % 4, "+-<>"[rng() % 4]);
+        }
+    }
+    return source;
+}
+
+struct Stage {
+    const char *name;
+    std::vector<double> seconds;
+};
+
+static void report(const char *shape, size_t size, const std::vector<Stage> &stages) {
+    for (const auto &stage : stages) {
+        double mean = 0;
+        for (auto s : stage.seconds) {
+            mean += s;
+        }
+        mean /= stage.seconds.size();
+        double variance = 0;
+        for (auto s : stage.seconds) {
+            variance += (s - mean) * (s - mean);
+        }
+        variance /= stage.seconds.size();
+        std::cout << std::left << std::setw(10) << shape << std::setw(10) << stage.name << std::right
+                  << std::fixed << std::setprecision(2) << std::setw(10) << mean * 1e9 / size << std::setw(12)
+                  << size / mean / 1e6 << std::setw(9) << std::setprecision(1)
+                  << (mean > 0 ? 100 * std::sqrt(variance) / mean : 0) << "%\n";
+    }
+}
+
+template <typename CellType>
+static void benchmark(const char *shape, const std::string &source, const Arguments &args, int repetitions) {
+    std::vector<Stage> stages{{"feed", {}}, {"compile", {}}, {"optimize", {}}, {"lower", {}}, {"codegen", {}}};
+    size_t optimizedLength = 0, codeLength = 0;
+    /// The first run warms up caches and the allocator, and isn't counted
+    for (int rep = -1; rep < repetitions; ++rep) {
+        std::istringstream in(source);
+        Parser parser(args);
+        Optimizer optimizer(args);
+        Tape<CellType> tape(args.bfMemLength, false);
+        CodeGenerator<CellType> codeGenerator(tape, args);
+        double seconds[5];
+        auto last = std::chrono::steady_clock::now();
+        auto lap = [&](int stage) {
+            const auto now = std::chrono::steady_clock::now();
+            seconds[stage] = std::chrono::duration<double>(now - last).count();
+            last = now;
+        };
+        parser.feed(in);
+        lap(0);
+        auto tree = parser.compile();
+        lap(1);
+        optimizer.optimize(tree);
+        lap(2);
+        auto prog = tree.lower();
+        lap(3);
+        codeGenerator.compile(prog);
+        lap(4);
+        if (rep >= 0) {
+            for (size_t i = 0; i < stages.size(); ++i) {
+                stages[i].seconds.push_back(seconds[i]);
+            }
+        }
+        optimizedLength = prog.size();
+        codeLength = codeGenerator.generatedLength();
+    }
+    report(shape, source.size(), stages);
+    std::cout << std::left << std::setw(10) << shape << source.size() << " instructions, " << optimizedLength
+              << " after optimizing, " << codeLength << " bytes of code\n";
+}
+
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"size", required_argument, 0, 's'},
+        {"repetitions", required_argument, 0, 'r'},
+        {"cell-bit-width", required_argument, 0, 'w'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    size_t size = 256 * 1024;
+    int repetitions = 10;
+    std::string cellBitWidth = "8";
+    int c;
+    while ((c = getopt_long(argc, argv, "s:r:w:h", long_options, nullptr)) != -1) {
+        switch (c) {
+        case 's':
+            size = std::strtoul(optarg, nullptr, 10);
+            if (size == 0) {
+                std::cerr << "Error: Invalid size\n";
+                return 1;
+            }
+            break;
+        case 'r':
+            repetitions = std::atoi(optarg);
+            if (repetitions <= 0) {
+                std::cerr << "Error: Invalid number of repetitions\n";
+                return 1;
+            }
+            break;
+        case 'w':
+            cellBitWidth = optarg;
+            if (cellBitWidth != "8" && cellBitWidth != "16" && cellBitWidth != "32") {
+                std::cerr << "Error: Invalid cell width. Must be 8, 16, or 32.\n";
+                return 1;
+            }
+            break;
+        case 'h':
+            printUsage(argv[0]);
+            return 0;
+        default:
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    using Generator = std::string (*)(size_t, std::mt19937 &);
+    const std::vector<std::pair<const char *, Generator>> shapes{
+        {"straight", straightProgram}, {"nested", nestedProgram}, {"copy", copyProgram}, {"mixed", mixedProgram}};
+    std::vector<std::pair<const char *, Generator>> selected;
+    for (int i = optind; i < argc; ++i) {
+        const auto it = std::find_if(shapes.begin(), shapes.end(),
+                                     [&](const auto &shape) { return strcmp(shape.first, argv[i]) == 0; });
+        if (it == shapes.end()) {
+            std::cerr << "Error: Unknown shape " << argv[i] << '\n';
+            printUsage(argv[0]);
+            return 1;
+        }
+        selected.push_back(*it);
+    }
+    if (selected.empty()) {
+        selected = shapes;
+    }
+
+    /// The stages only read the options that shape the compiled code, and
+    /// the source comes from the generators rather than this file
+    char widthFlag[] = "-w", noFile[] = "microbench.b";
+    char *bfArgv[] = {argv[0], widthFlag, cellBitWidth.data(), noFile, nullptr};
+    optind = 0;
+    const Arguments args(4, bfArgv);
+
+    try {
+        std::cout << std::left << std::setw(10) << "shape" << std::setw(10) << "stage" << std::right
+                  << std::setw(10) << "ns/ins" << std::setw(12) << "MB/s" << std::setw(10) << "stddev" << '\n';
+        for (const auto &[name, generate] : selected) {
+            std::mt19937 rng(42);
+            const std::string source = generate(size, rng);
+            switch (args.cellBitWidth) {
+            case 8:
+                benchmark<char>(name, source, args, repetitions);
+                break;
+            case 16:
+                benchmark<short>(name, source, args, repetitions);
+                break;
+            case 32:
+                benchmark<int>(name, source, args, repetitions);
+                break;
+            }
+        }
+    } catch (JITError &e) {
+        std::cout << "Fatal JITError caught: " << e.what() << '\n';
+        return 1;
+    }
+}
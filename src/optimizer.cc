@@ -1,172 +1,522 @@
-#include <cassert>
-#include <map>
-#include <optional>
-#include <unordered_map>
+#include <sstream>
 
+#include "idioms.hpp"
 #include "optimizer.hpp"
+#include "parser.hpp"
 
-Optimizer::Optimizer(const Arguments &arguments) : verbose_{arguments.verbose} {}
+Optimizer::Optimizer(const Arguments &arguments) : Optimizer(arguments, true) {}
 
-void Optimizer::optimize(std::vector<Instruction> &program) {
-    progPtr_ = &program;
-    size_t numOptPasses = 1;
-    while (optimizePass()) {
-        ++numOptPasses;
+Optimizer::Optimizer(const Arguments &arguments, bool matchIdioms)
+    : verbose_{arguments.verbose && matchIdioms}, tapeLength_{(ssize_t)arguments.bfMemLength} {
+    if (matchIdioms) {
+        compileIdioms(arguments);
     }
+}
+
+// Idioms are matched by the shape their source has after optimization, which
+// depends on the tape length, so they are optimized like the program is
+void Optimizer::compileIdioms(const Arguments &arguments) {
+    Optimizer optimizer(arguments, false);
+    std::vector<std::pair<const char *, Instruction>> sources;
+    for (size_t i = 0; i < DIVMOD_IDIOMS.size(); ++i) {
+        sources.emplace_back(DIVMOD_IDIOMS[i].source, Instruction{IROpCode::DIVMOD, (int)i});
+    }
+    for (size_t i = 0; i < COMPARE_IDIOMS.size(); ++i) {
+        sources.emplace_back(COMPARE_IDIOMS[i].source, Instruction{IROpCode::CMP, (int)i});
+    }
+    for (const auto &[idiomSource, op] : sources) {
+        for (int direction : {1, -1}) {
+            std::string source = idiomSource;
+            if (direction == -1) {
+                std::replace(source.begin(), source.end(), '<', '_');
+                std::replace(source.begin(), source.end(), '>', '<');
+                std::replace(source.begin(), source.end(), '_', '>');
+            }
+            std::istringstream in(source);
+            Parser parser(arguments);
+            parser.feed(in);
+            auto tree = parser.compile();
+            optimizer.optimize(tree, false);
+            Region shape;
+            appendShape(tree, tree.loop(tree.root().at(0)), shape, SIZE_MAX);
+            longestIdiom_ = std::max(longestIdiom_, shape.size());
+            idioms_.emplace_back(std::move(shape), Instruction{op.code_, op.a_, direction});
+        }
+    }
+}
+
+// The optimizer walks the loop tree once. Runs of ADD, ADP and CONST, and
+// the MULs of multiplication loops, are folded as they are read, and written
+// out in canonical form when something else ends the run. Loops are decided
+// on from their summaries before their bodies are visited, so each node is
+// visited a constant number of times.
+// The run also tracks cells known to be zero: the first cell at the start,
+// and the tested cell after every loop, so loops that can't be entered and
+// redundant clears are dropped.
+void Optimizer::optimize(LoopTree &tree, bool atStart) {
+    const size_t before = verbose_ ? tree.instructionCount() : 0;
+    constants_.clear();
+    runOffset_ = 0;
+    if (atStart) {
+        constants_[0] = {0, ConstFoldable::Type::Known};
+    }
+    optimizeRegion(tree, tree.root());
     if (verbose_) {
-        std::cout << "Optimized " << numOptPasses << " times\n";
+        std::cout << "Optimized " << before << " instructions into " << tree.instructionCount() << '\n';
+    }
+}
+
+// Post-order: a loop's body is optimized before its summary is refreshed.
+// The pending run is always flushed before descending, so the body starts
+// and ends with an empty run. Nesting can be as deep as the program is
+// long, so the regions being optimized are kept on a stack of their own.
+void Optimizer::optimizeRegion(LoopTree &tree, Region &region) {
+    openRegions_.clear();
+    openRegions_.push_back({&region, 0, {}, nullptr});
+    openRegions_.back().out.reserve(region.size());
+    while (!openRegions_.empty()) {
+        auto &top = openRegions_.back();
+        if (top.next == top.region->size()) {
+            flushRun(top.out);
+            top.region->swap(top.out);
+            const Instruction *ins = top.loop;
+            openRegions_.pop_back();
+            if (ins != nullptr) {
+                finishLoop(tree, *ins, openRegions_.back().out);
+            }
+            continue;
+        }
+        const auto &ins = (*top.region)[top.next++];
+        auto &out = top.out;
+        switch (ins.code_) {
+        case IROpCode::ADD:
+        case IROpCode::ADP:
+        case IROpCode::CONST:
+            foldIntoRun(ins, out);
+            break;
+        case IROpCode::INVALID:
+            break;
+        case IROpCode::LOOP: {
+            auto &loop = tree.loop(ins);
+            if (currentCellKnownZero() || multLoop(loop, out)) {
+                loop.body_ = {};
+                break;
+            }
+            flushRun(out);
+            Region body;
+            body.reserve(loop.body_.size());
+            openRegions_.push_back({&loop.body_, 0, std::move(body), &ins});
+            break;
+        }
+        default:
+            flushRun(out);
+            out.push_back(ins);
+            break;
+        }
     }
-    progPtr_ = nullptr;
 }
 
-std::vector<Instruction> &Optimizer::prog() { return *progPtr_; }
+// After the body of the loop ins stands for is optimized
+void Optimizer::finishLoop(LoopTree &tree, const Instruction &ins, Region &out) {
+    auto &loop = tree.loop(ins);
+    tree.summarize(loop);
+    loop.strided_ = isStridedLoop(loop);
+    loop.once_ = runsAtMostOnce(tree, loop);
+    if (auto idiom = matchIdiom(tree, loop)) {
+        out.push_back(*idiom);
+    }
+    out.push_back(ins);
+    constants_[runOffset_] = {0, ConstFoldable::Type::Known};
+}
 
-struct ConstFoldable {
-    int val{};
-    enum class Type : int {
-        Add,
-        Const,
-    } type{Type::Add};
-    Instruction genIns() const {
-        return {
-            type == Type::Add ? IROpCode::ADD : IROpCode::CONST,
-            val
-        };
+void Optimizer::foldIntoRun(const Instruction &ins, Region &out) {
+    if (ins.code_ == IROpCode::ADP) {
+        runOffset_ += ins.a_;
+        return;
+    }
+    if (!fitsInRun(runOffset_)) {
+        flushRun(out);
     }
-};
+    runMin_ = std::min(runMin_, runOffset_);
+    runMax_ = std::max(runMax_, runOffset_);
+    auto &fold = constants_[runOffset_];
+    switch (ins.code_) {
+    case IROpCode::ADD:
+        fold.change();
+        fold.val += ins.a_;
+        break;
+    case IROpCode::CONST:
+        fold.set(ins.a_);
+        break;
+    default:
+        throw JITError("ICE: Tried to fold ", ins.code_, " into a run");
+    }
+}
 
-// For each run of Add, Const, Adp, re-organize them
-bool Optimizer::constPropagatePass() {
-    auto sawChange{false};
-    if (prog().size() == 0) {
+static int wrapMul(int a, int b) { return (int)((unsigned)a * (unsigned)b); }
+
+static void addTerm(std::vector<std::pair<int, int>> &terms, int offset, int factor) {
+    for (auto it = terms.begin(); it != terms.end(); ++it) {
+        if (it->first == offset) {
+            it->second = (int)((unsigned)it->second + (unsigned)factor);
+            if (it->second == 0) {
+                terms.erase(it);
+            }
+            return;
+        }
+    }
+    if (factor != 0) {
+        terms.emplace_back(offset, factor);
+    }
+}
+
+// Fold the MULs of a multiplication loop at the current offset, and the
+// clear of its cell, into the run. The cells' values stay in terms of the
+// values they had when the run started, so that known values fold into
+// constants, and a value that is moved out and back again cancels out: with
+// cell 2 zeroed, [>+>+<<-]>>[<<+>>-] leaves only a MUL into cell 1. Returns
+// false, leaving the run as it was, if the targets would need more MULs than
+// the loop has, or they couldn't be written out in any order.
+bool Optimizer::foldMulLoop(int factor) {
+    const int source = runOffset_;
+    int low = std::min(runMin_, source), high = std::max(runMax_, source);
+    for (auto x : relativeAdds_.sortedKeys()) {
+        low = std::min(low, source + x);
+        high = std::max(high, source + x);
+    }
+    if (runMuls_ >= MAX_RUN_MULS || high - low >= tapeLength_) {
         return false;
     }
-    std::map<int, ConstFoldable> constants;
-    int offset{};
-    auto finalize = [&](size_t start, size_t end) {
-        int tapePosition{};
-        size_t codePosition{start};
-        auto writeInst = [&](Instruction inst) {
-            assert(codePosition < end);
-            auto &p = prog();
-            if (p[codePosition] != inst) {
-                sawChange = true;
+    /// What the source holds, in terms of the start of the run
+    terms_.clear();
+    int value = 0;
+    if (!constants_.contains(source) || constants_[source].type == ConstFoldable::Type::Add) {
+        terms_.emplace_back(source, 1);
+    }
+    if (constants_.contains(source)) {
+        value = constants_[source].val;
+        for (auto term : constants_[source].terms) {
+            terms_.push_back(term);
+        }
+    }
+    /// A constant on top of that would need an ADD on every target instead
+    /// of the one on the source. With more than one term, each target needs
+    /// more MULs than the loop has, unless it is one of them and cancels out.
+    if (value != 0 && !terms_.empty()) {
+        return false;
+    }
+    if (terms_.size() > 1 && std::none_of(terms_.begin(), terms_.end(), [&](const auto &term) {
+            return term.first != source && relativeAdds_.contains(term.first - source);
+        })) {
+        return false;
+    }
+    /// Copies of the cells it changes, which keep their storage between loops
+    size_t changed = 0;
+    auto save = [&](int offset) -> ConstFoldable & {
+        auto &fold = constants_[offset];
+        if (changed == backup_.size()) {
+            backup_.emplace_back();
+        }
+        backup_[changed].first = offset;
+        backup_[changed++].second = fold;
+        return fold;
+    };
+    save(source);
+    bool folded = true;
+    int muls = 0;
+    for (auto x : relativeAdds_.sortedKeys()) {
+        const int f = wrapMul(-relativeAdds_[x], factor);
+        if (f == 0) {
+            continue;
+        }
+        ++muls;
+        const int target = source + x;
+        auto &fold = save(target);
+        fold.change();
+        fold.val += wrapMul(value, f);
+        for (auto [offset, g] : terms_) {
+            addTerm(fold.terms, offset, wrapMul(g, f));
+        }
+        /// A term on the target itself changes whether it is an ADD or a CONST
+        int self = fold.type == ConstFoldable::Type::Add ? 1 : 0;
+        auto it = std::find_if(fold.terms.begin(), fold.terms.end(),
+                               [&](const auto &term) { return term.first == target; });
+        if (it != fold.terms.end()) {
+            self += it->second;
+            fold.terms.erase(it);
+        }
+        fold.type = self == 1 ? ConstFoldable::Type::Add : ConstFoldable::Type::Const;
+        folded &= self == 0 || self == 1;
+    }
+    constants_[source].set(0);
+    /// A target's MULs are written before the cells they read are, so none of
+    /// those may read the target in turn
+    size_t before = 0, after = 0;
+    for (size_t i = 1; i < changed && folded; ++i) {
+        const int target = backup_[i].first;
+        before += backup_[i].second.terms.size();
+        after += constants_[target].terms.size();
+        for (auto [offset, g] : constants_[target].terms) {
+            folded &= !dependsOn(offset, target);
+        }
+    }
+    if (!folded || after > before + muls) {
+        while (changed > 0) {
+            --changed;
+            constants_[backup_[changed].first] = backup_[changed].second;
+        }
+        return false;
+    }
+    runMin_ = low;
+    runMax_ = high;
+    runMuls_ += muls;
+    return true;
+}
+
+bool Optimizer::fitsInRun(int offset) const {
+    return std::max(runMax_, offset) - std::min(runMin_, offset) < tapeLength_;
+}
+
+// Whether the value of cell depends on the value the cell at offset had when
+// the run started, through its terms and theirs
+bool Optimizer::dependsOn(int cell, int offset) {
+    pending_.assign(1, cell);
+    visited_.clear();
+    while (!pending_.empty()) {
+        const int next = pending_.back();
+        pending_.pop_back();
+        if (next == offset) {
+            return true;
+        }
+        if (!constants_.contains(next) ||
+            std::find(visited_.begin(), visited_.end(), next) != visited_.end()) {
+            continue;
+        }
+        visited_.push_back(next);
+        for (auto [term, f] : constants_[next].terms) {
+            pending_.push_back(term);
+        }
+    }
+    return false;
+}
+
+// Write out the pending run: touched cells in ascending order, with the
+// cell the run started on first and the cell it ends on last. Adds of 0
+// and moves of 0 are dropped, and so are known values. A cell's terms are
+// written as MULs from the cells they read, grouped by the cell read, and
+// each cell is written after every MUL that reads it.
+void Optimizer::flushRun(Region &out) {
+    int tapePosition{};
+    auto moveTo = [&](int off) {
+        if (off != tapePosition) {
+            out.emplace_back(IROpCode::ADP, off - tapePosition);
+            tapePosition = off;
+        }
+    };
+    muls_.clear();
+    if (runMuls_ != 0) {
+        for (auto off : constants_.sortedKeys()) {
+            for (auto [source, factor] : constants_[off].terms) {
+                muls_.emplace_back(source, off, factor);
             }
-            p[codePosition++] = inst;
-        };
-        if (offset != 0 && constants.count(0)) {
-            writeInst(constants[0].genIns());
-        }
-        for (auto [off, fold]: constants) {
-            if (off != 0 && off != offset) {
-                writeInst({IROpCode::ADP, off - tapePosition});
-                writeInst(fold.genIns());
-                tapePosition = off;
+        }
+        std::sort(muls_.begin(), muls_.end());
+    }
+    auto write = [&](auto &self, int off) -> void {
+        if (!constants_.contains(off) || constants_[off].written) {
+            return;
+        }
+        constants_[off].written = true;
+        auto readers = std::make_pair(muls_.end(), muls_.end());
+        if (!muls_.empty()) {
+            readers = std::equal_range(muls_.begin(), muls_.end(), std::tuple{off, 0, 0},
+                                       [](const auto &a, const auto &b) { return std::get<0>(a) < std::get<0>(b); });
+            for (auto it = readers.first; it != readers.second; ++it) {
+                self(self, std::get<1>(*it));
             }
         }
-        if (tapePosition != offset) {
-            writeInst({IROpCode::ADP, offset - tapePosition});
+        const auto &fold = constants_[off];
+        if (readers.first == readers.second && !fold.needsWrite()) {
+            return;
         }
-        if (constants.count(offset)) {
-            writeInst(constants[offset].genIns());
+        moveTo(off);
+        for (auto it = readers.first; it != readers.second; ++it) {
+            out.emplace_back(IROpCode::MUL, std::get<1>(*it) - off, std::get<2>(*it));
         }
-        while (codePosition < end) {
-            writeInst(IROpCode::INVALID);
+        if (fold.needsWrite()) {
+            out.emplace_back(fold.genIns());
         }
     };
-    size_t foldStart = 0;
-    for (size_t pos = 0; pos != prog().size(); ++pos) {
-        auto &ins = prog()[pos];
-        switch (ins.code_) {
-        case IROpCode::ADD: constants[offset].val += ins.a_; break;
-        case IROpCode::ADP: offset += ins.a_; break;
-        case IROpCode::CONST: constants[offset] = {ins.a_, ConstFoldable::Type::Const}; break;
-        default:
-            if (offset != 0 || constants.size()) {
-                finalize(foldStart, pos);
-                offset = {};
-                constants = {};
+    if (runOffset_ != 0) {
+        write(write, 0);
+    }
+    for (auto off : constants_.sortedKeys()) {
+        if (off != runOffset_) {
+            write(write, off);
+        }
+    }
+    write(write, runOffset_);
+    moveTo(runOffset_);
+    constants_.clear();
+    runOffset_ = 0;
+    runMin_ = 0;
+    runMax_ = 0;
+    runMuls_ = 0;
+}
+
+// Replace loops like [->+>++<<] with MUL instructions followed by a CONST 0,
+// which are folded into the current run.
+bool Optimizer::multLoop(const Loop &loop, Region &out) {
+    const auto &summary = loop.summary_;
+    if (summary.hasLoops || summary.hasIO || !summary.deltaKnown || summary.netDelta != 0) {
+        return false;
+    }
+    relativeAdds_.clear();
+    int currOffset{};
+    int origModBy{};
+    for (const auto &ins : loop.body_) {
+        if (ins.code_ == IROpCode::ADD) {
+            if (currOffset == 0) {
+                origModBy += ins.a_;
+            } else {
+                relativeAdds_[currOffset] += ins.a_;
             }
-            foldStart = pos + 1;
-            break;
+        } else if (ins.code_ == IROpCode::ADP) {
+            currOffset += ins.a_;
+        } else if (ins.code_ != IROpCode::INVALID) {
+            return false;
         }
     }
-    finalize(foldStart, prog().size());
-    return sawChange;
+    if (std::abs(origModBy) != 1) {
+        return false;
+    }
+    if (foldMulLoop(origModBy)) {
+        return true;
+    }
+    flushRun(out);
+    if (foldMulLoop(origModBy)) {
+        return true;
+    }
+    /// Only loops that span the whole tape don't fit an empty run. Their
+    /// adds can land on each other or on the loop's cell, so they run as
+    /// written.
+    return false;
+}
+
+// Loops like [>], [[-]>] or [>+>] that move by a fixed stride and only
+// touch cells within a window narrower than the stride
+bool Optimizer::isStridedLoop(const Loop &loop) {
+    const auto &summary = loop.summary_;
+    if (summary.hasLoops || summary.hasIO || !summary.deltaKnown || summary.netDelta == 0 ||
+        summary.maxOffset - summary.minOffset >= std::abs(summary.netDelta)) {
+        return false;
+    }
+    return std::all_of(loop.body_.begin(), loop.body_.end(), [](const Instruction &ins) {
+        return ins.code_ == IROpCode::ADD || ins.code_ == IROpCode::ADP || ins.code_ == IROpCode::CONST;
+    });
 }
 
-bool Optimizer::deadCodeEliminationPass() {
-    auto sawChange{false};
-    auto writePos = prog().begin();
-    for (auto &v : prog()) {
-        if (v.code_ == IROpCode::INVALID) {
-            sawChange = true;
-        } else if ((v.code_ == IROpCode::ADD || v.code_ == IROpCode::ADP) && v.a_ == 0) {
-            sawChange = true;
+bool Optimizer::appendShape(const LoopTree &tree, const Loop &loop, Region &shape, size_t limit) const {
+    /// The loops being appended, with the next instruction in each
+    std::vector<std::pair<const Loop *, size_t>> open{{&loop, 0}};
+    shape.emplace_back(IROpCode::LOOP, 0, loop.strided_, loop.once_);
+    while (!open.empty()) {
+        if (shape.size() > limit) {
+            return false;
+        }
+        auto &[current, next] = open.back();
+        if (next == current->body_.size()) {
+            shape.emplace_back(IROpCode::END_LOOP);
+            open.pop_back();
+            continue;
+        }
+        const auto &ins = current->body_[next++];
+        if (ins.code_ == IROpCode::LOOP) {
+            const auto &inner = tree.loop(ins);
+            shape.emplace_back(IROpCode::LOOP, 0, inner.strided_, inner.once_);
+            open.emplace_back(&inner, 0);
         } else {
-            *(writePos++) = v;
+            shape.push_back(ins);
         }
     }
-    prog().resize(std::distance(prog().begin(), writePos));
-    return sawChange;
+    return shape.size() <= limit;
 }
 
-bool Optimizer::multPass() {
-    std::optional<size_t> loopStartPosition{};
-    std::unordered_map<int, int> relativeAdds;
-    ssize_t currOffset{};
-    int origModBy{};
-    auto sawChange{false};
-    for (size_t i = 0u; i < prog().size(); ++i) {
-        auto &ins = prog()[i];
+// Loops with the shape of one of DIVMOD_IDIOMS or COMPARE_IDIOMS, which get a
+// DIVMOD or CMP in front
+std::optional<Instruction> Optimizer::matchIdiom(const LoopTree &tree, const Loop &loop) {
+    const auto &summary = loop.summary_;
+    if (!summary.hasLoops || summary.hasIO) {
+        return std::nullopt;
+    }
+    shape_.clear();
+    if (!appendShape(tree, loop, shape_, longestIdiom_)) {
+        return std::nullopt;
+    }
+    for (const auto &[shape, op] : idioms_) {
+        if (shape == shape_) {
+            return op;
+        }
+    }
+    return std::nullopt;
+}
+
+bool Optimizer::currentCellKnownZero() {
+    if (!constants_.contains(runOffset_)) {
+        return false;
+    }
+    const auto &fold = constants_[runOffset_];
+    return fold.type != ConstFoldable::Type::Add && fold.val == 0 && fold.terms.empty();
+}
+
+// Loops like [->+<[-]] whose body always leaves the cell it tests at zero, so
+// they are if statements. Offsets are compared modulo the tape length, since
+// a cell can be reached from the other end of the tape.
+bool Optimizer::runsAtMostOnce(const LoopTree &tree, const Loop &loop) const {
+    const auto &summary = loop.summary_;
+    if (!summary.deltaKnown || summary.netDelta != 0) {
+        return false;
+    }
+    auto isTested = [&](ssize_t off) { return wrapOffset(off, tapeLength_) == 0; };
+    bool zeroed = false;
+    int offset{};
+    for (const auto &ins : loop.body_) {
         switch (ins.code_) {
+        case IROpCode::ADP:
+            offset += ins.a_;
+            break;
         case IROpCode::ADD:
-            if (currOffset == 0) {
-                origModBy += ins.a_;
-            } else if (loopStartPosition.has_value()) {
-                relativeAdds[currOffset] += ins.a_;
-            }
+        case IROpCode::IN:
+            zeroed &= !isTested(offset);
             break;
-        case IROpCode::ADP:
-            currOffset += ins.a_;
+        case IROpCode::CONST:
+            if (isTested(offset)) {
+                zeroed = ins.a_ == 0;
+            }
             break;
-        case IROpCode::INVALID:
+        case IROpCode::MUL:
+            zeroed &= !isTested(offset + ins.a_);
             break;
-        case IROpCode::LOOP:
-            loopStartPosition = i;
-            currOffset = 0;
-            origModBy = 0;
-            relativeAdds = {};
+        case IROpCode::DIVMOD:
+        case IROpCode::CMP:
+            for (int cell : idiomCells(ins)) {
+                zeroed &= !isTested(offset + cell);
+            }
             break;
-        case IROpCode::END_LOOP: {
-            if (loopStartPosition.has_value() && std::abs(origModBy) == 1 && currOffset == 0) {
-                sawChange = true;
-                auto writeIndex = *loopStartPosition, end = i + 1;
-                for (auto [x, v] : relativeAdds) {
-                    if (v != 0) {
-                        prog()[writeIndex++] = Instruction{IROpCode::MUL, x, -v * origModBy};
-                    }
-                }
-                prog()[writeIndex++] = Instruction{IROpCode::CONST, 0};
-                for (; writeIndex < end; ++writeIndex) {
-                    prog()[writeIndex] = IROpCode::INVALID;
-                }
+        case IROpCode::LOOP: {
+            // Inner loops don't move the data pointer, or deltaKnown would be false
+            const auto &inner = tree.loop(ins).summary_;
+            if (isTested(offset)) {
+                zeroed = true;
+            } else {
+                const ssize_t first = wrapOffset(offset + inner.minOffset, tapeLength_);
+                zeroed &= first != 0 && first + inner.maxOffset - inner.minOffset < tapeLength_;
             }
-            loopStartPosition = {};
             break;
         }
         default:
-            loopStartPosition = {};
+            break;
         }
     }
-    return sawChange;
-}
-
-bool Optimizer::optimizePass() {
-    // Explicit, to avoid short circuit eval
-    auto sawChange = false;
-    sawChange = constPropagatePass() || sawChange;
-    sawChange = deadCodeEliminationPass() || sawChange;
-    sawChange = multPass() || sawChange;
-    return sawChange;
+    return zeroed;
 }
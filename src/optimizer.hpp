@@ -1,24 +1,178 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdlib>
+#include <optional>
+#include <tuple>
 #include <vector>
 
 #include "arguments.hpp"
 #include "error.hpp"
 #include "ir.hpp"
+#include "loop_tree.hpp"
+
+// Map from tape offsets to T, backed by a flat vector that keeps its storage
+// between uses, so clearing and refilling it doesn't allocate.
+template <typename T> class OffsetMap {
+  public:
+    T &operator[](int offset) {
+        if (offset < base_ || offset >= base_ + (int)present_.size()) {
+            grow(offset);
+        }
+        const size_t index = offset - base_;
+        if (!present_[index]) {
+            present_[index] = true;
+            values_[index] = T{};
+            keys_.push_back(offset);
+        }
+        return values_[index];
+    }
+    bool contains(int offset) const {
+        return offset >= base_ && offset < base_ + (int)present_.size() && present_[offset - base_];
+    }
+    bool empty() const { return keys_.empty(); }
+    // Keys in ascending order
+    const std::vector<int> &sortedKeys() {
+        std::sort(keys_.begin(), keys_.end());
+        return keys_;
+    }
+    void clear() {
+        for (auto key : keys_) {
+            present_[key - base_] = false;
+        }
+        keys_.clear();
+    }
+
+  private:
+    void grow(int offset) {
+        const int low = std::min(offset, base_), high = std::max(offset + 1, base_ + (int)present_.size());
+        const int slack = std::max(16, (high - low) / 2);
+        const int newBase = low - slack;
+        std::vector<T> values(high - low + 2 * slack);
+        std::vector<char> present(values.size(), false);
+        for (auto key : keys_) {
+            values[key - newBase] = values_[key - base_];
+            present[key - newBase] = true;
+        }
+        values_ = std::move(values);
+        present_ = std::move(present);
+        base_ = newBase;
+    }
+    std::vector<T> values_;
+    std::vector<char> present_;
+    std::vector<int> keys_;
+    int base_{};
+};
+
+struct ConstFoldable {
+    int val{};
+    // Known is a value the cell is known to hold already, which needs no instruction
+    enum class Type : int {
+        Add,
+        Const,
+        Known,
+    } type{Type::Add};
+    ConstFoldable() = default;
+    ConstFoldable(int val, Type type) : val{val}, type{type} {}
+    // MULs folded into the cell, as pairs of an offset and a factor: the cell
+    // gains factor times the value the cell at offset had when the run started
+    std::vector<std::pair<int, int>> terms;
+    // The value of a Known cell that has been changed since
+    std::optional<int> start;
+    // Set by flushRun() once the cell is written out
+    bool written{};
+    // Called before changing the cell
+    void change() {
+        if (type == Type::Known) {
+            start = val;
+            type = Type::Const;
+        }
+    }
+    void set(int value) {
+        if (type != Type::Known || val != value) {
+            change();
+            val = value;
+            type = Type::Const;
+            terms.clear();
+        }
+    }
+    // Whether the cell needs an ADD or CONST, apart from its terms
+    bool needsWrite() const {
+        switch (type) {
+        case Type::Add: return val != 0;
+        case Type::Const: return start != val;
+        default: return false;
+        }
+    }
+    Instruction genIns() const {
+        return {
+            type == Type::Add ? IROpCode::ADD : IROpCode::CONST,
+            val
+        };
+    }
+};
 
 class Optimizer {
   public:
     Optimizer() = delete;
     Optimizer(const Arguments &arguments);
-    void optimize(std::vector<Instruction> &program);
+    // atStart is false for code that doesn't start with an all zero tape
+    void optimize(LoopTree &tree, bool atStart = true);
 
   private:
-    std::vector<Instruction> &prog();
-    bool constPropagatePass();
-    bool deadCodeEliminationPass();
-    bool multPass();
-    bool optimizePass();
+    // Optimizes the idioms themselves, so it doesn't look for them
+    Optimizer(const Arguments &arguments, bool matchIdioms);
+    void compileIdioms(const Arguments &arguments);
+    // Append loop, and the loops in it, to shape with the loop numbers left
+    // out. Returns false once shape is longer than limit.
+    bool appendShape(const LoopTree &tree, const Loop &loop, Region &shape, size_t limit) const;
+    std::optional<Instruction> matchIdiom(const LoopTree &tree, const Loop &loop);
+    void optimizeRegion(LoopTree &tree, Region &region);
+    void finishLoop(LoopTree &tree, const Instruction &ins, Region &out);
+    void foldIntoRun(const Instruction &ins, Region &out);
+    bool foldMulLoop(int factor);
+    bool fitsInRun(int offset) const;
+    bool dependsOn(int cell, int offset);
+    void flushRun(Region &out);
+    bool multLoop(const Loop &loop, Region &out);
+    static bool isStridedLoop(const Loop &loop);
+    bool runsAtMostOnce(const LoopTree &tree, const Loop &loop) const;
+    bool currentCellKnownZero();
 
     bool verbose_;
-    std::vector<Instruction> *progPtr_{nullptr};
+    const ssize_t tapeLength_;
+    // The pending run of ADD, ADP and CONST instructions, by offset from the start of the run
+    OffsetMap<ConstFoldable> constants_;
+    int runOffset_{};
+    // The lowest and highest offsets the run touched. They stay less than the
+    // tape length apart, so that different offsets are different cells.
+    int runMin_{};
+    int runMax_{};
+    // MULs folded into the run, which bounds how long it takes to fold another
+    static constexpr int MAX_RUN_MULS = 64;
+    int runMuls_{};
+    // Scratch space for foldMulLoop(), dependsOn() and flushRun()
+    std::vector<std::pair<int, int>> terms_;
+    std::vector<std::pair<int, ConstFoldable>> backup_;
+    std::vector<int> pending_;
+    std::vector<int> visited_;
+    std::vector<std::tuple<int, int, int>> muls_;
+    // Scratch space for multLoop()
+    OffsetMap<int> relativeAdds_;
+    // The shapes of the loops in DIVMOD_IDIOMS and COMPARE_IDIOMS, and the op that
+    // goes before each
+    std::vector<std::pair<Region, Instruction>> idioms_;
+    size_t longestIdiom_{};
+    // Scratch space for matchIdiom()
+    Region shape_;
+    // The regions optimizeRegion() is in, innermost last, with the next
+    // instruction of each, what it has written so far, and the LOOP that
+    // contains it
+    struct OpenRegion {
+        Region *region;
+        size_t next;
+        Region out;
+        const Instruction *loop;
+    };
+    std::vector<OpenRegion> openRegions_;
 };
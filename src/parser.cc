@@ -17,33 +17,55 @@ void Parser::feed(std::istream &is) {
     while (is.good()) {
         Instruction ins;
         is >> ins;
-        switch (ins.code_) {
-        case IROpCode::LOOP:
-            ins.a_ = loopCount_;
-            loopStack_.push(loopCount_);
-            ++loopCount_;
-            break;
-        case IROpCode::END_LOOP:
-            if (loopStack_.size() == 0) {
-                throw JITError("Unexpected ]");
-            }
-            ins.a_ = loopStack_.top();
-            loopStack_.pop();
-            break;
-        default:
-            break;
-        }
-        if (ins.code_ != IROpCode::INVALID) {
-            outStream_.emplace_back(std::move(ins));
+        append(ins);
+    }
+}
+
+bool Parser::feedAvailable(std::istream &is) {
+    checkNotFinished();
+    /// Skipping whitespace would wait for the input after it, so whitespace
+    /// is read as an invalid instruction instead
+    is >> std::noskipws;
+    do {
+        Instruction ins;
+        is >> ins;
+        append(ins);
+    } while (is.good() && is.rdbuf()->in_avail() > 0);
+    return is.good();
+}
+
+LoopTree *Parser::chunk() {
+    checkNotFinished();
+    if (tree_.openLoops() > 0 || tree_.root().empty()) {
+        return nullptr;
+    }
+    return &tree_;
+}
+
+void Parser::append(const Instruction &ins) {
+    switch (ins.code_) {
+    case IROpCode::LOOP:
+        tree_.openLoop();
+        break;
+    case IROpCode::END_LOOP:
+        if (tree_.openLoops() == 0) {
+            throw JITError("Unexpected ]");
         }
+        tree_.closeLoop();
+        break;
+    case IROpCode::INVALID:
+        break;
+    default:
+        tree_.append(ins);
+        break;
     }
 }
 
-std::vector<Instruction> Parser::compile() {
+LoopTree Parser::compile() {
     checkNotFinished();
-    if (loopStack_.size() > 0) {
+    if (tree_.openLoops() > 0) {
         throw JITError("Unmatched [");
     }
     compiled_ = true;
-    return std::move(outStream_);
+    return std::move(tree_);
 }
@@ -1,13 +1,12 @@
 #pragma once
 
 #include <iostream>
-#include <stack>
-#include <vector>
 
 #include "arguments.hpp"
 #include "asmbuf.hpp"
 #include "error.hpp"
 #include "ir.hpp"
+#include "loop_tree.hpp"
 
 class Parser {
   public:
@@ -15,12 +14,19 @@ class Parser {
     explicit Parser(const Arguments &args);
     void checkNotFinished() const;
     void feed(std::istream &is);
-    std::vector<Instruction> compile();
+    LoopTree compile();
+    // Streaming: parse what is has buffered already, only waiting for input
+    // if it has none. Returns false at the end of is.
+    bool feedAvailable(std::istream &is);
+    // Streaming: if no loop is open, the top level code parsed since the last
+    // chunk, as the root of the returned tree. The caller optimizes and lowers
+    // it, then clears the root. Loops keep their numbers across chunks.
+    LoopTree *chunk();
 
   private:
-    std::vector<Instruction> outStream_;
-    std::stack<int> loopStack_;
-    size_t loopCount_{};
+    void append(const Instruction &ins);
+
+    LoopTree tree_;
     bool compiled_{false};
     bool verbose_;
 };
@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "error.hpp"
+#include "profile.hpp"
+
+static constexpr const char *PROFILE_MAGIC = "bf-profile";
+static constexpr int PROFILE_VERSION = 2;
+
+void LoopProfile::recordIteration(size_t dp) {
+    if (iterations == 0) {
+        minDp = maxDp = dp;
+    } else {
+        minDp = std::min(minDp, dp);
+        maxDp = std::max(maxDp, dp);
+    }
+    ++iterations;
+}
+
+void LoopProfile::recordExit(uint64_t trips) {
+    ++entries;
+    ++tripHistogram[bucket(trips)];
+}
+
+double LoopProfile::fractionWithTrips(uint64_t trips) const {
+    if (entries == 0) {
+        return 0;
+    }
+    // Count whole buckets at or above the one trips falls in
+    uint64_t count{};
+    for (size_t b = bucket(trips); b < BUCKETS; ++b) {
+        count += tripHistogram[b];
+    }
+    return (double)count / entries;
+}
+
+Profile::Profile(const std::vector<Instruction> &prog, size_t tapeLength)
+    : programHash_{programHash(prog)}, footprint_{tapeLength, 0, 0} {
+    int loops{};
+    for (const auto &ins : prog) {
+        if (ins.code_ == IROpCode::LOOP || ins.code_ == IROpCode::IF) {
+            loops = std::max(loops, ins.a_ + 1);
+        }
+    }
+    loops_.resize(loops);
+}
+
+uint64_t Profile::programHash(const std::vector<Instruction> &prog) {
+    // FNV-1a over the instruction fields
+    uint64_t hash = 0xcbf29ce484222325;
+    auto mix = [&](uint64_t v) {
+        hash ^= v;
+        hash *= 0x100000001b3;
+    };
+    for (const auto &ins : prog) {
+        mix((uint64_t)ins.code_);
+        mix((uint32_t)ins.a_);
+        mix((uint32_t)ins.b_);
+        mix((uint32_t)ins.c_);
+    }
+    return hash;
+}
+
+const LoopProfile *Profile::find(int loopNumber) const {
+    if (loopNumber < 0 || loopNumber >= (int)loops_.size() || loops_[loopNumber].entries == 0) {
+        return nullptr;
+    }
+    return &loops_[loopNumber];
+}
+
+uint64_t Profile::totalIterations() const {
+    uint64_t total{};
+    for (const auto &loop : loops_) {
+        total += loop.iterations;
+    }
+    return total;
+}
+
+// Format: a "bf-profile VERSION HASH LOOPS" header, a "tape LENGTH MIN_CELL
+// MAX_CELL" line, then a line per entered loop: "NUMBER ENTRIES ITERATIONS
+// MIN_DP MAX_DP" followed by the histogram
+void Profile::save(const std::string &path) const {
+    std::ofstream out(path);
+    out << PROFILE_MAGIC << ' ' << PROFILE_VERSION << ' ' << std::hex << programHash_ << std::dec << ' '
+        << loops_.size() << '\n';
+    out << "tape " << footprint_.tapeLength << ' ' << footprint_.minCell << ' ' << footprint_.maxCell << '\n';
+    for (size_t i = 0; i < loops_.size(); ++i) {
+        const auto &loop = loops_[i];
+        if (loop.entries == 0) {
+            continue;
+        }
+        out << i << ' ' << loop.entries << ' ' << loop.iterations << ' ' << loop.minDp << ' ' << loop.maxDp;
+        for (auto count : loop.tripHistogram) {
+            out << ' ' << count;
+        }
+        out << '\n';
+    }
+    if (!out.good()) {
+        throw JITError("Failed to write profile \"", path, "\"");
+    }
+}
+
+Profile Profile::load(const std::string &path, const std::vector<Instruction> &prog) {
+    std::ifstream in(path);
+    if (!in.good()) {
+        throw JITError("Failed to open profile \"", path, "\"");
+    }
+    std::string magic;
+    int version{};
+    uint64_t hash{};
+    size_t loops{};
+    in >> magic >> version >> std::hex >> hash >> std::dec >> loops;
+    if (!in.good() || magic != PROFILE_MAGIC || version != PROFILE_VERSION) {
+        throw JITError("\"", path, "\" isn't a profile");
+    }
+    Profile profile(prog);
+    if (hash != profile.programHash_ || loops != profile.loops_.size()) {
+        throw JITError("Profile \"", path, "\" was generated for a different program or optimization flags");
+    }
+    std::string line;
+    std::getline(in, line);
+    std::string tape;
+    auto &footprint = profile.footprint_;
+    in >> tape >> footprint.tapeLength >> footprint.minCell >> footprint.maxCell;
+    if (in.fail() || tape != "tape" || footprint.minCell > footprint.maxCell) {
+        throw JITError("Malformed tape footprint in profile \"", path, "\"");
+    }
+    std::getline(in, line);
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        size_t number;
+        LoopProfile loop;
+        fields >> number >> loop.entries >> loop.iterations >> loop.minDp >> loop.maxDp;
+        for (auto &count : loop.tripHistogram) {
+            fields >> count;
+        }
+        if (fields.fail() || number >= loops) {
+            throw JITError("Malformed profile line in \"", path, "\": ", line);
+        }
+        profile.loops_[number] = loop;
+    }
+    return profile;
+}
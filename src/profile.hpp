@@ -0,0 +1,71 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "ir.hpp"
+
+// Execution counts for one loop. An IF counts as a loop that runs at most once.
+struct LoopProfile {
+    // Entries bucketed by trip count: bucket 0 counts entries that skipped
+    // the loop, bucket b > 0 those with 2^(b-1) <= trips < 2^b
+    static constexpr size_t BUCKETS = 34;
+    uint64_t entries{};
+    uint64_t iterations{};
+    std::array<uint64_t, BUCKETS> tripHistogram{};
+    // Range of the data pointer at the start of iterations, valid if iterations > 0
+    size_t minDp{};
+    size_t maxDp{};
+    // Iterations since the loop was last entered, while profiling. It lives
+    // here so that a run that suspends keeps it.
+    uint64_t trips{};
+
+    static size_t bucket(uint64_t trips) { return trips == 0 ? 0 : 64 - __builtin_clzll(trips); }
+    void recordIteration(size_t dp);
+    void recordExit(uint64_t trips);
+    // Fraction of entries that ran at least trips iterations
+    double fractionWithTrips(uint64_t trips) const;
+};
+
+// Cells a run reached on a tape of the given length, relative to the start.
+// Cells in the upper half of the tape count as left of the start.
+struct TapeFootprint {
+    size_t tapeLength{};
+    ssize_t minCell{};
+    ssize_t maxCell{};
+};
+
+// Per loop profile of a run, keyed by the loop numbers the parser assigns,
+// and written as a text file by --profile-generate for --profile-use
+class Profile {
+  public:
+    Profile() = default;
+    explicit Profile(const std::vector<Instruction> &prog, size_t tapeLength = 0);
+    static Profile load(const std::string &path, const std::vector<Instruction> &prog);
+    void save(const std::string &path) const;
+
+    LoopProfile &loop(int loopNumber) { return loops_[loopNumber]; }
+    // Null for loops the profile has no data for
+    const LoopProfile *find(int loopNumber) const;
+    uint64_t totalIterations() const;
+    // Record that the data pointer or a MUL reached cell
+    void touchCell(size_t cell) {
+        const ssize_t relative = cell < footprint_.tapeLength / 2 ? cell : cell - footprint_.tapeLength;
+        footprint_.minCell = std::min(footprint_.minCell, relative);
+        footprint_.maxCell = std::max(footprint_.maxCell, relative);
+    }
+    const TapeFootprint &footprint() const { return footprint_; }
+
+  private:
+    // Identifies the program the profile was taken from, since loop numbers
+    // only mean something for the same source and optimization flags
+    static uint64_t programHash(const std::vector<Instruction> &prog);
+
+    uint64_t programHash_{};
+    std::vector<LoopProfile> loops_;
+    // The run starts at cell 0, so that is always in the footprint
+    TapeFootprint footprint_;
+};
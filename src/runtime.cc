@@ -1,7 +1,9 @@
 #include <cstdio>
 #include <iostream>
 
+#include "async_output.hpp"
 #include "error.hpp"
+#include "fork_server.hpp"
 #include "runtime.hpp"
 
 unsigned int mgetchar_0_on_eof(int) {
@@ -19,6 +21,14 @@ unsigned int mgetchar_nothing_on_eof(int current_cell) {
     return c == EOF ? current_cell : c;
 }
 
+// The real getchar behind mgetchar_fork_server
+static GetCharFunc forkServerGetChar;
+
+unsigned int mgetchar_fork_server(int current_cell) {
+    forkServerRunJobs();
+    return forkServerGetChar(current_cell);
+}
+
 int mputchar(int c) {
     c = putchar(c);
     fflush(stdout);
@@ -27,7 +37,60 @@ int mputchar(int c) {
 
 int mputchar_noflush(int c) { return putchar(c); }
 
-GetCharFunc getCharFunc(const Arguments &args) {
+// The real getchar behind mgetchar_async_output
+static GetCharFunc asyncOutputGetChar;
+
+unsigned int mgetchar_async_output(int current_cell) {
+    /// Prompts show up before the program waits for an answer
+    asyncOutput->flush();
+    return asyncOutputGetChar(current_cell);
+}
+
+int mputchar_async(int c) {
+    asyncOutput->put((char)c);
+    if (c == '\n') {
+        asyncOutput->handOffIfIdle();
+    }
+    return c;
+}
+
+int mputchar_async_noflush(int c) {
+    asyncOutput->put((char)c);
+    return c;
+}
+
+SessionIO *currentSessionIO;
+bool sessionInputStarved;
+
+unsigned int mgetchar_session(int current_cell) {
+    SessionIO &io = *currentSessionIO;
+    if (io.inputPos < io.input.size()) {
+        return (unsigned char)io.input[io.inputPos++];
+    }
+    if (!io.inputClosed) {
+        sessionInputStarved = true;
+        return current_cell;
+    }
+    switch (io.eofBehaviour) {
+    case GetCharBehaviour::EOF_RETURNS_0:
+        return 0;
+    case GetCharBehaviour::EOF_RETURNS_255:
+        return 255;
+    default:
+        return current_cell;
+    }
+}
+
+int mputchar_session(int c) {
+    SessionIO &io = *currentSessionIO;
+    io.output.push_back((char)c);
+    if (io.output.size() >= SessionIO::OUTPUT_LIMIT && io.stop != nullptr) {
+        *io.stop = 1;
+    }
+    return c;
+}
+
+static GetCharFunc eofGetCharFunc(const Arguments &args) {
     switch (args.getCharBehaviour) {
     case GetCharBehaviour::EOF_RETURNS_0:
         return mgetchar_0_on_eof;
@@ -40,7 +103,28 @@ GetCharFunc getCharFunc(const Arguments &args) {
     }
 }
 
+GetCharFunc getCharFunc(const Arguments &args) {
+    if (args.servePort != 0 || args.batch) {
+        return mgetchar_session;
+    }
+    if (!args.forkServerJobs.empty()) {
+        forkServerGetChar = eofGetCharFunc(args);
+        return mgetchar_fork_server;
+    }
+    if (args.asyncOutput && !args.noFlush) {
+        asyncOutputGetChar = eofGetCharFunc(args);
+        return mgetchar_async_output;
+    }
+    return eofGetCharFunc(args);
+}
+
 PutCharFunc putCharFunc(const Arguments &args) {
+    if (args.servePort != 0 || args.batch) {
+        return mputchar_session;
+    }
+    if (args.asyncOutput) {
+        return args.noFlush ? mputchar_async_noflush : mputchar_async;
+    }
     if (args.noFlush) {
         return mputchar_noflush;
     } else {
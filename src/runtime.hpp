@@ -1,5 +1,8 @@
 #pragma once
 
+#include <csignal>
+#include <string>
+
 #include "arguments.hpp"
 
 using GetCharFunc = unsigned int (*)(int);
@@ -9,9 +12,33 @@ extern "C" {
 unsigned int mgetchar_0_on_eof(int);
 unsigned int mgetchar_255_on_eof(int);
 unsigned int mgetchar_nothing_on_eof(int current_cell);
+unsigned int mgetchar_fork_server(int current_cell);
 int mputchar(int c);
 int mputchar_noflush(int c);
+unsigned int mgetchar_session(int current_cell);
+int mputchar_session(int c);
+unsigned int mgetchar_async_output(int current_cell);
+int mputchar_async(int c);
+int mputchar_async_noflush(int c);
 }
 
+// --serve: the IO of the session that is running, see session_server.hpp,
+// or with --batch, of the record that is running (see batch.hpp).
+// Instead of blocking, mgetchar_session sets sessionInputStarved and returns
+// current_cell when the session has no input yet, and the caller then
+// suspends the session to try the IN again once some has arrived.
+struct SessionIO {
+    std::string input;
+    size_t inputPos{};
+    bool inputClosed{};
+    GetCharBehaviour eofBehaviour{};
+    std::string output;
+    // Set when the output grows past OUTPUT_LIMIT, to stop the program until the client catches up
+    volatile sig_atomic_t *stop{};
+    static constexpr size_t OUTPUT_LIMIT = 64 * 1024;
+};
+extern SessionIO *currentSessionIO;
+extern bool sessionInputStarved;
+
 GetCharFunc getCharFunc(const Arguments &args);
 PutCharFunc putCharFunc(const Arguments &args);
@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <sys/time.h>
+#include <ucontext.h>
+
+#include "error.hpp"
+#include "sample_profiler.hpp"
+
+// The profiler the signal handler records into
+static SampleProfiler *activeProfiler;
+
+SampleProfiler::~SampleProfiler() { stop(); }
+
+void SampleProfiler::start(uintptr_t codeBegin) {
+    if (activeProfiler != nullptr) {
+        throw JITError("ICE: Started a second sample profiler");
+    }
+    codeBegin_ = codeBegin;
+    samples_.reset(new uint32_t[MAX_SAMPLES]);
+    activeProfiler = this;
+    struct sigaction action {};
+    action.sa_sigaction = onSignal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &previousAction_)) {
+        activeProfiler = nullptr;
+        throw JITError("Failed to install SIGPROF handler: ", strerror(errno));
+    }
+    running_ = true;
+    const itimerval timer{{0, INTERVAL_US}, {0, INTERVAL_US}};
+    if (setitimer(ITIMER_PROF, &timer, nullptr)) {
+        stop();
+        throw JITError("Failed to start profiling timer: ", strerror(errno));
+    }
+}
+
+void SampleProfiler::stop() {
+    if (!running_) {
+        return;
+    }
+    const itimerval timer{};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    sigaction(SIGPROF, &previousAction_, nullptr);
+    activeProfiler = nullptr;
+    running_ = false;
+}
+
+void SampleProfiler::onSignal(int, siginfo_t *, void *context) {
+    SampleProfiler *self = activeProfiler;
+    if (self == nullptr) {
+        return;
+    }
+    const uintptr_t pc = static_cast<ucontext_t *>(context)->uc_mcontext.gregs[REG_RIP];
+    const uintptr_t offset = pc - self->codeBegin_;
+    if (pc < self->codeBegin_ || offset > UINT32_MAX) {
+        self->elsewhereCount_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    const size_t index = self->sampleCount_.fetch_add(1, std::memory_order_relaxed);
+    if (index < MAX_SAMPLES) {
+        self->samples_[index] = offset;
+    }
+}
+
+void SampleProfiler::report(std::ostream &os, const std::vector<Instruction> &prog, size_t codeLength,
+                            const std::function<std::optional<size_t>(size_t)> &irIndexAt) const {
+    /// Samples per instruction, with the ones in code not generated for an
+    /// instruction (the prelude and epilogue) counted last
+    std::vector<size_t> hits(prog.size() + 1);
+    size_t elsewhere = elsewhereCount_;
+    const size_t kept = std::min<size_t>(sampleCount_, MAX_SAMPLES);
+    for (size_t i = 0; i < kept; ++i) {
+        if (samples_[i] >= codeLength) {
+            ++elsewhere;
+            continue;
+        }
+        ++hits[irIndexAt(samples_[i]).value_or(prog.size())];
+    }
+    const size_t total = kept + elsewhere;
+    os << "Sample profile: " << total << " samples, " << total - elsewhere
+       << " in generated code";
+    if (sampleCount_ > kept) {
+        os << ", " << sampleCount_ - kept << " more not kept";
+    }
+    os << '\n';
+    if (total == 0) {
+        return;
+    }
+    const auto oldFlags = os.flags();
+    const auto oldPrecision = os.precision();
+    os << std::fixed << std::setprecision(1);
+    auto share = [&](size_t count) -> std::ostream & {
+        return os << std::setw(6) << 100.0 * count / total << "% " << std::setw(8) << count << "  ";
+    };
+
+    os << "Hottest instructions:\n";
+    std::vector<size_t> order;
+    for (size_t i = 0; i < prog.size(); ++i) {
+        if (hits[i] > 0) {
+            order.push_back(i);
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return hits[a] > hits[b]; });
+    for (size_t i = 0; i < std::min(order.size(), REPORT_LINES); ++i) {
+        share(hits[order[i]]) << '#' << order[i] << ' ' << prog[order[i]] << '\n';
+    }
+    if (hits[prog.size()] > 0) {
+        share(hits[prog.size()]) << "(prelude and epilogue)\n";
+    }
+    if (elsewhere > 0) {
+        share(elsewhere) << "(outside generated code: IO, runtime and compiler)\n";
+    }
+
+    /// A loop's total counts every instruction from its LOOP to its END_LOOP,
+    /// its self count only the ones not inside a nested loop
+    struct LoopHits {
+        size_t begin;
+        size_t end;
+        size_t total;
+        size_t self;
+    };
+    std::vector<LoopHits> loops;
+    std::vector<size_t> open;
+    for (size_t i = 0; i < prog.size(); ++i) {
+        const auto code = prog[i].code_;
+        if (code == IROpCode::LOOP || code == IROpCode::IF) {
+            open.push_back(loops.size());
+            loops.push_back({i, i, 0, 0});
+        }
+        for (size_t loop : open) {
+            loops[loop].total += hits[i];
+        }
+        if (!open.empty()) {
+            loops[open.back()].self += hits[i];
+        }
+        if ((code == IROpCode::END_LOOP || code == IROpCode::END_IF) && !open.empty()) {
+            loops[open.back()].end = i;
+            open.pop_back();
+        }
+    }
+    loops.erase(std::remove_if(loops.begin(), loops.end(), [](const LoopHits &loop) { return loop.total == 0; }),
+                loops.end());
+    std::stable_sort(loops.begin(), loops.end(),
+                     [](const LoopHits &a, const LoopHits &b) { return a.total > b.total; });
+    os << "Hottest loops (total, then self):\n";
+    for (size_t i = 0; i < std::min(loops.size(), REPORT_LINES); ++i) {
+        const auto &loop = loops[i];
+        share(loop.total) << std::setw(6) << 100.0 * loop.self / total << "%  #" << loop.begin << "-#" << loop.end
+                          << ' ' << prog[loop.begin] << '\n';
+    }
+    os.flags(oldFlags);
+    os.precision(oldPrecision);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <signal.h>
+#include <vector>
+
+#include "ir.hpp"
+
+// Sampling profiler for --sample-profile. A SIGPROF interval timer samples
+// the program counter while the program runs. Samples that hit the generated
+// code are kept as offsets into it, and only mapped back to IR instructions
+// when the report is printed, so taking a sample costs a few stores.
+class SampleProfiler {
+  public:
+    // Sampling period, in microseconds of CPU time
+    static constexpr long INTERVAL_US = 1000;
+    // Samples past this many are only counted, which at INTERVAL_US takes over an hour
+    static constexpr size_t MAX_SAMPLES = 1 << 22;
+    // Lines in each part of the report
+    static constexpr size_t REPORT_LINES = 20;
+
+    SampleProfiler() = default;
+    SampleProfiler(const SampleProfiler &other) = delete;
+    SampleProfiler &operator=(const SampleProfiler &other) = delete;
+    ~SampleProfiler();
+
+    // Start sampling, with program counters taken relative to codeBegin.
+    // Only one profiler can sample at a time.
+    void start(uintptr_t codeBegin);
+    void stop();
+    // Print a flat and a per loop report of where the samples hit. irIndexAt
+    // maps an offset into the generated code to the instruction of prog it
+    // was generated for, or to nullopt for code that isn't for an instruction.
+    void report(std::ostream &os, const std::vector<Instruction> &prog, size_t codeLength,
+                const std::function<std::optional<size_t>(size_t)> &irIndexAt) const;
+
+  private:
+    static void onSignal(int signal, siginfo_t *info, void *context);
+
+    uintptr_t codeBegin_{};
+    // Allocated by start() and left uninitialized, so only pages that get samples are committed
+    std::unique_ptr<uint32_t[]> samples_;
+    std::atomic<size_t> sampleCount_{};
+    // Samples outside the generated code: the runtime, IO, strided loops and lazy compilation
+    std::atomic<size_t> elsewhereCount_{};
+    bool running_{false};
+    struct sigaction previousAction_ {};
+};
@@ -0,0 +1,259 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "error.hpp"
+#include "interpreter.hpp"
+#include "session_server.hpp"
+
+template <typename CellType>
+SessionServer<CellType>::SessionServer(const std::vector<Instruction> &prog, Tape<CellType> &layout,
+                                       const Arguments &args, const Profile *profile)
+    : prog_{prog}, args_{args}, tapeLength_{layout.size()}, stop_{&interpreterStop_} {
+    if (!args.useInterpreter) {
+        codeGenerator_.emplace(layout, args, profile);
+        entry_ = codeGenerator_->compile(prog);
+        stop_ = &codeGenerator_->safepoints().stop;
+    }
+    listenFd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd_ < 0) {
+        throw JITError("Failed to create socket: ", strerror(errno));
+    }
+    const int one = 1;
+    setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(args.servePort);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenFd_, (const sockaddr *)&address, sizeof(address)) || listen(listenFd_, SOMAXCONN)) {
+        throw JITError("Failed to listen on port ", args.servePort, ": ", strerror(errno));
+    }
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd_ < 0) {
+        throw JITError("Failed to create epoll instance: ", strerror(errno));
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = listenFd_;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd_, &event)) {
+        throw JITError("Failed to watch listening socket: ", strerror(errno));
+    }
+}
+
+template <typename CellType> SessionServer<CellType>::~SessionServer() {
+    for (auto &[fd, session] : sessions_) {
+        close(fd);
+    }
+    if (epollFd_ >= 0) {
+        close(epollFd_);
+    }
+    if (listenFd_ >= 0) {
+        close(listenFd_);
+    }
+}
+
+template <typename CellType> void SessionServer<CellType>::run() {
+    if (args_.verbose) {
+        std::cout << "Serving on port " << args_.servePort << std::endl;
+    }
+    watchdog_.start(stop_, 0, SLICE_US);
+    constexpr int MAX_EVENTS = 256;
+    epoll_event events[MAX_EVENTS];
+    while (true) {
+        /// Only block when no session can run
+        const int count = epoll_wait(epollFd_, events, MAX_EVENTS, runnable_.empty() ? -1 : 0);
+        if (count < 0 && errno != EINTR) {
+            throw JITError("Failed to wait for connections: ", strerror(errno));
+        }
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.fd == listenFd_) {
+                acceptConnections();
+                continue;
+            }
+            auto it = sessions_.find(events[i].data.fd);
+            if (it == sessions_.end()) {
+                continue;
+            }
+            Session &session = *it->second;
+            const bool ok = (!(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) || readInput(session)) &&
+                            (!(events[i].events & EPOLLOUT) || writeOutput(session));
+            if (!ok || (events[i].events & EPOLLERR)) {
+                closeSession(session);
+                continue;
+            }
+            if (canContinue(session)) {
+                session.state = SessionState::RUNNABLE;
+                runnable_.push_back(session.fd);
+            } else if (session.state == SessionState::FINISHED && session.io.output.empty()) {
+                closeSession(session);
+            }
+        }
+        if (runnable_.empty()) {
+            continue;
+        }
+        Session &session = *sessions_.at(runnable_.front());
+        runnable_.pop_front();
+        runSlice(session);
+        /// A session that read all the input it was allowed to has room for
+        /// more now. What it reads may be all the client sends, so no edge
+        /// will come to wake it up for that.
+        const bool ok =
+            (session.io.input.size() < INPUT_LIMIT || session.io.inputClosed || readInput(session)) &&
+            writeOutput(session);
+        if (!ok || (session.state == SessionState::FINISHED && session.io.output.empty())) {
+            closeSession(session);
+        } else if (session.state == SessionState::RUNNABLE || canContinue(session)) {
+            session.state = SessionState::RUNNABLE;
+            runnable_.push_back(session.fd);
+        }
+    }
+}
+
+template <typename CellType> void SessionServer<CellType>::acceptConnections() {
+    while (true) {
+        const int fd = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /// Out of descriptors or similar: leave the rest in the backlog
+            if (errno != EAGAIN && errno != EWOULDBLOCK && args_.verbose) {
+                std::cerr << "Failed to accept connection: " << strerror(errno) << '\n';
+            }
+            return;
+        }
+        /// Sessions are interactive, so don't hold back small writes
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        auto session = std::make_unique<Session>(fd, tapeLength_, args_.hugePages);
+        session->io.eofBehaviour = args_.getCharBehaviour;
+        session->io.stop = stop_;
+        session->fuel = args_.fuel > 0 ? args_.fuel : SafepointState{}.fuel;
+        if (args_.timeLimit > 0) {
+            session->deadline = std::chrono::steady_clock::now() +
+                                std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                    std::chrono::duration<double>(args_.timeLimit));
+        }
+        /// Edge triggered, since the connection is always read and written
+        /// until the kernel has nothing more, or there is enough for now
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = fd;
+        if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event)) {
+            close(fd);
+            continue;
+        }
+        sessions_.emplace(fd, std::move(session));
+        runnable_.push_back(fd);
+    }
+}
+
+template <typename CellType> bool SessionServer<CellType>::readInput(Session &session) {
+    auto &io = session.io;
+    io.input.erase(0, io.inputPos);
+    io.inputPos = 0;
+    char buffer[4096];
+    while (io.input.size() < INPUT_LIMIT && !io.inputClosed) {
+        const ssize_t n = read(session.fd, buffer, std::min(sizeof(buffer), INPUT_LIMIT - io.input.size()));
+        if (n > 0) {
+            io.input.append(buffer, n);
+        } else if (n == 0) {
+            io.inputClosed = true;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename CellType> bool SessionServer<CellType>::writeOutput(Session &session) {
+    auto &output = session.io.output;
+    size_t written = 0;
+    bool ok = true;
+    while (written < output.size()) {
+        const ssize_t n = send(session.fd, output.data() + written, output.size() - written, MSG_NOSIGNAL);
+        if (n >= 0) {
+            written += n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            ok = false;
+            break;
+        }
+    }
+    output.erase(0, written);
+    return ok;
+}
+
+template <typename CellType> bool SessionServer<CellType>::canContinue(const Session &session) const {
+    const auto &io = session.io;
+    return (session.state == SessionState::WAITING_FOR_INPUT && (io.inputPos < io.input.size() || io.inputClosed)) ||
+           (session.state == SessionState::WAITING_FOR_OUTPUT && io.output.size() < SessionIO::OUTPUT_LIMIT);
+}
+
+template <typename CellType> void SessionServer<CellType>::runSlice(Session &session) {
+    currentSessionIO = &session.io;
+    sessionInputStarved = false;
+    *stop_ = 0;
+    bool stopped;
+    if (codeGenerator_) {
+        auto &safepoints = codeGenerator_->safepoints();
+        safepoints.tape = (uintptr_t)session.tape.data();
+        safepoints.fuel = session.fuel;
+        if (!session.started) {
+            session.started = true;
+            session.dp = codeGenerator_->enter(entry_);
+        } else {
+            safepoints.dp = session.dp;
+            safepoints.stoppedAt = session.stoppedAt;
+            session.dp = codeGenerator_->resume();
+        }
+        session.fuel = safepoints.fuel;
+        session.stoppedAt = safepoints.stoppedAt;
+        stopped = codeGenerator_->stopped();
+    } else {
+        session.dp = interpretSuspendable(prog_, session.tape, args_, session.pc, session.dp, interpreterStop_,
+                                          session.fuel);
+        stopped = session.pc < prog_.size();
+    }
+    currentSessionIO = nullptr;
+    if (!stopped) {
+        session.state = SessionState::FINISHED;
+    } else if (sessionInputStarved) {
+        session.state = SessionState::WAITING_FOR_INPUT;
+    } else if (session.io.output.size() >= SessionIO::OUTPUT_LIMIT) {
+        session.state = SessionState::WAITING_FOR_OUTPUT;
+    } else if (*stop_ && std::chrono::steady_clock::now() < session.deadline) {
+        session.state = SessionState::RUNNABLE;
+    } else if (*stop_) {
+        if (args_.verbose) {
+            std::cerr << "Session on connection " << session.fd << " exceeded the time limit\n";
+        }
+        session.state = SessionState::FINISHED;
+    } else {
+        if (args_.verbose) {
+            std::cerr << "Session on connection " << session.fd << " ran out of fuel\n";
+        }
+        session.state = SessionState::FINISHED;
+    }
+}
+
+template <typename CellType> void SessionServer<CellType>::closeSession(Session &session) {
+    const int fd = session.fd;
+    runnable_.erase(std::remove(runnable_.begin(), runnable_.end(), fd), runnable_.end());
+    close(fd);
+    sessions_.erase(fd);
+}
+
+template class SessionServer<char>;
+template class SessionServer<short>;
+template class SessionServer<int>;
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <chrono>
+#include <csignal>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "arguments.hpp"
+#include "code_generator.hpp"
+#include "ir.hpp"
+#include "profile.hpp"
+#include "runtime.hpp"
+#include "tape.hpp"
+#include "watchdog.hpp"
+
+// --serve: run a session of the program for every connection to a TCP port
+// on localhost, all of them on one thread. Each session has its own tape,
+// and its connection for input and output. Rather than block, a session that
+// runs out of input, or whose client falls behind on its output, suspends
+// (see SessionIO) until epoll says that its connection is ready again. The
+// watchdog stops the running session every SLICE_US, so that one busy
+// session doesn't hold up the others. Compiled sessions share the code, and
+// the interpreter runs them with interpretSuspendable(). --fuel and
+// --time-limit apply to each session, which is closed once it runs out.
+template <typename CellType> class SessionServer {
+  public:
+    // Time a session runs before the next one gets its turn, in microseconds
+    static constexpr long SLICE_US = 10 * 1000;
+    // Unread input a session keeps before leaving the rest with the kernel
+    static constexpr size_t INPUT_LIMIT = 64 * 1024;
+
+    // layout is only used for its length, since each session brings its own tape
+    SessionServer(const std::vector<Instruction> &prog, Tape<CellType> &layout, const Arguments &args,
+                  const Profile *profile);
+    SessionServer(const SessionServer &other) = delete;
+    SessionServer &operator=(const SessionServer &other) = delete;
+    ~SessionServer();
+    // Serve connections until the process is killed
+    void run();
+
+  private:
+    enum class SessionState { RUNNABLE, WAITING_FOR_INPUT, WAITING_FOR_OUTPUT, FINISHED };
+    struct Session {
+        Session(int fd, size_t tapeLength, bool hugePages) : fd{fd}, tape{tapeLength, hugePages} {}
+        int fd;
+        Tape<CellType> tape;
+        SessionIO io;
+        SessionState state{SessionState::RUNNABLE};
+        size_t dp{};
+        // Where the compiled code continues, once it has started
+        bool started{};
+        uint32_t stoppedAt{SafepointState::NOT_STOPPED};
+        uint64_t fuel{};
+        std::chrono::steady_clock::time_point deadline{std::chrono::steady_clock::time_point::max()};
+        // Where the interpreter continues
+        size_t pc{};
+    };
+    void acceptConnections();
+    // Read what the connection has, up to INPUT_LIMIT. Returns false if it failed.
+    bool readInput(Session &session);
+    // Write what the connection takes. Returns false if it failed.
+    bool writeOutput(Session &session);
+    // Whether a waiting session has what it was waiting for
+    bool canContinue(const Session &session) const;
+    void runSlice(Session &session);
+    void closeSession(Session &session);
+
+    const std::vector<Instruction> &prog_;
+    const Arguments &args_;
+    const size_t tapeLength_;
+    std::optional<CodeGenerator<CellType>> codeGenerator_;
+    ASMBufOffset entry_{};
+    volatile sig_atomic_t interpreterStop_{};
+    volatile sig_atomic_t *stop_;
+    Watchdog watchdog_;
+    int listenFd_{-1};
+    int epollFd_{-1};
+    std::unordered_map<int, std::unique_ptr<Session>> sessions_;
+    // Connections of the sessions waiting for their turn
+    std::deque<int> runnable_;
+};
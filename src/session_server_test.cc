@@ -0,0 +1,163 @@
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "arguments.hpp"
+#include "error.hpp"
+#include "optimizer.hpp"
+#include "parser.hpp"
+#include "session_server.hpp"
+#include "tape.hpp"
+
+// make test: runs --serve sessions in a child process and talks to them over
+// loopback, like a client would. Each case sends its input in one burst,
+// then reads until the server closes the connection, and compares what came
+// back.
+
+struct SessionCase {
+    const char *name;
+    const char *source;
+    std::vector<std::string> options;
+    std::string input;
+    std::string expected;
+    // How long the session may take before the case fails
+    double seconds;
+};
+
+// Serve source with options on port, in a child that runs until it is killed
+static pid_t startServer(const SessionCase &test, int port) {
+    const pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+    std::vector<std::string> words{"session_server_test", "--serve", std::to_string(port)};
+    words.insert(words.end(), test.options.begin(), test.options.end());
+    words.emplace_back("-");
+    std::vector<char *> argv;
+    for (auto &word : words) {
+        argv.push_back(word.data());
+    }
+    try {
+        Arguments args((int)argv.size(), argv.data());
+        Parser parser(args);
+        std::istringstream in(test.source);
+        parser.feed(in);
+        auto tree = parser.compile();
+        Optimizer(args).optimize(tree);
+        const auto prog = tree.lower();
+        Tape<char> layout(args.bfMemLength, false);
+        SessionServer<char> server(prog, layout, args, nullptr);
+        server.run();
+    } catch (JITError &e) {
+        std::printf("server: %s\n", e.what());
+    }
+    _exit(1);
+}
+
+static int connectTo(int port) {
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    /// The server may still be compiling
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        const int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (const sockaddr *)&address, sizeof(address)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(20 * 1000);
+    }
+    return -1;
+}
+
+// Send input, then read what comes back until the server closes the
+// connection. Returns false if that takes longer than seconds.
+static bool exchange(int fd, const std::string &input, std::string &output, double seconds) {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+    size_t sent = 0;
+    if (input.empty()) {
+        shutdown(fd, SHUT_WR);
+    }
+    while (std::chrono::steady_clock::now() < deadline) {
+        pollfd poller{fd, (short)(POLLIN | (sent < input.size() ? POLLOUT : 0)), 0};
+        if (poll(&poller, 1, 100) <= 0) {
+            continue;
+        }
+        if ((poller.revents & POLLOUT) && sent < input.size()) {
+            const ssize_t n = send(fd, input.data() + sent, input.size() - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n > 0 && (sent += n) == input.size()) {
+                shutdown(fd, SHUT_WR);
+            }
+        }
+        if (poller.revents & (POLLIN | POLLHUP | POLLERR)) {
+            char buffer[65536];
+            const ssize_t n = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                return true;
+            }
+            if (n > 0) {
+                output.append(buffer, n);
+            }
+        }
+    }
+    return false;
+}
+
+static bool runCase(const SessionCase &test, int port) {
+    const pid_t server = startServer(test, port);
+    const int fd = connectTo(port);
+    std::string output;
+    const bool closed = fd >= 0 && exchange(fd, test.input, output, test.seconds);
+    if (fd >= 0) {
+        close(fd);
+    }
+    kill(server, SIGKILL);
+    waitpid(server, nullptr, 0);
+    if (fd < 0) {
+        std::printf("FAIL %s: couldn't connect\n", test.name);
+        return false;
+    }
+    if (!closed) {
+        std::printf("FAIL %s: still open after %g seconds, with %zu bytes of output\n", test.name, test.seconds,
+                    output.size());
+        return false;
+    }
+    if (output != test.expected) {
+        std::printf("FAIL %s: expected %zu bytes of output, got %zu\n", test.name, test.expected.size(),
+                    output.size());
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    /// More than SessionServer::INPUT_LIMIT, so the session has to come back
+    /// for the rest after it has read as much as it is allowed to
+    std::string burst(200000, 0);
+    for (size_t i = 0; i < burst.size(); ++i) {
+        burst[i] = 'a' + i % 26;
+    }
+    const std::vector<SessionCase> cases{
+        {"echo a burst", ",[.,]", {}, burst, burst, 10},
+        {"echo a burst, interpreted", ",[.,]", {"--use-interpreter"}, burst, burst, 10},
+        {"time limit", "+[]", {"--time-limit", "1"}, "", "", 5},
+        {"time limit, interpreted", "+[]", {"--time-limit", "1", "--use-interpreter"}, "", "", 5},
+    };
+    const int basePort = 20000 + getpid() % 20000;
+    int failures = 0;
+    for (size_t i = 0; i < cases.size(); ++i) {
+        failures += !runCase(cases[i], basePort + (int)i);
+    }
+    std::printf("%d of %zu sessions failed\n", failures, cases.size());
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <cstdint>
+#include <emmintrin.h>
+#include <type_traits>
+
+#include "error.hpp"
+#include "strided_loop.hpp"
+
+StridedLoop::StridedLoop(const std::vector<Instruction> &prog, size_t loopStart, size_t tapeLength)
+    : tapeLength{tapeLength} {
+    for (size_t i = loopStart + 1; prog[i].code_ != IROpCode::END_LOOP; ++i) {
+        const auto &ins = prog[i];
+        switch (ins.code_) {
+        case IROpCode::ADP:
+            stride += ins.a_;
+            break;
+        case IROpCode::ADD:
+        case IROpCode::CONST:
+            ops.push_back({stride, ins.code_ == IROpCode::CONST, ins.a_});
+            minOffset = std::min(minOffset, stride);
+            maxOffset = std::max(maxOffset, stride);
+            break;
+        default:
+            throw JITError("ICE: Unexpected ", ins.code_, " in strided loop");
+        }
+    }
+    if (stride == 0 || maxOffset - minOffset >= std::abs(stride)) {
+        throw JITError("ICE: Loop at instruction ", loopStart, " isn't strided");
+    }
+}
+
+// SSE2 only has fixed width compares and adds, so pick them by cell size
+template <typename CellType> static __m128i cmpEqZero(__m128i v) {
+    if constexpr (sizeof(CellType) == 1) {
+        return _mm_cmpeq_epi8(v, _mm_setzero_si128());
+    } else if constexpr (sizeof(CellType) == 2) {
+        return _mm_cmpeq_epi16(v, _mm_setzero_si128());
+    } else {
+        return _mm_cmpeq_epi32(v, _mm_setzero_si128());
+    }
+}
+
+template <typename CellType> static __m128i addCells(__m128i v, int value) {
+    if constexpr (sizeof(CellType) == 1) {
+        return _mm_add_epi8(v, _mm_set1_epi8(value));
+    } else if constexpr (sizeof(CellType) == 2) {
+        return _mm_add_epi16(v, _mm_set1_epi16(value));
+    } else {
+        return _mm_add_epi32(v, _mm_set1_epi32(value));
+    }
+}
+
+// Index of the first of count iterations whose cell is zero, or count if
+// there is none. Strides of up to a vector's worth of cells test every
+// iteration in a vector at once.
+template <typename CellType>
+static size_t findZero(const CellType *tape, ptrdiff_t dp, ptrdiff_t stride, size_t count, ptrdiff_t len) {
+    constexpr ptrdiff_t LANES = 16 / sizeof(CellType);
+    const ptrdiff_t step = std::abs(stride);
+    size_t k = 0;
+    if (step <= LANES) {
+        // Moving up, the iterations in a vector are lanes 0, step, 2*step...,
+        // moving down they are lanes LANES-1, LANES-1-step...
+        const size_t perVector = (LANES + step - 1) / step;
+        uint32_t pattern = 0;
+        for (size_t j = 0; j < perVector; ++j) {
+            const ptrdiff_t lane = stride > 0 ? j * step : LANES - 1 - j * step;
+            pattern |= 1u << (lane * sizeof(CellType));
+        }
+        for (; k + perVector <= count; k += perVector) {
+            const ptrdiff_t pos = dp + (ptrdiff_t)k * stride;
+            const ptrdiff_t chunk = stride > 0 ? pos : pos - (LANES - 1);
+            if (chunk < 0 || chunk + LANES > len) {
+                break;
+            }
+            const __m128i cells = _mm_loadu_si128(reinterpret_cast<const __m128i *>(tape + chunk));
+            const uint32_t mask = _mm_movemask_epi8(cmpEqZero<CellType>(cells)) & pattern;
+            if (mask != 0) {
+                if (stride > 0) {
+                    return k + __builtin_ctz(mask) / sizeof(CellType) / step;
+                }
+                return k + (LANES - 1 - (31 - __builtin_clz(mask)) / (ptrdiff_t)sizeof(CellType)) / step;
+            }
+        }
+    }
+    for (; k < count; ++k) {
+        if (tape[dp + (ptrdiff_t)k * stride] == 0) {
+            return k;
+        }
+    }
+    return count;
+}
+
+template <typename CellType>
+static void applyOp(CellType *tape, ptrdiff_t first, ptrdiff_t stride, size_t count, const StridedLoop::Op &op) {
+    using UCell = std::make_unsigned_t<CellType>;
+    constexpr size_t LANES = 16 / sizeof(CellType);
+    UCell *cells = reinterpret_cast<UCell *>(tape);
+    if (stride != 1 && stride != -1) {
+        for (size_t i = 0; i < count; ++i) {
+            UCell &cell = cells[first + (ptrdiff_t)i * stride];
+            cell = op.isConst ? (UCell)op.value : (UCell)(cell + op.value);
+        }
+        return;
+    }
+    UCell *start = cells + (stride == 1 ? first : first - (ptrdiff_t)count + 1);
+    if (op.isConst) {
+        std::fill(start, start + count, (UCell)op.value);
+        return;
+    }
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        auto *chunk = reinterpret_cast<__m128i *>(start + i);
+        _mm_storeu_si128(chunk, addCells<CellType>(_mm_loadu_si128(chunk), op.value));
+    }
+    for (; i < count; ++i) {
+        start[i] += op.value;
+    }
+}
+
+template <typename CellType> size_t runStridedLoop(CellType *tape, size_t dp, const StridedLoop *loop) {
+    const ptrdiff_t pos = dp, stride = loop->stride, len = loop->tapeLength;
+    // Number of iterations whose window fits on the tape without wrapping
+    size_t count = 0;
+    if (pos + loop->minOffset >= 0 && pos + loop->maxOffset < len) {
+        count = stride > 0 ? (len - 1 - loop->maxOffset - pos) / stride + 1 : (pos + loop->minOffset) / -stride + 1;
+    }
+    const size_t iterations = findZero(tape, pos, stride, count, len);
+    for (const auto &op : loop->ops) {
+        applyOp(tape, pos + op.offset, stride, iterations, op);
+    }
+    return wrapOffset(pos + (ptrdiff_t)iterations * stride, len);
+}
+
+template size_t runStridedLoop(char *tape, size_t dp, const StridedLoop *loop);
+template size_t runStridedLoop(short *tape, size_t dp, const StridedLoop *loop);
+template size_t runStridedLoop(int *tape, size_t dp, const StridedLoop *loop);
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "ir.hpp"
+
+// A loop whose body moves the data pointer by a fixed stride and applies a
+// fixed transform to a window of cells narrower than the stride. No
+// iteration touches a cell that another one tests, so the loop is the same
+// as finding the first iteration whose cell is zero and then applying the
+// transform to the windows of all the iterations before it.
+struct StridedLoop {
+    struct Op {
+        int offset;
+        bool isConst;
+        int value;
+    };
+    int stride{};
+    int minOffset{};
+    int maxOffset{};
+    size_t tapeLength;
+    std::vector<Op> ops;
+    // Describe the loop starting at prog[loopStart], which the optimizer marked as strided
+    StridedLoop(const std::vector<Instruction> &prog, size_t loopStart, size_t tapeLength);
+};
+
+// Run the iterations of the loop whose windows fit on the tape without
+// wrapping, stopping at the first one whose cell is zero. Returns the new
+// data pointer, whose cell is only nonzero if the loop reached the edge of
+// the tape, in which case the caller continues with the scalar loop.
+template <typename CellType> size_t runStridedLoop(CellType *tape, size_t dp, const StridedLoop *loop);
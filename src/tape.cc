@@ -0,0 +1,44 @@
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+#include "error.hpp"
+#include "tape.hpp"
+
+template <typename CellType>
+Tape<CellType>::Tape(size_t length, bool hugePages) : length_{length}, mappedBytes_{length * sizeof(CellType)} {
+    void *mapping = mmap(nullptr, mappedBytes_, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) {
+        throw JITError("Failed to mmap tape: ", strerror(errno));
+    }
+    data_ = static_cast<CellType *>(mapping);
+    if (hugePages && madvise(mapping, mappedBytes_, MADV_HUGEPAGE)) {
+        // Transparent huge pages may be disabled on this system, which isn't fatal
+        std::cerr << "Warning: Failed to enable huge pages for tape: " << strerror(errno) << '\n';
+    }
+}
+
+template <typename CellType> Tape<CellType>::~Tape() {
+    // Not checking munmap because we are discarding, and this is a destructor
+    munmap(data_, mappedBytes_);
+}
+
+template <typename CellType> size_t Tape<CellType>::residentBytes() const {
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    const size_t numPages = (mappedBytes_ + pageSize - 1) / pageSize;
+    std::vector<unsigned char> residency(numPages);
+    if (mincore(data_, mappedBytes_, residency.data())) {
+        throw JITError("Failed to query tape residency: ", strerror(errno));
+    }
+    size_t residentPages = 0;
+    for (auto page : residency) {
+        residentPages += page & 1;
+    }
+    return residentPages * pageSize;
+}
+
+template class Tape<char>;
+template class Tape<short>;
+template class Tape<int>;
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+
+// The brainfuck memory array. It is mapped with MAP_NORESERVE, so pages are
+// only committed (and zeroed by the kernel) when the program first touches them.
+template <typename CellType> class Tape {
+  public:
+    Tape(size_t length, bool hugePages);
+    Tape(const Tape &other) = delete;
+    Tape &operator=(const Tape &other) = delete;
+    ~Tape();
+
+    CellType *data() { return data_; }
+    const CellType *data() const { return data_; }
+    size_t size() const { return length_; }
+    CellType &operator[](size_t i) { return data_[i]; }
+    const CellType &operator[](size_t i) const { return data_[i]; }
+    // Number of bytes of the tape that are backed by physical memory
+    size_t residentBytes() const;
+
+  private:
+    size_t length_;
+    size_t mappedBytes_;
+    CellType *data_;
+};
@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <iostream>
+#include <optional>
+
+#include "idioms.hpp"
+#include "tape_sizing.hpp"
+
+// Smallest tape that is worth picking, since a smaller one saves nothing
+static constexpr size_t MIN_AUTO_TAPE_LENGTH = 4096;
+// --dump-mem shows this many cells, which cells left of the start must stay clear of
+static constexpr size_t DUMPED_CELLS = 32;
+
+struct CellRange {
+    ssize_t min{};
+    ssize_t max{};
+};
+
+// Offsets from the starting cell that prog addresses, walking loop bodies
+// once. Every offset is exact if each loop leaves the data pointer where it
+// started (balanced is set then); otherwise offsets after an unbalanced loop
+// are only relative to that loop's start.
+static CellRange addressedOffsets(const std::vector<Instruction> &prog, bool &balanced) {
+    CellRange range;
+    balanced = true;
+    ssize_t offset{};
+    std::vector<ssize_t> loopStarts;
+    auto touch = [&](ssize_t off) {
+        range.min = std::min(range.min, off);
+        range.max = std::max(range.max, off);
+    };
+    for (const auto &ins : prog) {
+        switch (ins.code_) {
+        case IROpCode::ADP:
+            offset += ins.a_;
+            break;
+        case IROpCode::MUL:
+            touch(offset);
+            touch(offset + ins.a_);
+            break;
+        case IROpCode::DIVMOD:
+        case IROpCode::CMP:
+            for (int cell : idiomCells(ins)) {
+                touch(offset + cell);
+            }
+            break;
+        case IROpCode::LOOP:
+        case IROpCode::IF:
+            touch(offset);
+            loopStarts.push_back(offset);
+            break;
+        case IROpCode::END_LOOP:
+        case IROpCode::END_IF:
+            touch(offset);
+            balanced &= offset == loopStarts.back();
+            offset = loopStarts.back();
+            loopStarts.pop_back();
+            break;
+        default:
+            touch(offset);
+            break;
+        }
+    }
+    return range;
+}
+
+static size_t roundUpToPow2(size_t n) {
+    size_t pow2 = 1;
+    while (pow2 < n) {
+        pow2 *= 2;
+    }
+    return pow2;
+}
+
+size_t autoTapeLength(const std::vector<Instruction> &prog, const Profile *profile, size_t defaultLength,
+                      bool verbose) {
+    bool balanced;
+    const CellRange offsets = addressedOffsets(prog, balanced);
+    /// The optimizer compared offsets as cells of a tape of defaultLength,
+    /// which gives the same answers on any tape longer than their distance
+    const size_t maxOffset = std::max(-offsets.min, offsets.max);
+    size_t needed = 2 * maxOffset + 1;
+    if (!balanced) {
+        /// A profiled run only shows how far one input went. Another input
+        /// that goes further would wrap at a different cell on a smaller
+        /// tape, and behave differently, so the profile doesn't shrink it.
+        if (verbose) {
+            std::cout << "Tape size: can't bound the data pointer, keeping " << defaultLength << " cells";
+            if (profile != nullptr && profile->footprint().tapeLength == defaultLength) {
+                const auto &footprint = profile->footprint();
+                std::cout << " (the profiled run reached " << footprint.maxCell - footprint.minCell + 1
+                          << " of them)";
+            }
+            std::cout << '\n';
+        }
+        return defaultLength;
+    }
+    /// Cells left of the start wrap to the end of the tape, which must keep
+    /// them apart from the cells right of it and from the dumped ones
+    needed = std::max(needed, (size_t)(offsets.max - offsets.min + 1) + DUMPED_CELLS);
+    const size_t length = std::max(MIN_AUTO_TAPE_LENGTH, roundUpToPow2(needed));
+    if (length >= defaultLength) {
+        if (verbose) {
+            std::cout << "Tape size: the program needs " << needed << " cells, keeping " << defaultLength
+                      << '\n';
+        }
+        return defaultLength;
+    }
+    if (verbose) {
+        std::cout << "Tape size: " << length << " cells\n";
+    }
+    return length;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "ir.hpp"
+#include "profile.hpp"
+
+// --mem-size=auto: pick the smallest power of two tape that prog behaves the
+// same on as on a tape of defaultLength cells, so the data pointer wraps
+// with a mask and the tape stays in cache. The range of cells prog touches
+// comes from static analysis, which bounds it if every loop returns the data
+// pointer to where it started; otherwise the tape keeps defaultLength cells.
+// The footprint in profile, if there is one, is only reported with verbose.
+// prog must have been optimized for a tape of defaultLength cells.
+size_t autoTapeLength(const std::vector<Instruction> &prog, const Profile *profile, size_t defaultLength,
+                      bool verbose);
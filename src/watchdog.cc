@@ -0,0 +1,57 @@
+#include <cstring>
+#include <sys/time.h>
+
+#include "error.hpp"
+#include "watchdog.hpp"
+
+// The flag the signal handler sets, and how often it does
+static volatile sig_atomic_t *activeStopFlag;
+static itimerval activeTimer;
+
+Watchdog::~Watchdog() { stop(); }
+
+void Watchdog::start(volatile sig_atomic_t *stop, double seconds, long sliceUs) {
+    if (activeStopFlag != nullptr) {
+        throw JITError("ICE: Started a second watchdog");
+    }
+    if (seconds > 0) {
+        deadline_ = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                           std::chrono::duration<double>(seconds));
+    }
+    activeStopFlag = stop;
+    struct sigaction action {};
+    action.sa_handler = onSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGALRM, &action, &previousAction_)) {
+        activeStopFlag = nullptr;
+        throw JITError("Failed to install SIGALRM handler: ", strerror(errno));
+    }
+    running_ = true;
+    activeTimer = {{sliceUs / 1000000, sliceUs % 1000000}, {sliceUs / 1000000, sliceUs % 1000000}};
+    if (setitimer(ITIMER_REAL, &activeTimer, nullptr)) {
+        this->stop();
+        throw JITError("Failed to start time limit timer: ", strerror(errno));
+    }
+}
+
+void Watchdog::stop() {
+    if (!running_) {
+        return;
+    }
+    const itimerval timer{};
+    setitimer(ITIMER_REAL, &timer, nullptr);
+    sigaction(SIGALRM, &previousAction_, nullptr);
+    activeStopFlag = nullptr;
+    running_ = false;
+}
+
+bool Watchdog::restartAfterFork() {
+    return activeStopFlag == nullptr || setitimer(ITIMER_REAL, &activeTimer, nullptr) == 0;
+}
+
+void Watchdog::onSignal(int) {
+    if (activeStopFlag != nullptr) {
+        *activeStopFlag = 1;
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <chrono>
+#include <signal.h>
+
+// Wall clock limit for --time-limit, and time slices for --serve. A SIGALRM
+// interval timer sets the stop flag of the generated code every slice, which
+// makes the program hand control back at its next safepoint. The engine then
+// checks expired(), and either kills the program or clears the flag and
+// resumes it, and the session server switches to another session.
+class Watchdog {
+  public:
+    // Default time between two requests to stop, in microseconds
+    static constexpr long SLICE_US = 100 * 1000;
+
+    Watchdog() = default;
+    Watchdog(const Watchdog &other) = delete;
+    Watchdog &operator=(const Watchdog &other) = delete;
+    ~Watchdog();
+
+    // Start setting *stop every sliceUs, with the limit seconds from now, or
+    // none if seconds is 0. Only one watchdog can run at a time.
+    void start(volatile sig_atomic_t *stop, double seconds, long sliceUs = SLICE_US);
+    void stop();
+    // Start the running watchdog's timer again in a child, which fork()
+    // doesn't pass its interval timers on to. The deadline stays the same.
+    // Returns false if the timer couldn't be started.
+    static bool restartAfterFork();
+    bool expired() const { return std::chrono::steady_clock::now() >= deadline_; }
+
+  private:
+    static void onSignal(int signal);
+
+    std::chrono::steady_clock::time_point deadline_{std::chrono::steady_clock::time_point::max()};
+    bool running_{false};
+    struct sigaction previousAction_ {};
+};